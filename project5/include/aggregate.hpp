@@ -0,0 +1,57 @@
+#ifndef __AGGREGATE_H__
+#define __AGGREGATE_H__
+
+#include "bpt.hpp"
+
+// Parts of a range aggregate to compute
+#define AGGREGATE_COUNT 0x1
+#define AGGREGATE_MIN 0x2
+#define AGGREGATE_MAX 0x4
+#define AGGREGATE_SUM 0x8
+#define AGGREGATE_ALL (AGGREGATE_COUNT | AGGREGATE_MIN | AGGREGATE_MAX | AGGREGATE_SUM)
+
+// Aggregate of the keys of a range
+// min_key and max_key are valid only if count is not 0, and count, like the other
+// parts not asked for, may cover only part of the range.
+// sum wraps around like int64_t additions that overflow.
+struct KeyAggregate{
+    uint64_t count;
+    keyval_t min_key;
+    keyval_t max_key;
+    int64_t sum;
+};
+
+/*
+ * Aggregates over key ranges
+ *
+ * The aggregate is taken inside the leaf walk, without copying records out.
+ * Keys in a leaf are sorted, so a leaf wholly inside the range gives its count,
+ * minimum and maximum from its number of keys and its two ends, and only the
+ * sum reads every key. A minimum alone stops at the first key in the range,
+ * and a maximum alone is looked for in the leaf of high before walking.
+ * A count alone in a table keeping subtree counts takes two descents instead.
+ *
+ * The walk holds the root latch of the table shared, which keeps merges out,
+ * and latches one leaf at a time. Inserts may go on: a key a split moves to a
+ * new leaf behind the walk has been read in the leaf it came from. The result
+ * is that of a scan, not of a snapshot.
+ */
+
+// Aggregate the keys of table_id from low to high, both included, computing the given parts
+// Return 0 if success, otherwise -1.
+int db_aggregate(int table_id, keyval_t low, keyval_t high, int parts, KeyAggregate * result);
+
+// Number of keys of table_id from low to high
+// Return 0 if success, otherwise -1.
+int db_count(int table_id, keyval_t low, keyval_t high, uint64_t * count);
+
+// Smallest and largest key of table_id from low to high
+// Return 0 if success, otherwise -1 (also if there's no key in the range).
+int db_min(int table_id, keyval_t low, keyval_t high, keyval_t * min_key);
+int db_max(int table_id, keyval_t low, keyval_t high, keyval_t * max_key);
+
+// Sum of the keys of table_id from low to high, wrapping around on overflow
+// Return 0 if success, otherwise -1.
+int db_sum(int table_id, keyval_t low, keyval_t high, int64_t * sum);
+
+#endif /* __AGGREGATE_H__ */
@@ -0,0 +1,147 @@
+#ifndef __BLOOM_H__
+#define __BLOOM_H__
+
+#include "bpt.hpp"
+
+// Bits of filter per key a filter is sized for by default
+#define DEFAULT_BLOOM_BITS_PER_KEY 12
+
+// Fewest keys a filter is sized for, so that a filter of a small table has room to grow
+#define BLOOM_MIN_KEYS 4096
+
+// 32-bit words in a block of a filter, each of which gets one bit of every key
+#define BLOOM_BLOCK_WORDS 8
+
+// Suffix of the file next to the data file that keeps the filter of a table
+#define BLOOM_FILE_SUFFIX ".bloom"
+
+// Odd multipliers that pick the bit of a key in each word of its block
+static const uint32_t bloom_salts[BLOOM_BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+// Mix the bits of key so that nearby keys land in unrelated blocks
+static inline uint64_t bloom_hash(keyval_t key){
+    uint64_t hash = (uint64_t)key;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/*
+ * Split block Bloom filter over keys
+ *
+ * A key hashes to a single 32-byte block and sets one bit in each of its
+ * eight words, so adding or testing a key touches one cache line, and the
+ * test is a handful of independent ANDs that the compiler can vectorize.
+ * Keys are only ever added: bits of deleted keys stay set until the filter
+ * is rebuilt, which makes the filter answer "maybe" more often but never
+ * "no" for a key that is there.
+ *
+ * Inserts add keys while others test them, so the words are set with atomic
+ * ORs and read with relaxed atomic loads.
+ */
+class BloomFilter{
+
+private:
+
+    uint32_t * words;
+    uint64_t num_blocks;
+
+    // Keys added to the filter, duplicates included
+    atomic<uint64_t> num_added;
+
+    // First word of the block of a key with hash
+    uint32_t * block_of(uint64_t hash) const {
+        return words + ((hash >> 32) * num_blocks >> 32) * BLOOM_BLOCK_WORDS;
+    }
+
+public:
+
+    BloomFilter(uint64_t num_blocks, uint64_t num_added = 0);
+    ~BloomFilter();
+
+    bool is_valid() const { return words != NULL; }
+
+    void add(keyval_t key);
+
+    // Return false only if key was never added
+    // Collects the missing bits of every word rather than stopping at the first one
+    bool may_contain(keyval_t key) const {
+        uint64_t hash = bloom_hash(key);
+        const uint32_t * block = block_of(hash);
+
+        uint32_t missing = 0;
+        for (int i = 0; i < BLOOM_BLOCK_WORDS; i++){
+            uint32_t bit = 1U << (((uint32_t)hash * bloom_salts[i]) >> 27);
+            missing |= bit & ~__atomic_load_n(&block[i], __ATOMIC_RELAXED);
+        }
+        return missing == 0;
+    }
+
+    uint64_t get_num_blocks() const { return num_blocks; }
+    uint64_t get_num_added() const { return num_added.load(memory_order_relaxed); }
+
+    // Write the words of the filter to fd at offset, or read them back from there
+    // Return 0 if success, otherwise -1.
+    int write_to(int fd, off_t offset) const;
+    int read_from(int fd, off_t offset);
+
+    // Number of blocks of a filter sized for num_keys keys at bits_per_key bits each
+    static uint64_t blocks_for(uint64_t num_keys, int bits_per_key);
+};
+
+/*
+ * Bloom filters of the tables
+ *
+ * A table has a filter once db_build_bloom_filter is called on it, and keeps it
+ * in a file named after the data file with BLOOM_FILE_SUFFIX. The file is marked
+ * while the table is open and unmarked when the table is closed, so a filter
+ * left behind by a crash, or by a data file that changed since, is dropped when
+ * the table is opened again and has to be built anew.
+ *
+ * Inserts add their key to the filter before the leaf. They and deletes hold
+ * the filter latch of the table shared, and a rebuild holds it exclusively
+ * while it reads the leaves, so that no key is added or moved behind its back.
+ * Lookups read the filter without the latch; a filter that is replaced is freed
+ * only when the table is closed.
+ */
+
+// Build the filter of table_id from its leaves, replacing the filter it has
+// Return 0 if success, otherwise -1.
+int db_build_bloom_filter(int table_id, int bits_per_key = DEFAULT_BLOOM_BITS_PER_KEY);
+
+// Drop the filter of table_id and remove its file
+// Return 0 if success, otherwise -1.
+int db_drop_bloom_filter(int table_id);
+
+// Return false only if table_id surely has no record with key (true if it has no filter)
+bool bloom_may_contain(int table_id, keyval_t key);
+
+// Filter of table_id, or NULL if it has none
+// The filter stays valid until the table is closed, even if it is dropped or rebuilt.
+const BloomFilter * get_bloom_filter(int table_id);
+
+// Whether table_id has a filter
+bool has_bloom_filter(int table_id);
+
+// Latch of the filter of table_id, held shared by inserts and deletes
+shared_timed_mutex & bloom_latch(int table_id);
+
+// Add key to the filter of table_id, if it has one
+// Called by inserts holding the filter latch of the table shared
+void bloom_add(int table_id, keyval_t key);
+
+// Load the filter of a table being opened from its file, and mark the file
+// Called by open_table with the data file open in fd
+void bloom_open_table(int table_id, const char * pathname, int fd);
+
+// Write the filter of a table being closed to its file, and free it
+// Called by close_table once every page of the table is on the disk
+void bloom_close_table(int table_id);
+
+#endif /* __BLOOM_H__ */
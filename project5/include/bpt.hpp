@@ -5,6 +5,9 @@
 
 #define LINE(x) printf("line #%d: ", x);
 
+// Optimistic descents that run into a writer before falling back to latch coupling
+#define OPTIMISTIC_DESCENT_RETRIES 4
+
 // TYPES.
 
 /* Type representing the record
@@ -51,6 +54,180 @@ struct QNode{
 
 extern struct QNode * queue;
 
+// CONCURRENCY.
+
+/* The root page number is guarded by the root latch of the table, and every
+ * page by the latch of its frame.
+ * Lookups descend optimistically: nodes above the leaf are read without their
+ * latches and validated against their versions, and the descent starts over
+ * if a writer changed one of them in between. After a few conflicts, or if
+ * optimistic_descent is off, they take shared latches instead, one node at a
+ * time, holding the root latch shared so that no node on the way is freed.
+ * An insert or delete first descends like a lookup and latches only the leaf
+ * exclusively; if the leaf may split or underflow, it descends again latching
+ * every node exclusively (latch coupling), and lets go of everything above a
+ * node the change can't propagate past (a safe node).
+ * Pages a split or merge changes off that path (siblings, children moved to
+ * another parent, new pages) are latched through the latch set of the thread,
+ * which releases them all when the operation ends.
+ *
+ * The tree is a B-link tree: every node keeps a high key and a link to its
+ * right sibling, so a descent that finds key at or past the high key of a
+ * node moves right instead of down. With blink_insert on, a split therefore
+ * doesn't need the parent latched in advance: the node is split and linked to
+ * its new sibling first, and the separator then goes up one level at a time,
+ * latching the parent only while the node below it stays latched. Each level
+ * is a system operation of its own, and the split node is marked until its
+ * parent points at the new sibling, so recovery can finish a split a crash
+ * cut short. Since such splits latch upwards, merges keep the root latch exclusively
+ * until they end, and the parent page numbers a split leaves behind in the
+ * moved children are fixed by the next merge that passes them.
+ *
+ * A table may keep subtree counts: every internal entry then also holds the
+ * number of records under its child, which makes the rank of a key and the
+ * key at a rank a single descent. Since an insert or delete changes a count
+ * on every level, it descends with latch coupling and keeps the root latch
+ * exclusively and the whole path latched until it ends, so writers of such a
+ * table run one at a time, and lookups holding the root latch shared see
+ * counts that add up.
+ */
+
+enum class TreeOp { FIND, INSERT, DELETE };
+
+class TreeLatches{
+
+private:
+
+    int table_id;
+
+    // latch set of an enclosing operation of the thread, restored at the end
+    TreeLatches * saved;
+
+    // whether the root latch is held, and in which mode
+    bool holds_root;
+    bool root_exclusive;
+
+    // root page number seen by the last descent
+    Pagenum_t root_page_num;
+
+    // pinned and latched pages (the path from the top down, then the other pages)
+    vector<BufferBlock_t *> frames;
+    vector<bool> exclusive;
+
+    // pages to free once the operation has ended
+    vector<BufferBlock_t *> freed;
+
+    void push(BufferBlock_t * frame, bool is_exclusive);
+
+    // Release the root latch (kept by deletes) and every page latched before the last one
+    void release_ancestors(TreeOp op);
+
+public:
+
+    TreeLatches(int table_id);
+    ~TreeLatches();
+
+    // Descend to the leaf that may hold key, leaving it latched exclusively
+    // If optimistic, the nodes above the leaf are passed like a lookup does,
+    // otherwise they stay latched exclusively up to the lowest safe node for op
+    // Return the page number of the leaf, or NO_ROOT_NODE if the tree is empty
+    // (with the root latch held unless optimistic)
+    Pagenum_t descend(keyval_t key, TreeOp op, bool optimistic);
+
+    // Descend to the leaf that may hold key for a B-link split, leaving it latched exclusively
+    // The root latch is held shared until the latch set is released, and the page number
+    // of the first node reached on each level is stored in path, from the leaf up
+    // Return the page number of the leaf, or NO_ROOT_NODE if the tree is empty
+    Pagenum_t descend_blink(keyval_t key, vector<Pagenum_t> & path);
+
+    Pagenum_t get_root_page_num();
+
+    bool holds(Pagenum_t page_num);
+
+    // Latch page_num exclusively until the operation ends, unless it is latched already
+    void latch(Pagenum_t page_num);
+
+    // Latch page_num exclusively, then move right through the links while key is past
+    // the high key, releasing the nodes left behind
+    // Return the page number of the node left latched
+    Pagenum_t latch_right(Pagenum_t page_num, keyval_t key);
+
+    // Release the latch on page_num before the operation ends
+    void unlatch(Pagenum_t page_num);
+
+    // Free the page of frame when the latch set is released, taking over the pin of the caller
+    void free_later(BufferBlock_t * frame);
+
+    // Free the pages given to free_later, and release every latch and pin
+    // The system operation must have ended before pages are freed, since a page
+    // freed by an operation that is rolled back would be in use and free at once
+    void release();
+};
+
+// Latch set of the insert or delete in progress on the calling thread
+extern thread_local TreeLatches * tree_latches;
+
+// Whether descents read the nodes above the leaf optimistically (on by default)
+extern bool optimistic_descent;
+
+// Whether inserts split nodes B-link style (on by default)
+// Otherwise a split descends again keeping every node it may reach latched
+// Set before any table is used
+extern bool blink_insert;
+
+// Read the root page number from the header page
+// Called with the root latch of the table held, or validated against its version
+Pagenum_t read_root_page_num(int table_id);
+
+// Right sibling of node, or 0 if it is the last node of its level
+Pagenum_t right_link(NodePage_t & node);
+
+// Whether key belongs to a right sibling of node
+bool beyond_high_key(NodePage_t & node, keyval_t key);
+
+// Whether node of table_id stays within its size limits after op removes or adds one entry
+bool is_safe(int table_id, NodePage_t & node, TreeOp op);
+
+// Whether the internal nodes of table_id keep subtree counts
+bool has_subtree_counts(int table_id);
+
+// Order of the internal nodes of table_id
+int internal_order(int table_id);
+
+// Records in the subtree at page_num, which the caller has latched
+uint64_t subtree_total(int table_id, Pagenum_t page_num);
+
+// Add delta to the count of every subtree on the path to the leaf that may hold key
+// Called by an insert or delete holding every node on the path
+void add_to_subtree_counts(int table_id, keyval_t key, int delta);
+
+// Number of records of table_id with a key below key, or up to key if inclusive
+// Called with the root latch of a table that keeps subtree counts held shared
+uint64_t count_keys_below(int table_id, keyval_t key, bool inclusive);
+
+// Latch page_num for the insert or delete in progress on the calling thread
+void latch_node(Pagenum_t page_num);
+
+// Make the node at page_num a child of parent_page_num
+// A child moving to another parent is reached only through pages the operation keeps latched,
+// so it is latched only while it is written
+void set_parent_page(int table_id, Pagenum_t page_num, Pagenum_t parent_page_num);
+
+// Free the page of frame after the insert or delete in progress on the calling thread ends
+// The pin of the caller is released then
+void free_node(BufferBlock_t * frame);
+
+// Descend to the leaf that may hold key like a lookup
+// Return the leaf pinned and latched (exclusively if exclusive is set), or nullptr if the tree is empty
+// The caller releases the latch and the pin
+BufferBlock_t * find_leaf_frame(int table_id, keyval_t key, bool exclusive);
+
+// Descend to the leaf that may hold key, latching one node at a time, for a caller
+// holding the root latch of the table shared (so that no leaf right of it is freed either)
+// Return the leaf pinned and latched shared, or nullptr if the tree is empty
+// The caller releases the latch and the pin
+BufferBlock_t * find_leaf_frame_shared(int table_id, keyval_t key);
+
 // Insert input ‘key/value’ (record) to data file at the right place.
 // If success, return 0. Otherwise, return non-zero value.
 int db_insert (int table_id, keyval_t key, char * value);
@@ -64,6 +241,21 @@ int db_find (int table_id, keyval_t key, char * ret_val);
 // If success, return 0. Otherwise, return non-zero value.
 int db_delete (int table_id, keyval_t key);
 
+// Make the empty table table_id keep subtree counts, before it is used
+// Return 0 if success, otherwise -1 (also if the table has records).
+int db_keep_subtree_counts(int table_id);
+
+// Store in rank the number of records of table_id with a key below key
+// (the position of key in key order, from 0, if the table has it)
+// Return 0 if success, otherwise -1 (also if the table keeps no subtree counts).
+int db_rank(int table_id, keyval_t key, uint64_t * rank);
+
+// Find the record at position rank of table_id in key order, from 0,
+// storing its key in key and its value in ret_val unless it is NULL
+// Return 0 if success, otherwise -1 (also if the table has no more records
+// than rank or keeps no subtree counts).
+int db_select(int table_id, uint64_t rank, keyval_t * key, char * ret_val);
+
 
 // Output and utility.
 void enqueue( Pagenum_t new_node );
@@ -72,9 +264,17 @@ Pagenum_t dequeue( void );
 void print_tree(int table_id);
 void print_leaves(int table_id);
 
+// Check the structure of the tree: key order and bounds, node sizes,
+// depth of the leaves, and the high keys and right links of every level.
+// Return SUCCESS if the tree is valid, otherwise print the first violation and return FAILURE.
+int check_tree(int table_id);
+
 int height(int table_id,  Pagenum_t root_page_num );
 int path_to_root(int table_id,  Pagenum_t root_page_num, Pagenum_t child_page_num );
 int cut( int length );
+
+// The descent starts from the current root
+// (root_page_num only tells whether the caller saw an empty tree)
 Pagenum_t find_leaf(int table_id,  Pagenum_t root_page_num, keyval_t key, bool verbose );
 Record_t find(int table_id,  Pagenum_t root_page_num, keyval_t key, bool verbose );
 
@@ -86,12 +286,26 @@ Pagenum_t make_node( int table_id, bool is_leaf );
 int get_left_index(NodePage_t parent, Pagenum_t left);
 Pagenum_t insert_into_leaf(int table_id, Pagenum_t leaf_page_num, keyval_t key, Record_t pointer );
 Pagenum_t insert_into_leaf_after_splitting(int table_id, Pagenum_t root, Pagenum_t leaf, keyval_t key, Record_t pointer);
+
+// Split a full leaf, inserting key and pointer, and link it to the new right sibling
+// A B-link split marks the leaf until its parent points at the sibling
+// Return the new leaf, storing its first key in k_prime
+Pagenum_t split_leaf(int table_id, Pagenum_t leaf, keyval_t key, Record_t pointer, keyval_t * k_prime, bool blink);
+
+// Split a full internal node, inserting key and right after the pointer at left_index
+// A B-link split also leaves the children moved to the new node with their old parent page number
+// Return the new node, storing the key to push up in k_prime
+Pagenum_t split_node(int table_id, Pagenum_t node, int left_index, keyval_t key, Pagenum_t right, keyval_t * k_prime, bool blink);
 Pagenum_t insert_into_node(int table_id, Pagenum_t root_page_num, Pagenum_t parent, int left_index, keyval_t key, Pagenum_t right);
 Pagenum_t insert_into_node_after_splitting(int table_id, Pagenum_t root, Pagenum_t parent, int left_index, keyval_t key, Pagenum_t right);
 Pagenum_t insert_into_parent(int table_id, Pagenum_t root, Pagenum_t left, keyval_t key, Pagenum_t right);
 Pagenum_t insert_into_new_root(int table_id, Pagenum_t left, keyval_t key, Pagenum_t right);
 Pagenum_t start_new_tree(int table_id, keyval_t key, Record_t pointer);
 
+// Insert the separators of the B-link splits a crash interrupted into their parents
+// Called by recovery, before anything else uses the table
+void finish_splits(int table_id);
+
 // Deletion.
 
 int get_neighbor_index(int table_id,  Pagenum_t n );
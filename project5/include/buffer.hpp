@@ -1,7 +1,38 @@
 #ifndef __BUFFER_H__
 #define __BUFFER_H__
 
-#include "diskmanage.hpp"
+#include "log.hpp"
+
+/* Reader-writer latch with a version for optimistic readers.
+ * The version is odd while the latch is held exclusively, and changes on every
+ * exclusive acquisition and release. A reader that saw an even version before
+ * reading and the same version after it read nothing a writer was changing.
+ */
+class PageLatch{
+
+private:
+
+    shared_timed_mutex latch;
+    atomic<uint64_t> version;
+
+public:
+
+    PageLatch();
+
+    void lock();
+    void unlock();
+    void lock_shared();
+    void unlock_shared();
+
+    // Start an optimistic read, storing the version to validate against
+    // Return false if a writer holds the latch
+    bool read_begin(uint64_t * version);
+
+    // Return whether the latch was not taken exclusively since read_begin returned version
+    bool validate(uint64_t version);
+
+    uint64_t get_version();
+};
 
 struct TableInfo_t{
 
@@ -10,6 +41,20 @@ struct TableInfo_t{
     char pathname[MAX_TABLE_NUMBER + 1][512];
     int fd[MAX_TABLE_NUMBER + 1];
 
+    // LSN of the OPEN record of each table
+    lsn_t open_lsn[MAX_TABLE_NUMBER + 1];
+
+    // guards the table slots against checkpoints taken in the background
+    mutex latch;
+
+    // guards the root page number of each tree: shared while descending from the root,
+    // exclusive while an insert or delete may replace the root
+    PageLatch root_latch[MAX_TABLE_NUMBER + 1];
+
+    // whether each tree keeps subtree counts, mirrored from its header page
+    // so that splits and merges don't read the header to know
+    atomic<bool> subtree_counts[MAX_TABLE_NUMBER + 1];
+
 };
 
 extern TableInfo_t tables;
@@ -31,13 +76,23 @@ struct BufferBlock_t{
     // Indicates whether this block is dirty or not
     bool is_dirty;
 
+    // LSN of the oldest change not written to the disk yet (valid while dirty)
+    lsn_t rec_lsn;
+
     // Indicates wheter this block is pinned or not
-    int pin_count;
+    atomic<int> pin_count;
 
     // Pointer for LRU lists
     BufferBlock_t * prev, * next;
 
-    mutex latch;
+    // Page latch: shared to read the page, exclusive to change it
+    // Only taken while the frame is pinned; readers that only descend through
+    // the page may read it without the latch and validate its version instead
+    PageLatch latch;
+
+    // Guards frame, is_dirty and rec_lsn, so that the page cleaner and checkpoints
+    // see a page either before or after a write together with its log record
+    mutex content_latch;
     
     BufferBlock_t();
     BufferBlock_t(Page_t page, int tid, Pagenum_t pid, bool dirty);
@@ -47,7 +102,14 @@ struct BufferBlock_t{
 
     void insert_between(BufferBlock_t * prev, BufferBlock_t * next);
     void clear();
+
+    // Write the page to the disk if it is dirty
+    // Called with the buffer latch held, so that two flushes never race
     void flush();
+
+    // Return whether the page is dirty, storing its rec_lsn
+    bool dirty_since(lsn_t * rec_lsn);
+
     void print();
 
 };
@@ -56,7 +118,7 @@ class Buffer{
 
 private:
     
-    mutex latch;
+    recursive_mutex latch;
     BufferBlock_t * pool;
     unordered_map<pair<int, Pagenum_t>, BufferBlock_t *, PIDHasher> lookup;
 
@@ -73,6 +135,16 @@ public:
 
     BufferBlock_t& allocate_page(const int table_id);
     void free_page(BufferBlock_t& frame);
+    void flush_page(BufferBlock_t& frame);
+    void set_root_page(const int table_id, const Pagenum_t root_page_num);
+    void set_subtree_counts(const int table_id);
+
+    // Write every dirty page whose oldest unwritten change is older than lsn
+    // Return the number of pages written
+    int clean_pages(lsn_t lsn);
+
+    // Collect the dirty page table for a checkpoint
+    void get_dirty_pages(vector<DirtyPage_t> & dirty_pages);
 
     void add_lookup(const int table_id, const Pagenum_t page_num, BufferBlock_t * frame);
     void remove_lookup(const int table_id, const Pagenum_t page_num);
@@ -93,6 +165,9 @@ extern Buffer *buffer;
 // If success, return 0. Otherwise, return non zero value.
 int init_db(int num_buf);
 
+// Same as init_db(num_buf), but keeps the write-ahead log at log_path
+int init_db(int num_buf, const char * log_path);
+
 // Open existing data file using ‘pathname’ or create one if not existed.
 // If success, return the unique table id, which represents the own table in this database. Otherwise,
 // return negative value.
@@ -120,6 +195,7 @@ BufferBlock_t * buffer_read_page(int table_id, Pagenum_t page_num);
 
 // Write page to buffer
 // This makes frame dirty and increases pin count by 1
+// The change is logged under the log owner of the calling thread and the page LSN is stamped
 void buffer_write_page(BufferBlock_t * frame, Page_t page);
 
 // Flush all data of frame into coresponding disk page 
@@ -127,12 +203,22 @@ void buffer_flush_page(BufferBlock_t * frame);
 
 // Allocate new page from disk and stage it on a buffer frame
 // This increases pin count by 1
+// The allocation is logged as a system operation of its own, which is never rolled back
 BufferBlock_t * buffer_allocate_page(int table_id);
 
 // Free an allocated page from the buffer
 // Flush the changes into the disk and remove frame from the buffer
+// Like an allocation, this is logged as a system operation of its own
+// The frame is reused only after its remaining pins are released
 void buffer_free_page(BufferBlock_t * frame);
 
+// Change the root page number in the header page
+// Serialized with allocations and frees, which change the header page too
+void buffer_set_root_page(int table_id, Pagenum_t root_page_num);
+
+// Mark the header page of table_id as that of a table keeping subtree counts
+void buffer_set_subtree_counts(int table_id);
+
 // Decrease the pin count of frame in buffer by count
 void buffer_unpin_page(BufferBlock_t * frame, int count);
 
@@ -21,6 +21,17 @@ typedef struct InternalRecord{
 
 } InternalRecord;
 
+// Records of an internal node in a table that keeps subtree counts
+// The number of records under each child takes the room of the last 50 records -> Order = 199
+typedef struct CountedRecords{
+
+    InternalRecord in_record[COUNTED_INTERNAL_ORDER - 1];
+
+    // records in the subtree of each child, in the order of INTERNAL_VAL
+    uint32_t subtree_count[COUNTED_INTERNAL_ORDER];
+
+} CountedRecords;
+
 /*
     In-memory page structures used to temporary store data on the memory
 */
@@ -37,8 +48,14 @@ typedef struct HeaderPage_t {
     // denote the number of pages existing in this data file now
     Pagenum_t num_page;
 
+    // LSN of the last log record applied to this page
+    lsn_t page_lsn;
+
+    // 1 if the internal pages keep the number of records under each child
+    int subtree_counts;
+
     // unused bytes of header page
-    char reserved[4072];
+    char reserved[4060];
 
 } HeaderPage_t;
 
@@ -48,8 +65,14 @@ typedef struct FreePage_t {
     // 0 if the page is the end of the free page list
     Pagenum_t next_free_page_num;
 
-    // unused bytes of header page
-    char reserved[4088];
+    // unused bytes kept so that page_lsn shares its offset with node pages
+    char padding[8];
+
+    // LSN of the last log record applied to this page
+    lsn_t page_lsn;
+
+    // unused bytes of free page
+    char reserved[4072];
     
 } FreePage_t;
 
@@ -66,8 +89,21 @@ typedef struct NodePage_t {
     // denote the number of keys within this page
     int num_key; 
 
+    // LSN of the last log record applied to this page
+    lsn_t page_lsn;
+
+    // every key of the page is below high_key, unless it is the last page of its level
+    keyval_t high_key;
+
+    // right sibling of an internal page (a leaf keeps it in right_page_num)
+    // 0 if the page is the last page of its level
+    Pagenum_t next_page_num;
+
+    // set while the page has been split but its parent doesn't point at the new sibling yet
+    int split_pending;
+
     // unused bytes of node pade
-    char reserved[104];
+    char reserved[76];
 
     // ------------------------------------------
 
@@ -87,6 +123,10 @@ typedef struct NodePage_t {
     // array storing records in the page
     // maximum 248 records per page(branching factor = 249)
     InternalRecord in_record[248];
+
+    // records of a page with subtree counts, sharing in_record
+    // maximum 198 records per page(branching factor = 199)
+    CountedRecords counted;
        
     // array storing records in the page
     // maximum 31 records per page(branching factor = 32)
@@ -120,6 +160,11 @@ void file_write_page(Pagenum_t pagenum, const Page_t* src, int fd);
 // Write some multiple pages stored in an array into the file
 void file_write_multi_pages(Pagenum_t pagenum, const Page_t* src, const int num_page, int fd);
 
+// Get or set the LSN stamped on a page
+// The header page keeps it at a different offset from node and free pages
+lsn_t get_page_lsn(Pagenum_t pagenum, const Page_t * page);
+void set_page_lsn(Pagenum_t pagenum, Page_t * page, lsn_t lsn);
+
 // If the file exists in given pathname, open it in fd and return 1
 // If the file doesn't exist or has error, return 0
 int file_open_if_exist(const char * pathname, int * fd);
@@ -1,35 +1,246 @@
 #include <bpt.hpp>
+#include <sink.hpp>
 
-class Join{
+// Keys sampled from the internal levels per partition of a parallel join
+#define JOIN_SAMPLES_PER_PARTITION 16
+
+// Bytes of a record value
+#define JOIN_VALUE_SIZE 120
+
+// A table with fewer than 1/JOIN_BUILD_RATIO the pages of the other is read whole,
+// and the other one probed with its keys rather than merged
+#define JOIN_BUILD_RATIO 8
+
+// Cost of the leaf read of a lookup, relative to a leaf read by a scan
+#define JOIN_RANDOM_PAGE_COST 4
+
+enum class JoinMethod {
+    AUTO,                   // chosen by cost
+    MERGE,                  // merge the leaves of both tables
+    HASH,                   // hash the smaller table, and probe it scanning the other one
+    INDEX_NESTED_LOOP       // look every key of the smaller table up in the other one
+};
+
+enum class JoinType {
+    INNER,                  // keys in both tables, with both values
+    SEMI,                   // keys of the left table that the right one has, without values
+    ANTI,                   // keys of the left table that the right one lacks, without values
+    LEFT_OUTER,             // every key of the left table, with the right value where there is one
+    FULL_OUTER              // every key of either table, with the values there are
+};
+
+// How a join runs and writes its result
+struct JoinOptions{
+
+    size_t output_buffer_size = DEFAULT_SINK_BUFFER_SIZE;
+    int output_flags = 0;     // SINK_DIRECT, SINK_SYNC
+    int num_threads = 1;      // key ranges merged in parallel
+    JoinMethod method = JoinMethod::AUTO;
+    JoinType type = JoinType::INNER;    // other types are merged
+    bool skip_leaves = true;  // let a merge descend past leaves with nothing to match
+};
+
+// Rows a JoinIterator returns per batch when the caller doesn't care
+#define JOIN_BATCH_SIZE 256
+
+// A row of a join: the key and the value of either table, NULL where the
+// table has no record with the key or the join type reads no values
+// A value is NUL-terminated unless it takes all JOIN_VALUE_SIZE bytes.
+struct JoinRow{
+
+    keyval_t key;
+    const char * left_value;
+    const char * right_value;
+};
+
+/*
+ * Pull-based merge join of two tables
+ *
+ * next_batch fills an array of rows in key order. The values are not copied:
+ * they point into the leaves, which stay pinned until the next call of
+ * next_batch or the end of the iterator. Like join_table, an iterator expects
+ * no writes to the tables while it runs.
+ *
+ * The merge starts at the leftmost leaves, or where start says, and can be
+ * limited to a key range. When the leaves of one side have nothing in common
+ * with the other side, it descends past the gap instead of walking it,
+ * unless the join type keeps the rows of that side without a match.
+ */
+class JoinIterator{
 
 private:
 
     int left_table_id, right_table_id;
-    ofstream output;
+
+    // Current leaves, pinned, and the next record of each
     BufferBlock_t * left, * right;
+    int left_idx, right_idx;
+
+    // Whether the batch being filled has rows in the current leaves,
+    // and the leaves already left behind that it has rows in
+    bool left_in_batch, right_in_batch;
+    vector<BufferBlock_t *> held;
+
+    // Only keys in [lower_bound, upper_bound) are joined
+    keyval_t lower_bound, upper_bound;
+    bool has_upper_bound;
+
+    JoinType type;
+
+    // Whether the current leaves had a key in common
+    bool skip_leaves;
+    bool matched;
+
+    bool is_started, is_done;
+
+    // Whether the rows of location without a match are part of the result
+    bool keeps_unmatched(int location);
+
+    void release_held();
+
+    void drop_leaf(int location);
+
+    void finish();
+
+    // Move location to its next leaf, or end the join if there is none
+    void advance(int location);
+
+public:
+
+    bool is_valid;
+
+    JoinIterator(int left_table_id, int right_table_id, const JoinOptions & options = JoinOptions());
+    ~JoinIterator();
+
+    // Join only keys from lower (inclusive) to upper (exclusive, if has_upper)
+    void set_range(keyval_t lower, keyval_t upper, bool has_upper);
 
-    int join_two_blocks();
+    // Start the merge at the given leaves rather than the leftmost ones
+    void start(Pagenum_t left_leaf, Pagenum_t right_leaf);
 
-    Pagenum_t get_next_leaf(int location);
+    // Store up to max_rows next rows in rows, releasing the leaves of the previous batch
+    // Return the number of rows stored, 0 once the join is done.
+    int next_batch(JoinRow * rows, int max_rows);
+};
+
+// Writer of the rows of a join to a CSV file
+class Join{
+
+private:
+
+    OutputSink output;
+    JoinIterator rows;
+    JoinType type;
 
 public:
 
     bool is_valid;
 
-    Join(const char * pathname, int left_table_id, int right_table_id);
+    Join(const char * pathname, int left_table_id, int right_table_id, const JoinOptions & options = JoinOptions());
     ~Join();
 
-    void write_line(keyval_t key, int left_idx, int right_idx);
+    // Join only keys from lower (inclusive) to upper (exclusive, if has_upper)
+    void set_range(keyval_t lower, keyval_t upper, bool has_upper);
+
+    // End the output, unless it is a partition of a longer one, and close the file.
+    // Return 0 if success, otherwise -1.
+    int close_output(bool terminate = true);
 
-    void set_block(Pagenum_t, int location);
+    // Write the key and the value of either table, with empty fields for a missing value,
+    // or only the key for semi and anti joins
+    void write_row(keyval_t key, const char * left_value, const char * right_value);
 
+    // Merge the tables from the given leaves and write every row
     void proceed(Pagenum_t left_leaf, Pagenum_t right_leaf);
 
 };
 
+/*
+ * Pull-based merge join of several tables on their keys
+ *
+ * A cursor walks the leaves of every table, and a key is returned once at
+ * least min_matches of the tables hold it: all of them for an inner join,
+ * fewer to keep keys that some tables lack. Batches are returned like
+ * JoinIterator does, with the values of table t at values[row * N + t]
+ * and NULL where the table doesn't have the key.
+ *
+ * While fewer than min_matches cursors are at the smallest current key,
+ * the cursors behind the min_matches-th smallest key jump to it, descending
+ * past leaves that can't match instead of walking them.
+ */
+class MultiJoinIterator{
+
+private:
+
+    struct Cursor{
+        int table_id;
+        BufferBlock_t * frame;      // current leaf, pinned, or NULL once the table is done
+        int idx;
+        bool in_batch;
+    };
+
+    vector<Cursor> cursors;
+
+    // Current key of every cursor, INT64_MAX for done ones, kept apart for the minimum
+    vector<keyval_t> current_keys;
+    vector<keyval_t> sorted_keys;
+    int num_live;
+
+    vector<BufferBlock_t *> held;
+
+    int min_matches;
+    bool skip_leaves;
+    bool is_started, is_done;
+
+    void release_held();
+
+    void drop_leaf(Cursor & cursor);
+
+    void finish();
+
+    // Move the cursor to page_num, or end it if page_num is 0
+    void load_leaf(int c, Pagenum_t page_num);
+
+    // Move the cursor past exhausted leaves and update its key
+    void settle(int c);
+
+    // Move the cursor to its first record with a key of at least key
+    void seek(int c, keyval_t key);
+
+public:
+
+    bool is_valid;
+
+    MultiJoinIterator(const vector<int> & table_ids, int min_matches, const JoinOptions & options = JoinOptions());
+    ~MultiJoinIterator();
+
+    int num_tables() const { return cursors.size(); }
+
+    // Store up to max_rows next keys in keys, and their values in values[row * num_tables() + table]
+    // releasing the leaves of the previous batch. Return the number of rows, 0 once the join is done.
+    int next_batch(keyval_t * keys, const char ** values, int max_rows);
+};
+
 // Do natural join with given two tables and write result table to the file using given pathname.
 // Return 0 if success, otherwise return non-zero value.
 // Two tables should have been opened earlier.
 int join_table(int table_id_1, int table_id_2, char * pathname);
 
+// Same as join_table(table_id_1, table_id_2, pathname), running and writing the join as options say
+int join_table(int table_id_1, int table_id_2, char * pathname, const JoinOptions & options);
+
+// Join the tables in options.num_threads key ranges at once
+// Each range is written to a file of its own next to pathname, and the files
+// are then appended to pathname in key order.
+int parallel_join_table(int table_id_1, int table_id_2, char * pathname, const JoinOptions & options);
+
+// Join the given tables on their keys and write a row for every key that
+// at least min_matches of them hold: the key and the value of each table in turn,
+// with both fields left empty for a table without the key.
+// Return 0 if success, otherwise -1.
+int join_tables(const vector<int> & table_ids, char * pathname, int min_matches, const JoinOptions & options = JoinOptions());
+
+// Page number of the leftmost leaf of table_id, or 0 if the table is empty
+Pagenum_t find_leftmost_leaf(int table_id);
+
 void find_leftmost_page_num(int table_id_1, int table_id_2, Pagenum_t * left_leaf, Pagenum_t * right_leaf);
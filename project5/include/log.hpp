@@ -0,0 +1,275 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "diskmanage.hpp"
+
+#define LOG_MAGIC 0x4250544c4f47ULL
+
+// Largest image a log record may carry (checkpoint records are the largest)
+#define MAX_LOG_IMAGE_SIZE (64 << 20)
+
+/*
+ * Write-ahead log
+ *
+ * Every page modification made through the buffer is described by a log record
+ * holding the before and after image of the changed byte range of the page.
+ * Records are appended to an in-memory log buffer and written to a single
+ * per-database log file by a group commit thread, which syncs the records of
+ * many committing transactions with one fdatasync.
+ * The LSN of a record is its logical byte offset within the log.
+ * Checkpoints let the records older than start_lsn go: that part of the file
+ * is deallocated, keeping the offsets of the remaining records.
+ */
+
+enum class LogType : int32_t {
+    BEGIN, UPDATE, COMMIT, ROLLBACK, COMPENSATE, INSERT, DELETE, SPLIT, MERGE, OPEN, CHECKPOINT,
+
+    // page allocation and deallocation, logged as system operations of their own
+    ALLOCATE, FREE
+};
+
+// Header of the log file
+typedef struct LogFileHeader_t {
+
+    // identifies the file as a log file of this database
+    uint64_t magic;
+
+    // LSN of the first record stored right after this header
+    lsn_t base_lsn;
+
+    // oldest record kept in the log (0 for base_lsn)
+    lsn_t start_lsn;
+
+    // last complete checkpoint record (NO_LSN if none)
+    lsn_t checkpoint_lsn;
+
+    // unused bytes of log file header
+    char reserved[32];
+
+} LogFileHeader_t;
+
+// Fixed-size part of a log record
+// The old image and the new image (length bytes each) follow it in the log
+typedef struct LogRecord_t {
+
+    // total size of the record including both images
+    uint32_t size;
+
+    // checksum of the whole record computed with this field set to 0
+    uint32_t checksum;
+
+    lsn_t lsn;
+
+    // previous record written by the same transaction
+    lsn_t prev_lsn;
+
+    int trx_id;
+    LogType type;
+
+    // target page of the record and byte offset of the images within it
+    int table_id;
+    int offset;
+    Pagenum_t page_num;
+
+    // length of each of the old and new image
+    int length;
+
+    // unused bytes of log record
+    int reserved;
+
+    // next record of the same transaction to be undone (compensation records only)
+    lsn_t undo_next_lsn;
+
+    // key of the updated record (update and compensation records only)
+    keyval_t key;
+
+} LogRecord_t;
+
+// Checkpoint record: the header is followed by the open tables,
+// the dirty page table and the active transaction table
+typedef struct CheckpointHeader_t {
+
+    // records older than begin_lsn are summarized by this checkpoint
+    lsn_t begin_lsn;
+
+    int num_tables;
+    int num_dirty_pages;
+    int num_active_trx;
+
+    int reserved;
+
+} CheckpointHeader_t;
+
+typedef struct CheckpointTable_t {
+    int table_id;
+
+    // OPEN record of the table
+    lsn_t open_lsn;
+
+    char pathname[512];
+} CheckpointTable_t;
+
+typedef struct DirtyPage_t {
+    int table_id;
+    Pagenum_t page_num;
+
+    // oldest change of the page not written to the disk yet
+    lsn_t rec_lsn;
+} DirtyPage_t;
+
+typedef struct ActiveTrx_t {
+    int trx_id;
+    lsn_t first_lsn;
+    lsn_t last_lsn;
+} ActiveTrx_t;
+
+// Owner of the page writes a thread makes through the buffer
+// A thread without an owner (trx_id 0) writes pages without logging them
+struct LogContext{
+    int trx_id;
+    LogType type;
+    lsn_t * last_lsn;
+    keyval_t key;
+    lsn_t undo_next_lsn;
+};
+
+class LogManager{
+
+private:
+
+    int fd;
+    LogFileHeader_t header;
+    lsn_t base_lsn, start_lsn;
+
+    mutex latch;
+
+    // wakes the group commit thread up / wakes threads waiting for durability up
+    condition_variable flush_cond;
+    condition_variable durable_cond;
+
+    // records appended but not handed to the group commit thread yet
+    vector<char> log_buffer;
+    size_t buffer_capacity;
+
+    // LSN given to the next appended record
+    lsn_t next_lsn;
+
+    // every record whose LSN is below flushed_lsn is durable
+    lsn_t flushed_lsn;
+
+    // somebody waits until every record below requested_lsn is durable
+    lsn_t requested_lsn;
+
+    bool terminate;
+    thread flusher;
+
+    // a log write failed; flushed_lsn never moves again and no record is appended
+    atomic<bool> failed;
+
+    // ID of the next system operation (negative, never collides with transactions)
+    int next_system_op_id;
+
+    // transactions and system operations which have not logged their end yet
+    unordered_map<int, ActiveTrx_t> active_trx;
+
+    uint64_t num_records, num_syncs;
+
+    // the process dies once this many records have been appended (0: never)
+    uint64_t crash_point;
+
+    int open_log(const char * pathname);
+    int write_log(const char * data, size_t length, lsn_t lsn);
+    void flush_loop();
+
+public:
+
+    LogManager(const char * pathname, size_t buffer_capacity);
+    ~LogManager();
+
+    // Append a record to the log buffer and return its LSN, or NO_LSN if the log has failed
+    lsn_t append(LogRecord_t & record, const char * old_image, const char * new_image);
+
+    // Block until every record up to lsn is durable
+    // Return FAILURE if the log could not be written, leaving them not durable
+    int flush(lsn_t lsn);
+
+    // Read a durable record from the log file
+    // Images are stored in images (old image followed by new image)
+    bool read_record(lsn_t lsn, LogRecord_t & record, vector<char> & images);
+
+    lsn_t get_start_lsn();
+    lsn_t get_checkpoint_lsn();
+    lsn_t get_flushed_lsn();
+    lsn_t get_next_lsn();
+
+    // Whether a log write failed, after which no record is appended or made durable
+    bool has_failed();
+
+    // Copy the active transaction table and return the LSN it is valid at
+    lsn_t get_active_trx(vector<ActiveTrx_t> & active);
+
+    // Record a durable checkpoint in the file header and drop the records older than start_lsn
+    int set_checkpoint(lsn_t checkpoint_lsn, lsn_t start_lsn);
+
+    int new_system_op_id();
+
+    // Kill the process without flushing anything after num_records more records
+    // are appended, leaving the disk as a crash would (0 disables it)
+    void set_crash_point(uint64_t num_records);
+
+    void print_status();
+};
+
+extern LogManager * log_manager;
+
+// Attach an owner to the calling thread for the lifetime of the scope
+class LogScope{
+
+private:
+
+    LogContext saved;
+
+public:
+
+    LogScope(int trx_id, LogType type, lsn_t * last_lsn, keyval_t key = 0, lsn_t undo_next_lsn = NO_LSN);
+
+    // Keep the current owner and change only the type of the records it writes
+    LogScope(LogType type);
+
+    ~LogScope();
+};
+
+// Structure-modifying operation (db_insert/db_delete) logged as a short internal transaction,
+// so that recovery can roll a half-done split or merge back as a whole
+class SystemOp{
+
+private:
+
+    int op_id;
+    lsn_t last_lsn;
+    LogScope scope;
+
+public:
+
+    SystemOp(LogType type);
+    ~SystemOp();
+};
+
+// Whether the log of log_manager has failed; nothing changed from then on can be logged
+bool log_failed();
+
+// Log the change between old_page and new_page under the owner of the calling thread
+// Return the LSN of the record, or NO_LSN if nothing was logged (or the log has failed)
+lsn_t log_page_write(int table_id, Pagenum_t page_num, const Page_t * old_page, const Page_t * new_page);
+
+// Log a record without images (BEGIN, COMMIT, ROLLBACK) and return its LSN, or NO_LSN if the log has failed
+lsn_t log_trx_record(int trx_id, LogType type, lsn_t prev_lsn);
+
+// Log that the file at pathname is opened as table_id
+// Recovery finds the file the records of a table ID refer to through these records
+lsn_t log_table_open(int table_id, const char * pathname);
+
+// Log a checkpoint record carrying length bytes of payload and return its LSN, or NO_LSN if the log has failed
+lsn_t log_checkpoint(const char * payload, int length);
+
+#endif /* __LOG_H__ */
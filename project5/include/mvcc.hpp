@@ -0,0 +1,101 @@
+#ifndef __MVCC_H__
+#define __MVCC_H__
+
+#include "transaction.hpp"
+
+#define VERSION_STORE_STRIPES 64
+
+// Number of old versions that triggers a full garbage collection
+#define VERSION_GC_THRESHOLD 4096
+
+/*
+ * Multi-versioning for snapshot transactions
+ *
+ * The page always holds the newest value of a record, committed or not.
+ * Before a transaction overwrites a value for the first time, the value is
+ * saved in the version store together with the commit timestamp it became
+ * visible at. A snapshot transaction reads, without any lock, the newest
+ * value committed at or before the timestamp it got at begin_trx.
+ * Versions no active snapshot can see any more are garbage collected.
+ */
+
+// Committed value of a record, visible from begin_ts until the next newer value
+struct Version{
+    uint64_t begin_ts;
+    char value[120];
+};
+
+struct VersionChain{
+
+    // commit timestamp of the value in the page
+    uint64_t latest_ts;
+
+    // transaction whose uncommitted value is in the page (0 if none)
+    int writer;
+
+    // older values, newest first
+    deque<Version> versions;
+};
+
+class VersionStore{
+
+private:
+
+    struct Stripe{
+        mutex latch;
+        unordered_map<pair<int, keyval_t>, VersionChain, RIDHasher> chains;
+    };
+
+    Stripe stripes[VERSION_STORE_STRIPES];
+
+    // guards the timestamps and the active snapshots
+    mutex ts_latch;
+
+    // every commit up to visible_ts is published in the version chains
+    uint64_t visible_ts;
+
+    multiset<uint64_t> snapshots;
+
+    atomic<int64_t> num_versions, gc_threshold;
+
+    Stripe & stripe_of(int table_id, keyval_t key);
+
+    // Oldest timestamp an active or future snapshot may read at
+    uint64_t oldest_snapshot();
+
+    // Drop the versions of chain no snapshot at or after oldest_ts can see
+    // Return true if the chain itself is not needed any more
+    bool prune(VersionChain & chain, uint64_t oldest_ts);
+
+public:
+
+    VersionStore();
+
+    // Take a snapshot timestamp / release it
+    uint64_t begin_snapshot();
+    void end_snapshot(uint64_t snapshot_ts);
+
+    // Save old_value before trx_id overwrites the record for the first time
+    // Called with the latch of the page frame held
+    void save_version(int trx_id, int table_id, keyval_t key, const char * old_value);
+
+    // Find the value of the record visible at snapshot_ts, given the value in the page
+    // Called with the latch of the page frame held
+    void read_version(int table_id, keyval_t key, uint64_t snapshot_ts, const char * page_value, char * ret_val);
+
+    // Find the newest committed value of the record, or the value trx_id wrote if it has changed it
+    // Called with the latch of the page frame held
+    void read_committed(int table_id, keyval_t key, int trx_id, const char * page_value, char * ret_val);
+
+    // Publish the updates of a committing transaction / forget the versions of an aborted one
+    void commit(Transaction * trx);
+    void abort(Transaction * trx);
+
+    void collect_garbage();
+
+    void print_status();
+};
+
+extern VersionStore * version_store;
+
+#endif /* __MVCC_H__ */
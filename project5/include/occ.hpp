@@ -0,0 +1,80 @@
+#ifndef __OCC_H__
+#define __OCC_H__
+
+#include "transaction.hpp"
+
+#define RECORD_VERSION_STRIPES 64
+
+// Number of idle entries that triggers a sweep once no optimistic transaction runs
+#define RECORD_VERSION_SWEEP_THRESHOLD 4096
+
+/*
+ * Record versions for optimistic transactions
+ *
+ * An optimistic transaction reads without locks and buffers its writes.
+ * For every record it reads it remembers the version the record had, and
+ * at end_trx it locks its write set, checks that none of those versions
+ * changed, and only then applies the writes.
+ *
+ * A record is marked with its writer from the first update of a locking
+ * transaction (or the validation of an optimistic one) until the writer
+ * ends, and its version is bumped then. Reading a marked record, or finding
+ * a different version at validation, aborts the optimistic transaction.
+ * Records without an entry are at version 0. Entries are only dropped while
+ * no optimistic transaction runs, so a version never goes back to a value
+ * a reader may have seen.
+ */
+
+struct RecordVersion{
+
+    uint64_t version;
+
+    // transaction that may change the record (0 if none)
+    int writer;
+};
+
+class RecordVersionTable{
+
+private:
+
+    struct Stripe{
+        mutex latch;
+        unordered_map<pair<int, keyval_t>, RecordVersion, RIDHasher> entries;
+    };
+
+    Stripe stripes[RECORD_VERSION_STRIPES];
+
+    // optimistic transactions running now
+    atomic<int> num_readers;
+
+    Stripe & stripe_of(int table_id, keyval_t key);
+
+    // Drop every idle entry if no optimistic transaction runs
+    void sweep();
+
+public:
+
+    RecordVersionTable();
+
+    // Register an optimistic transaction / unregister it
+    void begin_reader();
+    void end_reader();
+
+    // Version and writer of the record
+    RecordVersion read(int table_id, keyval_t key);
+
+    // Mark trx_id as the writer of the record
+    void lock(int trx_id, int table_id, keyval_t key);
+
+    // Clear the mark of trx_id on the record, bumping the version if the record may have changed
+    void unlock(int trx_id, int table_id, keyval_t key, bool changed);
+
+    // Whether every record in read_set is still at the version read and not marked by another transaction
+    bool validate(int trx_id, const ReadSet & read_set);
+
+    void print_status();
+};
+
+extern RecordVersionTable * record_versions;
+
+#endif /* __OCC_H__ */
@@ -0,0 +1,96 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "utility.hpp"
+
+// Number of free blocks each thread keeps per pool; the rest go back to the heap
+#define POOL_MAX_FREE_BLOCKS 4096
+
+/* Thread-local free list of memory blocks sized for a T.
+ * A block freed by one thread is reused by the next allocation of that thread,
+ * without going through the heap. Blocks may be freed by another thread than the
+ * one that allocated them, and a thread returns its free blocks to the heap when it exits.
+ */
+template <typename T>
+class ObjectPool{
+
+private:
+
+    union Block{
+        Block * next;
+        alignas(T) char object[sizeof(T)];
+    };
+
+    struct FreeList{
+        Block * head = nullptr;
+        int num_blocks = 0;
+
+        ~FreeList(){
+            while (head != nullptr){
+                Block * block = head;
+                head = block->next;
+                ::operator delete(block);
+            }
+        }
+    };
+
+    static thread_local FreeList free_list;
+
+public:
+
+    static void * allocate(){
+        Block * block = free_list.head;
+        if (block == nullptr){
+            return ::operator new(sizeof(Block));
+        }
+        free_list.head = block->next;
+        free_list.num_blocks--;
+        return block;
+    }
+
+    static void deallocate(void * ptr){
+        if (free_list.num_blocks >= POOL_MAX_FREE_BLOCKS){
+            ::operator delete(ptr);
+            return;
+        }
+        Block * block = static_cast<Block *>(ptr);
+        block->next = free_list.head;
+        free_list.head = block;
+        free_list.num_blocks++;
+    }
+};
+
+template <typename T>
+thread_local typename ObjectPool<T>::FreeList ObjectPool<T>::free_list;
+
+/* Allocator for node-based containers (list, map, unordered_map) taking their
+ * nodes from an ObjectPool. Arrays, such as hash buckets, still come from the heap.
+ */
+template <typename T>
+struct PoolAllocator{
+
+    typedef T value_type;
+
+    PoolAllocator() noexcept {}
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> &) noexcept {}
+
+    T * allocate(size_t n){
+        if (n == 1) return static_cast<T *>(ObjectPool<T>::allocate());
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T * ptr, size_t n){
+        if (n == 1) ObjectPool<T>::deallocate(ptr);
+        else ::operator delete(ptr);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &){ return true; }
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &){ return false; }
+
+#endif /* __POOL_H__ */
@@ -0,0 +1,126 @@
+#ifndef __RECOVERY_H__
+#define __RECOVERY_H__
+
+#include "transaction.hpp"
+
+#define MAX_REDO_THREADS 8
+
+// Number of records a redo worker may have queued before the log reader waits
+#define REDO_QUEUE_CAPACITY 1024
+
+// A checkpoint is taken when either interval has passed since the last one (0 disables it)
+#define DEFAULT_CHECKPOINT_INTERVAL_MS 30000
+#define DEFAULT_CHECKPOINT_INTERVAL_BYTES (64ULL << 20)
+
+// How often the checkpoint thread looks at the intervals
+#define CHECKPOINT_POLL_MS 100
+
+// Costs used to estimate the recovery time: log bytes scanned per second,
+// and milliseconds to read a dirty page back
+#define ESTIMATED_LOG_SCAN_RATE (100 << 20)
+#define ESTIMATED_PAGE_READ_MS 0.1
+
+/*
+ * Crash recovery
+ *
+ * Recovery runs in three passes over the write-ahead log, following ARIES.
+ * Analysis reads the log from the beginning, reopens the files the records refer
+ * to and finds the transactions and system operations which had not finished.
+ * Redo repeats history: every page record whose LSN is newer than the page is
+ * applied again. It runs in the same scan as analysis, handing the records to
+ * worker threads partitioned by page, so the records of a page stay in order.
+ * Undo rolls the unfinished ones back from the newest record to the oldest,
+ * logging compensation records so that a crash during recovery never undoes
+ * a record twice. Last, the B-link splits a crash cut short between two
+ * levels are finished.
+ *
+ * Fuzzy checkpoints bound the work: a checkpoint record holds the open tables,
+ * the dirty page table and the active transaction table as of its begin LSN,
+ * taken without stopping the other threads. Recovery starts from the last
+ * checkpoint, redoing from the oldest rec_lsn of its dirty pages, and the log
+ * older than what recovery may still need is dropped. Before each checkpoint
+ * the page cleaner writes the pages dirty since before the previous one, so
+ * the redo start point keeps moving forward.
+ */
+
+struct RecoveryStat{
+    uint64_t num_records;
+    uint64_t num_redone;
+    uint64_t num_undone;
+    int num_losers;
+    int num_threads;
+};
+
+// Recover the tables referred by the log of log_manager with num_threads redo workers
+// Every table is flushed and closed again when the recovery is done
+// Return SUCCESS, or FAILURE if a table could not be reopened
+int recover_db(int num_threads, RecoveryStat * stat);
+
+struct CheckpointStat{
+    uint64_t num_checkpoints;
+
+    // CHECKPOINT record of the last checkpoint and its begin LSN
+    lsn_t checkpoint_lsn;
+    lsn_t begin_lsn;
+
+    // recovery would redo from redo_lsn and needs the log from start_lsn
+    lsn_t redo_lsn;
+    lsn_t start_lsn;
+
+    int num_cleaned_pages;
+    int num_dirty_pages;
+    int num_active_trx;
+
+    double duration_ms;
+    double recovery_estimate_ms;
+};
+
+class Checkpointer{
+
+private:
+
+    // serializes checkpoints
+    mutex latch;
+
+    // wakes the checkpoint thread up on termination
+    mutex wait_latch;
+    condition_variable cond;
+    bool terminate;
+
+    int interval_ms;
+    uint64_t interval_bytes;
+
+    CheckpointStat stat;
+
+    // end of the log right after the last checkpoint
+    lsn_t idle_lsn;
+
+    thread worker;
+
+    void run();
+
+public:
+
+    Checkpointer(int interval_ms, uint64_t interval_bytes);
+    ~Checkpointer();
+
+    void set_interval(int interval_ms, uint64_t interval_bytes);
+
+    // Clean the old dirty pages, log a checkpoint and truncate the log behind it
+    int checkpoint();
+
+    CheckpointStat get_stat();
+};
+
+extern Checkpointer * checkpointer;
+
+// Take a checkpoint every interval_ms milliseconds or interval_bytes of log,
+// whichever comes first (0 disables either)
+int set_checkpoint_interval(int interval_ms, uint64_t interval_bytes);
+
+// Take a checkpoint now
+int take_checkpoint();
+
+void print_checkpoint_status();
+
+#endif /* __RECOVERY_H__ */
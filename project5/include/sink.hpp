@@ -0,0 +1,80 @@
+#ifndef __SINK_H__
+#define __SINK_H__
+
+#include "utility.hpp"
+
+#include <sys/uio.h>
+
+// Size of the user-space buffer of an output sink
+#define DEFAULT_SINK_BUFFER_SIZE (1 << 22)
+
+// Alignment of the buffer, file offset and length of O_DIRECT writes
+#define SINK_DIRECT_ALIGNMENT 4096
+
+// Flags of OutputSink
+#define SINK_DIRECT 0x1     // write around the page cache with O_DIRECT
+#define SINK_SYNC 0x2       // fdatasync the file on close
+
+/*
+ * Buffered writer of text output
+ *
+ * Rows are formatted straight into a large buffer which only goes to the
+ * file when it is full, so a write(2) covers thousands of rows. Integers are
+ * formatted by hand instead of going through the iostream locale machinery.
+ *
+ * A slice too large to be worth copying is written together with the buffered
+ * bytes in one writev(2). With SINK_DIRECT the file is opened with O_DIRECT
+ * (falling back to buffered I/O where the file system refuses it); only whole
+ * aligned blocks are written until close, which clears O_DIRECT with fcntl(2)
+ * and writes the partial block at the tail through the page cache.
+ */
+class OutputSink{
+
+private:
+
+    int fd;
+    int flags;
+    bool direct;
+    bool failed;
+
+    char * buffer;
+    size_t capacity, size;
+
+    uint64_t bytes_written;
+
+    int write_fully(const char * data, size_t length);
+    int writev_fully(struct iovec * iov, int iovcnt);
+    int finish_direct();
+
+public:
+
+    OutputSink(const char * pathname, size_t buffer_size = DEFAULT_SINK_BUFFER_SIZE, int flags = 0);
+    ~OutputSink();
+
+    bool is_open() const { return fd >= 0 && !failed; }
+
+    // Number of bytes written so far, buffered ones included
+    uint64_t get_bytes_written() const { return bytes_written + size; }
+
+    void put(char c){
+        if (size == capacity) flush_buffer();
+        buffer[size++] = c;
+    }
+
+    void write(const char * data, size_t length);
+
+    // Write a NUL-terminated string of at most max_length bytes
+    void write_str(const char * str, size_t max_length){
+        write(str, strnlen(str, max_length));
+    }
+
+    void write_int(int64_t value);
+
+    // Write out the buffer. With O_DIRECT the unaligned tail stays buffered.
+    int flush_buffer();
+
+    // Flush everything and close the file. Return 0 if success, otherwise -1.
+    int close();
+};
+
+#endif /* __SINK_H__ */
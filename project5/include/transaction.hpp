@@ -2,15 +2,19 @@
 #define __TRANSACTION_H__
 
 #include <bpt.hpp>
+#include <pool.hpp>
 
 
 struct UndoLog{
 
-    UndoLog(int, keyval_t, string);
+    UndoLog(int, keyval_t, const char *, lsn_t);
 
     int table_id;
     keyval_t key;
-    string old_value;
+    char old_value[120];
+
+    // LSN the transaction had logged right before this update
+    lsn_t prev_lsn;
 };
 
 
@@ -18,47 +22,145 @@ enum class TransactionState {
     IDLE, RUNNING, WAITING 
 };
 
+/* Records are locked under a lock on their table. A record lock needs an
+ * intention lock on the table first: INTENTION_SHARED for a shared record
+ * lock, INTENTION_EXCLUSIVE for an exclusive one. A shared or exclusive table
+ * lock covers every record of the table, and SHARED_INTENTION_EXCLUSIVE
+ * reads the whole table while locking the records it changes.
+ * The modes are ordered from the weakest to the strongest.
+ */
 enum class LockMode { 
-    SHARED, EXCLUSIVE
+    INTENTION_SHARED, INTENTION_EXCLUSIVE, SHARED, SHARED_INTENTION_EXCLUSIVE, EXCLUSIVE
+};
+
+// Default number of record locks a transaction takes in one table before they escalate to a table lock
+#define DEFAULT_LOCK_ESCALATION_THRESHOLD 1000
+
+// Default time a lock request waits before it gives up and its transaction is aborted
+#define DEFAULT_LOCK_WAIT_TIMEOUT_MS 10000
+
+// Lock counters of one transaction, or of every transaction since init_db
+struct LockStat{
+
+    // locks granted, table locks included
+    uint64_t num_acquired;
+
+    // lock requests that had to wait, and how long they waited in total and at most
+    uint64_t num_waits;
+    uint64_t total_wait_ns;
+    uint64_t max_wait_ns;
+
+    // lock requests refused because waiting would deadlock, or given up after the timeout
+    uint64_t num_deadlocks;
+    uint64_t num_timeouts;
+};
+
+enum class TrxMode {
+    // reads and writes under strict 2PL
+    LOCKING,
+
+    // read-only, reads the snapshot taken at begin_trx without any lock
+    SNAPSHOT,
+
+    // reads without locks and buffers its writes, which end_trx validates and applies
+    OPTIMISTIC
+};
+
+// Isolation level of a LOCKING transaction
+// Updates always hold exclusive locks until the transaction ends
+enum class IsolationLevel {
+    // reads the newest committed value of a record without any lock
+    READ_COMMITTED,
+
+    // holds shared locks on what it read until the transaction ends
+    // With only point reads and updates, this is serializable
+    REPEATABLE_READ
 };
 
 struct Lock;
 
+// (table ID, key) -> version read, or new value written by an optimistic transaction
+typedef map<pair<int, keyval_t>, uint64_t, less<pair<int, keyval_t>>,
+    PoolAllocator<pair<const pair<int, keyval_t>, uint64_t>>> ReadSet;
+typedef map<pair<int, keyval_t>, string, less<pair<int, keyval_t>>,
+    PoolAllocator<pair<const pair<int, keyval_t>, string>>> WriteSet;
+
 struct Transaction {
 
     int trx_id;
     bool is_working;
 
+    TrxMode mode;
+    IsolationLevel isolation;
+
+    // commit timestamp a SNAPSHOT transaction reads at
+    uint64_t snapshot_ts;
+
+    // OPTIMISTIC: version of every record read, and the buffered new values
+    ReadSet read_set;
+    WriteSet write_set;
+
     TransactionState trx_state;
 
-    list<Lock*> acquired_locks;
+    list<Lock*, PoolAllocator<Lock*>> acquired_locks;
+
+    // Lock counters of this transaction, guarded by the lock manager
+    LockStat lock_stat;
+
+    // Strongest table lock granted in each table (or nullptr), and number of record locks
+    // held in each table
+    // Guarded by the lock manager
+    Lock * table_locks[MAX_TABLE_NUMBER + 1];
+    int num_record_locks[MAX_TABLE_NUMBER + 1];
 
     mutex trx_mutex;
     condition_variable trx_cond;
 
     Lock* wait_lock;
 
-    list<UndoLog> undo_log_list;
+    list<UndoLog, PoolAllocator<UndoLog>> undo_log_list;
 
-    Transaction(int trx_id){
-        trx_id = trx_id;
-        is_working = false;
-    }
+    // LSN of the last log record written by this transaction
+    lsn_t last_lsn;
+
+    // Newest commit LSN of the transactions whose early released records this one read
+    // The transaction doesn't return from end_trx before that commit is durable
+    lsn_t depends_lsn;
+
+    Transaction(int trx_id) : trx_id(trx_id), is_working(false), mode(TrxMode::LOCKING), isolation(IsolationLevel::REPEATABLE_READ), snapshot_ts(0), trx_state(TransactionState::IDLE),
+        lock_stat(), table_locks(), num_record_locks(), wait_lock(nullptr), last_lsn(NO_LSN), depends_lsn(NO_LSN) {}
 
     void unlock_all();
 
+    // Transactions are allocated from a thread-local pool of sizeof(Transaction) blocks
+    static void * operator new(size_t){ return ObjectPool<Transaction>::allocate(); }
+    static void operator delete(void * ptr){ ObjectPool<Transaction>::deallocate(ptr); }
+
 };
 
+// Number of stripes of the transaction table
+#define TRX_TABLE_STRIPES 64
+
+/* Transaction IDs come from an atomic counter, and the active transactions
+ * are kept in a hash map split into stripes by transaction ID, each under
+ * its own latch. Consecutive IDs fall into different stripes, so
+ * transactions that begin and end concurrently rarely share a latch.
+ */
 class TransactionManager{
 
 private:
 
-    deque<Transaction*> trx_table;
+    struct Stripe{
+        mutex latch;
+        unordered_map<int, Transaction*, hash<int>, equal_to<int>, PoolAllocator<pair<const int, Transaction*>>> trx_table;
+    };
 
-    int next_trx_id;
+    Stripe stripes[TRX_TABLE_STRIPES];
+
+    atomic<int> next_trx_id;
     bool is_working;
 
-    mutex trx_manager_mutex;
+    Stripe & get_stripe(int trx_id);
 
 public:
 
@@ -66,20 +168,32 @@ public:
     ~TransactionManager();
 
     Transaction* add_new_trx();
+    Transaction* get_trx(int trx_id);
     bool clear_trx(int trx_id);
 
-    int current_id;
-    mutex work_mutex;
+    // Copy the lock counters of a running transaction, which can't end meanwhile
+    // Return false if there is no such transaction
+    bool get_lock_stat(int trx_id, LockStat * stat);
+};
+
+struct RIDHasher{
+    inline size_t operator()(const pair<int, keyval_t> & rid) const{
+        return (hash<int>()(rid.first) >> 1) ^ (hash<int64_t>()(rid.second) << 1);
+    }
 };
 
 struct Lock{
 
     Lock();
-    Lock(int, Pagenum_t, enum LockMode);
+    Lock(int, Pagenum_t, keyval_t, enum LockMode, Transaction*);
+    Lock(int, enum LockMode, Transaction*);
     
     int table_id;
     Transaction* trx;
 
+    // Whether this locks the whole table rather than the record of key
+    bool is_table_lock;
+
     Pagenum_t page_num;
     keyval_t key;
 
@@ -88,22 +202,133 @@ struct Lock{
 
     Lock * prev;
     Lock * next;
+
+    // Locks are allocated from a thread-local pool of sizeof(Lock) blocks, and mostly freed by the thread that took them
+    static void * operator new(size_t){ return ObjectPool<Lock>::allocate(); }
+    static void operator delete(void * ptr){ ObjectPool<Lock>::deallocate(ptr); }
 };
 
+typedef pair<Lock*, Lock*> LockList;
+
 class LockManager{
 
 private:
 
-    unordered_map<pair<int, Pagenum_t>, pair<Lock*, Lock*>, PIDHasher> lock_table;
+    // (table ID, key) -> first and last lock of the lock list on that record
+    unordered_map<pair<int, keyval_t>, LockList, RIDHasher, equal_to<pair<int, keyval_t>>,
+        PoolAllocator<pair<const pair<int, keyval_t>, LockList>>> lock_table;
+
+    // table ID -> first and last lock of the lock list on that table
+    unordered_map<int, LockList, hash<int>, equal_to<int>, PoolAllocator<pair<const int, LockList>>> table_lock_table;
 
     mutex lock_manager_mutex;
 
+    // Lock counters of every transaction
+    LockStat global_stat;
+
+    LockList * find_lock_list(Lock * lock);
+    bool conflicts(Lock * lock, Lock * other);
+    bool is_upgrade(Lock * lock);
+    bool waits_for(Lock * lock, Lock * other, bool upgrade, bool ahead);
+    bool is_grantable(Lock * lock);
+    bool detect_deadlock(Transaction * trx);
+
+    void append_lock(Lock * lock);
+    void remove_lock(Lock * lock);
+
+    // Grant lock to its transaction, waiting for conflicting locks if wait is set
+    // Return FAILURE if waiting would cause a deadlock or outlast lock_wait_timeout_ms,
+    // or if the lock isn't grantable at once without wait
+    int grant(Transaction * trx, Lock * lock, unique_lock<mutex> & guard, bool wait);
+
+    int convert_table_lock(Transaction * trx, int table_id, LockMode mode, unique_lock<mutex> & guard, bool wait);
+    void escalate(Transaction * trx, int table_id, unique_lock<mutex> & guard);
+
 public:
 
     LockManager();
+
+    // Acquire a record lock for trx, waiting while a conflicting lock is held
+    // The matching intention lock on the table is acquired first, and no record lock is
+    // taken when trx holds a table lock covering it already
+    // Once trx holds more than lock_escalation_threshold record locks in the table,
+    // they are replaced with one table lock if it can be granted without waiting
+    // Return SUCCESS, or FAILURE if waiting would cause a deadlock or time out
+    int acquire(Transaction * trx, int table_id, Pagenum_t page_num, keyval_t key, LockMode mode);
+
+    // Acquire a lock on the whole table for trx, waiting while a conflicting lock is held
+    // Return SUCCESS, or FAILURE if waiting would cause a deadlock or time out
+    int acquire_table(Transaction * trx, int table_id, LockMode mode);
+
+    // Copy the lock counters of trx, or of every transaction if trx is nullptr
+    void get_stat(Transaction * trx, LockStat * stat);
+
+    void print_status();
+
+    // Release every lock held by trx and wake up the transactions waiting for them
+    void release_all(Transaction * trx);
 };
 
 extern LockManager * lock_manager;
+
+// Number of record locks in one table past which a transaction escalates to a table lock
+// Escalation is off when this is 0 or less
+extern int lock_escalation_threshold;
+
+// Milliseconds a lock request waits before giving up, which aborts its transaction
+// Lock requests wait as long as it takes when this is 0 or less
+extern int lock_wait_timeout_ms;
+
+#define EARLY_RELEASE_STRIPES 64
+
+// Number of entries that triggers dropping the ones whose commit is durable
+#define EARLY_RELEASE_PRUNE_THRESHOLD 4096
+
+/* Early lock release
+ *
+ * A committing transaction releases its locks once its commit record is in
+ * the log buffer, instead of holding them while the group commit syncs it.
+ * Transactions waiting for the same hot records then run during the sync.
+ * Anyone who reads a released record before the commit is durable depends
+ * on that commit. This table keeps the commit LSN of such records until
+ * the commit is durable, and a reader remembers the newest LSN it depended
+ * on. end_trx returns only once that LSN is durable too. A writer always
+ * waits for its own later commit record, which covers every commit before it.
+ */
+class EarlyReleaseTable{
+
+private:
+
+    struct Stripe{
+        mutex latch;
+        unordered_map<pair<int, keyval_t>, lsn_t, RIDHasher, equal_to<pair<int, keyval_t>>,
+            PoolAllocator<pair<const pair<int, keyval_t>, lsn_t>>> entries;
+    };
+
+    Stripe stripes[EARLY_RELEASE_STRIPES];
+
+    atomic<int64_t> num_entries;
+
+    Stripe & stripe_of(int table_id, keyval_t key);
+
+    // Drop every entry whose commit is durable
+    void prune();
+
+public:
+
+    EarlyReleaseTable();
+
+    // Record the commit LSN of trx on every record it changed, before its locks are released
+    void release(Transaction * trx, lsn_t commit_lsn);
+
+    // Commit LSN a reader of the record has to wait for, or NO_LSN if it is durable
+    lsn_t depends_on(int table_id, keyval_t key);
+};
+
+extern EarlyReleaseTable * early_releases;
+
+// Whether committing transactions release their locks before their commit record is durable
+extern bool early_lock_release;
 extern TransactionManager * trx_manager;
 
 /* Allocate transaction structure and initialize it.
@@ -114,9 +339,18 @@ extern TransactionManager * trx_manager;
  */
 int begin_trx();
 
+// Same as begin_trx(), running the transaction in the given mode
+int begin_trx(TrxMode mode);
+
+// Same as begin_trx(), running a LOCKING transaction at the given isolation level
+int begin_trx(IsolationLevel isolation);
+
 /* Clean up the transaction with given tid (transaction id) and its related information
  * that has been used in your lock manager. (Shrinking phase of strict 2PL)
  * Return the completed transaction id if success, otherwise return 0.
+ * An OPTIMISTIC transaction that fails validation is aborted, and 0 is returned.
+ * 0 is also returned if the log could not make the commit durable, and if it has
+ * failed before the commit record, the transaction is rolled back as well.
  */
 int end_trx(int tid);
 
@@ -141,6 +375,19 @@ int db_find(int table_id, keyval_t key, char* ret_val, int trx_id);
  */
 int db_update(int table_id, keyval_t keyj, char* values, int trx_id);
 
+// Store the lock counters of the running transaction trx_id, or of every transaction
+// since init_db if trx_id is 0
+// Return SUCCESS, or FAILURE if there is no such running transaction
+int get_lock_stat(int trx_id, LockStat * stat);
+
+// Roll back every update of the transaction, release its locks and remove it
+void abort_trx(Transaction * trx);
+
+// Overwrite length bytes at offset of the value of key with image, logging it as a compensation
+// record of the log owner of the calling thread
+// Used to undo an update wherever the record lives now
+int undo_update(int table_id, keyval_t key, int offset, const char * image, int length);
+
 
 #endif /* __TRANSACTION_H__ */
 
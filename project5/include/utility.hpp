@@ -18,10 +18,16 @@
 #include <list>
 #include <unordered_map>
 #include <stack>
+#include <set>
+#include <deque>
+#include <vector>
 
 #include <mutex>
+#include <shared_mutex>
 #include <thread>
 #include <condition_variable>
+#include <atomic>
+#include <chrono>
 
 #define PAGE_SIZE 4096
 #define DEFAULT_NEW_PAGE_COUNT 128
@@ -45,8 +51,15 @@
 #define LEAF_ORDER 32
 #define INTERNAL_ORDER 249
 
+// Order of internal nodes of a table that keeps subtree counts
+#define COUNTED_INTERNAL_ORDER 199
+
 #define COMMA ','
 
+#define DEFAULT_LOG_PATH "bpt.log"
+#define DEFAULT_LOG_BUFFER_SIZE (1 << 20)
+#define NO_LSN 0
+
 #define LEFT 0
 #define RIGHT 1
 
@@ -56,11 +69,13 @@
 #define PAGE_CONTENTS(block) block->frame.node_page
 
 #define INTERNAL_VAL(node, i) i ? node.in_record[i - 1].page_num : node.extra_page_num
+#define SUBTREE_COUNT(node, i) node.counted.subtree_count[i]
 
 using namespace std;
 
 typedef uint64_t Pagenum_t;
 typedef uint64_t offset_t;
 typedef int64_t keyval_t;
+typedef uint64_t lsn_t;
 
 #endif /* __UTILITY_H__ */
\ No newline at end of file
@@ -0,0 +1,169 @@
+#include <aggregate.hpp>
+
+#include <algorithm>
+
+// Sum the keys of records[first, last)
+// Keys are 128 bytes apart, so four independent sums keep the adds from waiting on each other.
+static inline uint64_t sum_keys(const LeafRecord * records, int first, int last){
+
+    uint64_t sum_0 = 0, sum_1 = 0, sum_2 = 0, sum_3 = 0;
+    int i = first;
+
+    for (; i + 4 <= last; i += 4){
+        sum_0 += (uint64_t)records[i].key;
+        sum_1 += (uint64_t)records[i + 1].key;
+        sum_2 += (uint64_t)records[i + 2].key;
+        sum_3 += (uint64_t)records[i + 3].key;
+    }
+    for (; i < last; i++){
+        sum_0 += (uint64_t)records[i].key;
+    }
+    return sum_0 + sum_1 + sum_2 + sum_3;
+}
+
+// Index of the first record of leaf with a key not below key
+static inline int first_not_below(const NodePage_t & leaf, keyval_t key){
+    if (leaf.num_key == 0 || leaf.lf_record[0].key >= key){
+        return 0;
+    }
+    return lower_bound(leaf.lf_record, leaf.lf_record + leaf.num_key, key,
+        [](const LeafRecord & record, keyval_t key){ return record.key < key; }) - leaf.lf_record;
+}
+
+// Index past the last record of leaf with a key not above key
+static inline int last_not_above(const NodePage_t & leaf, keyval_t key){
+    if (leaf.num_key == 0 || leaf.lf_record[leaf.num_key - 1].key <= key){
+        return leaf.num_key;
+    }
+    return upper_bound(leaf.lf_record, leaf.lf_record + leaf.num_key, key,
+        [](keyval_t key, const LeafRecord & record){ return key < record.key; }) - leaf.lf_record;
+}
+
+int db_aggregate(int table_id, keyval_t low, keyval_t high, int parts, KeyAggregate * result){
+
+    if (table_id < 1 || table_id > MAX_TABLE_NUMBER || tables.in_use[table_id] == false){
+        return FAILURE;
+    }
+
+    result->count = 0;
+    result->min_key = 0;
+    result->max_key = 0;
+    result->sum = 0;
+
+    if (low > high){
+        return SUCCESS;
+    }
+
+    PageLatch & root_latch = tables.root_latch[table_id];
+    root_latch.lock_shared();
+
+    // With subtree counts, the number of keys is the difference of two ranks
+    if (parts == AGGREGATE_COUNT && has_subtree_counts(table_id)){
+        result->count = count_keys_below(table_id, high, true) - count_keys_below(table_id, low, false);
+        root_latch.unlock_shared();
+        return SUCCESS;
+    }
+
+    // The maximum alone is in the leaf of high, unless the range ends in a gap before it
+    if (parts == AGGREGATE_MAX){
+        BufferBlock_t * frame = find_leaf_frame_shared(table_id, high);
+        if (frame != nullptr){
+            NodePage_t & leaf = PAGE_CONTENTS(frame);
+            int first = first_not_below(leaf, low), last = last_not_above(leaf, high);
+            if (first < last){
+                result->count = last - first;
+                result->min_key = leaf.lf_record[first].key;
+                result->max_key = leaf.lf_record[last - 1].key;
+            }
+            frame->latch.unlock_shared();
+            buffer_unpin_page(frame, 1);
+        }
+        if (result->count > 0 || frame == nullptr){
+            root_latch.unlock_shared();
+            return SUCCESS;
+        }
+    }
+
+    BufferBlock_t * frame = find_leaf_frame_shared(table_id, low);
+    uint64_t sum = 0;
+
+    while (frame != nullptr){
+
+        NodePage_t & leaf = PAGE_CONTENTS(frame);
+        int first = first_not_below(leaf, low), last = last_not_above(leaf, high);
+
+        if (first < last){
+            if (result->count == 0){
+                result->min_key = leaf.lf_record[first].key;
+            }
+            result->max_key = leaf.lf_record[last - 1].key;
+            result->count += last - first;
+
+            if (parts & AGGREGATE_SUM){
+                sum += sum_keys(leaf.lf_record, first, last);
+            }
+        }
+
+        // Only the minimum is wanted, and it has been found
+        bool is_done = (parts & ~AGGREGATE_MIN) == 0 && result->count > 0;
+
+        // Keys up to high may go on in the right sibling only if high is past the high key
+        BufferBlock_t * next_frame = nullptr;
+        if (!is_done && beyond_high_key(leaf, high)){
+            next_frame = buffer_read_page(table_id, leaf.right_page_num);
+        }
+
+        frame->latch.unlock_shared();
+        buffer_unpin_page(frame, 1);
+
+        frame = next_frame;
+        if (frame != nullptr){
+            frame->latch.lock_shared();
+        }
+    }
+
+    root_latch.unlock_shared();
+
+    result->sum = (int64_t)sum;
+    return SUCCESS;
+}
+
+int db_count(int table_id, keyval_t low, keyval_t high, uint64_t * count){
+
+    KeyAggregate result;
+    if (db_aggregate(table_id, low, high, AGGREGATE_COUNT, &result) != SUCCESS){
+        return FAILURE;
+    }
+    *count = result.count;
+    return SUCCESS;
+}
+
+int db_min(int table_id, keyval_t low, keyval_t high, keyval_t * min_key){
+
+    KeyAggregate result;
+    if (db_aggregate(table_id, low, high, AGGREGATE_MIN, &result) != SUCCESS || result.count == 0){
+        return FAILURE;
+    }
+    *min_key = result.min_key;
+    return SUCCESS;
+}
+
+int db_max(int table_id, keyval_t low, keyval_t high, keyval_t * max_key){
+
+    KeyAggregate result;
+    if (db_aggregate(table_id, low, high, AGGREGATE_MAX, &result) != SUCCESS || result.count == 0){
+        return FAILURE;
+    }
+    *max_key = result.max_key;
+    return SUCCESS;
+}
+
+int db_sum(int table_id, keyval_t low, keyval_t high, int64_t * sum){
+
+    KeyAggregate result;
+    if (db_aggregate(table_id, low, high, AGGREGATE_SUM, &result) != SUCCESS){
+        return FAILURE;
+    }
+    *sum = result.sum;
+    return SUCCESS;
+}
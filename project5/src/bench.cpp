@@ -0,0 +1,555 @@
+#include "transaction.hpp"
+
+#include <getopt.h>
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <new>
+
+/*
+ * Benchmark driver for the transactional API
+ *
+ * Client threads run transactions against one table for a fixed duration.
+ * Each transaction does a fixed number of operations, each of which reads
+ * a record with db_find or overwrites it with db_update, on keys drawn from
+ * a uniform, Zipfian or latest distribution. Every key is loaded before the
+ * clock starts. A transaction whose operation or commit fails has already
+ * been rolled back by the API; it is counted as an abort and the client
+ * moves on to the next one.
+ *
+ * With --writers, more clients run next to them that only update, in
+ * locking transactions, so that snapshot readers can be timed under write
+ * load. Their results are reported on their own.
+ *
+ * With --insert-delete, the clients also insert and delete keys past the
+ * loaded ones outside transactions, which splits and merges nodes under
+ * the transactions of the other clients, and check_tree runs at the end.
+ *
+ * Throughput, abort rate and the latency of committed transactions
+ * (from begin_trx to end_trx) are printed, and written as JSON with --json.
+ * So are the heap allocations the clients make per transaction, counted by
+ * replacing the global operator new of this program.
+ */
+
+// Heap allocations made by the calling thread
+static thread_local uint64_t num_allocs = 0;
+
+void * operator new(size_t size){
+    num_allocs++;
+    void * ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) throw bad_alloc();
+    return ptr;
+}
+
+void operator delete(void * ptr) noexcept{
+    free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept{
+    free(ptr);
+}
+
+enum class KeyDistribution { UNIFORM, ZIPF, LATEST };
+
+struct BenchConfig{
+    int num_threads;
+    int num_writers;
+    double duration_s;
+    double read_ratio;
+    double change_ratio;
+    int ops_per_trx;
+    keyval_t num_keys;
+    KeyDistribution distribution;
+    double zipf_theta;
+    TrxMode mode;
+    IsolationLevel isolation;
+    int num_buf;
+    const char * table_path;
+    const char * log_path;
+    const char * json_path;
+    unsigned int seed;
+    int lock_timeout_ms;
+    bool early_lock_release;
+    bool optimistic_descent;
+};
+
+// Values are loaded and updated at the same length, since an update never grows a value
+#define BENCH_VALUE_FORMAT "%c%015ld"
+
+/* Zipfian generator of Gray et al., "Quickly generating billion-record
+ * synthetic databases", as YCSB uses it: rank 0 is the most popular.
+ */
+class ZipfGenerator{
+
+private:
+
+    uint64_t n;
+    double theta, alpha, zeta_n, eta;
+
+    static double zeta(uint64_t n, double theta){
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++)
+            sum += 1.0 / pow((double)i, theta);
+        return sum;
+    }
+
+public:
+
+    ZipfGenerator(uint64_t n, double theta)
+        : n(n), theta(theta), alpha(1.0 / (1.0 - theta)), zeta_n(zeta(n, theta)) {
+        eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta(2, theta) / zeta_n);
+    }
+
+    // Map u, uniform in [0, 1), to a rank in [0, n)
+    uint64_t next(double u){
+        double uz = u * zeta_n;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + pow(0.5, theta)) return 1;
+        return min(n - 1, (uint64_t)(n * pow(eta * u - eta + 1.0, alpha)));
+    }
+};
+
+// Spread the ranks over the key space, so that popular keys don't share leaves
+static keyval_t scramble(uint64_t rank, keyval_t num_keys){
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < 8; i++){
+        hash ^= (rank >> (i * 8)) & 0xff;
+        hash *= 1099511628211ULL;
+    }
+    return hash % num_keys;
+}
+
+struct ClientStat{
+    uint64_t num_commits;
+    uint64_t num_aborts;
+    uint64_t num_ops;
+
+    // inserts and deletes made outside transactions
+    uint64_t num_changes;
+
+    // heap allocations made while running transactions
+    uint64_t num_allocs;
+
+    // latency of every committed transaction in nanoseconds
+    vector<uint64_t> latencies;
+};
+
+static atomic<bool> stop_clients;
+
+// A writer runs locking transactions that only update, whatever the mode and read ratio of the clients
+static void run_client(const BenchConfig & config, int table_id, ZipfGenerator * zipf, int client, bool writer, ClientStat * stat){
+
+    TrxMode mode = writer ? TrxMode::LOCKING : config.mode;
+    double read_ratio = writer ? 0 : config.read_ratio;
+
+    mt19937_64 rng(config.seed + client);
+    uniform_real_distribution<double> unit(0.0, 1.0);
+    uniform_int_distribution<keyval_t> uniform(0, config.num_keys - 1);
+    char value[120];
+
+    // Room for every latency is made first, so that recording them allocates nothing
+    stat->latencies.reserve(1 << 20);
+    uint64_t first_alloc = num_allocs;
+
+    while (!stop_clients.load(memory_order_relaxed)){
+
+        // The key is inserted if the table doesn't have it, otherwise deleted.
+        // What they allocate is not charged to the transactions.
+        if (!writer && config.change_ratio > 0 && unit(rng) < config.change_ratio){
+            uint64_t change_allocs = num_allocs;
+            keyval_t key = config.num_keys + uniform(rng);
+            sprintf(value, BENCH_VALUE_FORMAT, 'i', (long)key);
+            if (db_insert(table_id, key, value) != SUCCESS){
+                db_delete(table_id, key);
+            }
+            stat->num_changes++;
+            first_alloc += num_allocs - change_allocs;
+            continue;
+        }
+
+        auto start = chrono::steady_clock::now();
+        int trx_id = mode == TrxMode::LOCKING ? begin_trx(config.isolation) : begin_trx(mode);
+        bool aborted = trx_id == 0;
+
+        for (int i = 0; i < config.ops_per_trx && !aborted; i++){
+
+            keyval_t key;
+            switch (config.distribution){
+            case KeyDistribution::ZIPF:
+                key = scramble(zipf->next(unit(rng)), config.num_keys);
+                break;
+            case KeyDistribution::LATEST:
+                // the keys loaded last are the most popular
+                key = config.num_keys - 1 - zipf->next(unit(rng));
+                break;
+            default:
+                key = uniform(rng);
+                break;
+            }
+
+            if (unit(rng) < read_ratio){
+                aborted = db_find(table_id, key, value, trx_id) != SUCCESS;
+            }
+            else {
+                sprintf(value, BENCH_VALUE_FORMAT, 'u', (long)rng() % 1000000000000000L);
+                aborted = db_update(table_id, key, value, trx_id) != SUCCESS;
+            }
+        }
+
+        if (!aborted){
+            aborted = end_trx(trx_id) == 0;
+        }
+
+        if (aborted){
+            stat->num_aborts++;
+            continue;
+        }
+
+        auto latency = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+        stat->latencies.push_back(latency.count());
+        stat->num_commits++;
+        stat->num_ops += config.ops_per_trx;
+    }
+
+    stat->num_allocs = num_allocs - first_alloc;
+}
+
+// Sum the results of a group of clients into total, with every latency sorted
+static void merge_stats(vector<ClientStat>::const_iterator begin, vector<ClientStat>::const_iterator end, ClientStat & total){
+    total = {0, 0, 0, 0, 0, {}};
+    for (auto stat = begin; stat != end; stat++){
+        total.num_commits += stat->num_commits;
+        total.num_aborts += stat->num_aborts;
+        total.num_ops += stat->num_ops;
+        total.num_changes += stat->num_changes;
+        total.num_allocs += stat->num_allocs;
+        total.latencies.insert(total.latencies.end(), stat->latencies.begin(), stat->latencies.end());
+    }
+    sort(total.latencies.begin(), total.latencies.end());
+}
+
+// Latency at quantile q of sorted latencies, in microseconds
+static double percentile(const vector<uint64_t> & latencies, double q){
+    if (latencies.empty()) return 0;
+    size_t index = min(latencies.size() - 1, (size_t)(q * latencies.size()));
+    return latencies[index] / 1000.0;
+}
+
+static const char * distribution_name(KeyDistribution distribution){
+    switch (distribution){
+    case KeyDistribution::ZIPF: return "zipf";
+    case KeyDistribution::LATEST: return "latest";
+    default: return "uniform";
+    }
+}
+
+static const char * isolation_name(IsolationLevel isolation){
+    return isolation == IsolationLevel::READ_COMMITTED ? "rc" : "rr";
+}
+
+static const char * mode_name(TrxMode mode){
+    switch (mode){
+    case TrxMode::SNAPSHOT: return "snapshot";
+    case TrxMode::OPTIMISTIC: return "optimistic";
+    default: return "locking";
+    }
+}
+
+static void print_usage(const char * program){
+    printf("Usage: %s [options]\n\n", program);
+    printf("-t, --threads N      : Number of client threads (default 4).\n");
+    printf("-W, --writers N      : Number of extra clients that only update, in locking transactions (default 0).\n");
+    printf("-d, --duration S     : Seconds to run for (default 10).\n");
+    printf("-r, --read-ratio R   : Fraction of operations that are reads (default 0.8).\n");
+    printf("-I, --insert-delete R: Fraction of client rounds that insert or delete a key past the loaded ones\n");
+    printf("                       outside a transaction, checking the tree at the end (default 0).\n");
+    printf("-o, --ops N          : Operations per transaction, 0 to time begin_trx and end_trx alone (default 4).\n");
+    printf("-k, --keys N         : Number of keys in the table (default 100000).\n");
+    printf("-D, --dist NAME      : Key distribution: uniform, zipf or latest (default uniform).\n");
+    printf("-z, --theta T        : Skew of zipf and latest, below 1 (default 0.99).\n");
+    printf("-m, --mode NAME      : Transaction mode: locking, snapshot or optimistic (default locking).\n");
+    printf("-i, --isolation NAME : Isolation level of locking transactions: rc or rr (default rr).\n");
+    printf("-b, --buffer N       : Number of buffer frames (default 10000).\n");
+    printf("-f, --table PATH     : Table file, loaded with the missing keys first (default bench.db).\n");
+    printf("-l, --log PATH       : Log file (default bench.log).\n");
+    printf("-j, --json PATH      : Write the results as JSON to PATH (- for stdout).\n");
+    printf("-s, --seed N         : Seed of the clients (default 1).\n");
+    printf("-w, --lock-timeout MS: Lock wait timeout in milliseconds, 0 to wait forever (default %d).\n", DEFAULT_LOCK_WAIT_TIMEOUT_MS);
+    printf("-e, --elr on|off     : Release locks before the commit record is durable (default on).\n");
+    printf("-v, --optimistic on|off: Descend the tree validating node versions instead of taking shared latches (default on).\n");
+    printf("-h, --help           : Print this message.\n");
+}
+
+// Return SUCCESS, or FAILURE after printing what is wrong with the arguments
+static int parse_args(int argc, char ** argv, BenchConfig & config){
+
+    static const struct option options[] = {
+        {"threads", required_argument, nullptr, 't'},
+        {"writers", required_argument, nullptr, 'W'},
+        {"duration", required_argument, nullptr, 'd'},
+        {"read-ratio", required_argument, nullptr, 'r'},
+        {"insert-delete", required_argument, nullptr, 'I'},
+        {"ops", required_argument, nullptr, 'o'},
+        {"keys", required_argument, nullptr, 'k'},
+        {"dist", required_argument, nullptr, 'D'},
+        {"theta", required_argument, nullptr, 'z'},
+        {"mode", required_argument, nullptr, 'm'},
+        {"isolation", required_argument, nullptr, 'i'},
+        {"buffer", required_argument, nullptr, 'b'},
+        {"table", required_argument, nullptr, 'f'},
+        {"log", required_argument, nullptr, 'l'},
+        {"json", required_argument, nullptr, 'j'},
+        {"seed", required_argument, nullptr, 's'},
+        {"lock-timeout", required_argument, nullptr, 'w'},
+        {"elr", required_argument, nullptr, 'e'},
+        {"optimistic", required_argument, nullptr, 'v'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:W:d:r:I:o:k:D:z:m:i:b:f:l:j:s:w:e:v:h", options, nullptr)) != -1){
+        switch (opt){
+        case 't': config.num_threads = atoi(optarg); break;
+        case 'W': config.num_writers = atoi(optarg); break;
+        case 'd': config.duration_s = atof(optarg); break;
+        case 'r': config.read_ratio = atof(optarg); break;
+        case 'I': config.change_ratio = atof(optarg); break;
+        case 'o': config.ops_per_trx = atoi(optarg); break;
+        case 'k': config.num_keys = atol(optarg); break;
+        case 'z': config.zipf_theta = atof(optarg); break;
+        case 'b': config.num_buf = atoi(optarg); break;
+        case 'f': config.table_path = optarg; break;
+        case 'l': config.log_path = optarg; break;
+        case 'j': config.json_path = optarg; break;
+        case 's': config.seed = atoi(optarg); break;
+        case 'w': config.lock_timeout_ms = atoi(optarg); break;
+        case 'e':
+            if (!strcmp(optarg, "on")) config.early_lock_release = true;
+            else if (!strcmp(optarg, "off")) config.early_lock_release = false;
+            else {
+                printf("--elr takes on or off.\n");
+                return FAILURE;
+            }
+            break;
+        case 'v':
+            if (!strcmp(optarg, "on")) config.optimistic_descent = true;
+            else if (!strcmp(optarg, "off")) config.optimistic_descent = false;
+            else {
+                printf("--optimistic takes on or off.\n");
+                return FAILURE;
+            }
+            break;
+        case 'D':
+            if (!strcmp(optarg, "uniform")) config.distribution = KeyDistribution::UNIFORM;
+            else if (!strcmp(optarg, "zipf")) config.distribution = KeyDistribution::ZIPF;
+            else if (!strcmp(optarg, "latest")) config.distribution = KeyDistribution::LATEST;
+            else {
+                printf("Unknown key distribution %s.\n", optarg);
+                return FAILURE;
+            }
+            break;
+        case 'm':
+            if (!strcmp(optarg, "locking")) config.mode = TrxMode::LOCKING;
+            else if (!strcmp(optarg, "snapshot")) config.mode = TrxMode::SNAPSHOT;
+            else if (!strcmp(optarg, "optimistic")) config.mode = TrxMode::OPTIMISTIC;
+            else {
+                printf("Unknown transaction mode %s.\n", optarg);
+                return FAILURE;
+            }
+            break;
+        case 'i':
+            if (!strcmp(optarg, "rc")) config.isolation = IsolationLevel::READ_COMMITTED;
+            else if (!strcmp(optarg, "rr")) config.isolation = IsolationLevel::REPEATABLE_READ;
+            else {
+                printf("Unknown isolation level %s.\n", optarg);
+                return FAILURE;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return FAILURE;
+        }
+    }
+
+    if (config.num_threads < 1 || config.num_writers < 0 || config.duration_s <= 0 || config.ops_per_trx < 0 || config.num_keys < 2
+        || config.num_buf < 1 || config.read_ratio < 0 || config.read_ratio > 1
+        || config.change_ratio < 0 || config.change_ratio > 1
+        || config.zipf_theta <= 0 || config.zipf_theta >= 1){
+        printf("Invalid arguments.\n");
+        print_usage(argv[0]);
+        return FAILURE;
+    }
+
+    // Snapshot transactions can't update
+    if (config.mode == TrxMode::SNAPSHOT && config.read_ratio < 1){
+        printf("Snapshot transactions are read-only: use --read-ratio 1, and --writers for the updates.\n");
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+// Insert the keys the table doesn't have yet
+static void load_table(const BenchConfig & config, int table_id){
+    char value[120];
+    keyval_t num_loaded = 0;
+
+    for (keyval_t key = 0; key < config.num_keys; key++){
+        sprintf(value, BENCH_VALUE_FORMAT, 'v', (long)key);
+        if (db_insert(table_id, key, value) == SUCCESS)
+            num_loaded++;
+    }
+    printf("Loaded %ld keys into %s.\n", num_loaded, config.table_path);
+}
+
+static void write_json(FILE * out, const BenchConfig & config, double elapsed_s, const ClientStat & clients,
+    const ClientStat & writers, const LockStat & lock_stat){
+
+    uint64_t num_commits = clients.num_commits, num_aborts = clients.num_aborts;
+    uint64_t num_trx = num_commits + num_aborts;
+    const vector<uint64_t> & latencies = clients.latencies;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\"threads\": %d, \"writers\": %d, \"duration_s\": %.3f, \"read_ratio\": %.3f, \"insert_delete\": %.3f, \"ops_per_trx\": %d, "
+        "\"keys\": %ld, \"distribution\": \"%s\", \"theta\": %.3f, \"mode\": \"%s\", \"isolation\": \"%s\", \"elr\": %s, \"optimistic\": %s, \"buffer\": %d},\n",
+        config.num_threads, config.num_writers, config.duration_s, config.read_ratio, config.change_ratio,
+        config.ops_per_trx, (long)config.num_keys,
+        distribution_name(config.distribution), config.zipf_theta, mode_name(config.mode), isolation_name(config.isolation),
+        config.early_lock_release ? "true" : "false", config.optimistic_descent ? "true" : "false", config.num_buf);
+    fprintf(out, "  \"elapsed_s\": %.3f,\n", elapsed_s);
+    fprintf(out, "  \"commits\": %lu,\n", num_commits);
+    fprintf(out, "  \"aborts\": %lu,\n", num_aborts);
+    fprintf(out, "  \"abort_rate\": %.6f,\n", num_trx ? (double)num_aborts / num_trx : 0.0);
+    fprintf(out, "  \"throughput_trx_per_s\": %.1f,\n", num_commits / elapsed_s);
+    fprintf(out, "  \"throughput_ops_per_s\": %.1f,\n", clients.num_ops / elapsed_s);
+    fprintf(out, "  \"inserts_deletes\": %lu,\n", clients.num_changes);
+    fprintf(out, "  \"allocs_per_trx\": %.2f,\n", num_trx ? (double)clients.num_allocs / num_trx : 0.0);
+    fprintf(out, "  \"locks\": {\"acquired\": %lu, \"waits\": %lu, \"avg_wait_us\": %.1f, \"max_wait_us\": %.1f, "
+        "\"deadlocks\": %lu, \"timeouts\": %lu},\n",
+        lock_stat.num_acquired, lock_stat.num_waits,
+        lock_stat.num_waits ? lock_stat.total_wait_ns / 1000.0 / lock_stat.num_waits : 0.0,
+        lock_stat.max_wait_ns / 1000.0, lock_stat.num_deadlocks, lock_stat.num_timeouts);
+    fprintf(out, "  \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+        percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+        latencies.empty() ? 0.0 : latencies.back() / 1000.0);
+    if (config.num_writers > 0){
+        fprintf(out, ",\n  \"writers\": {\"commits\": %lu, \"aborts\": %lu, \"throughput_trx_per_s\": %.1f, "
+            "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}",
+            writers.num_commits, writers.num_aborts, writers.num_commits / elapsed_s,
+            percentile(writers.latencies, 0.5), percentile(writers.latencies, 0.99), percentile(writers.latencies, 0.999),
+            writers.latencies.empty() ? 0.0 : writers.latencies.back() / 1000.0);
+    }
+    fprintf(out, "\n}\n");
+}
+
+int main(int argc, char ** argv){
+
+    BenchConfig config = {4, 0, 10, 0.8, 0, 4, 100000, KeyDistribution::UNIFORM, 0.99, TrxMode::LOCKING,
+        IsolationLevel::REPEATABLE_READ, 10000, "bench.db", "bench.log", nullptr, 1, DEFAULT_LOCK_WAIT_TIMEOUT_MS, true, true};
+
+    if (parse_args(argc, argv, config) != SUCCESS){
+        return 1;
+    }
+
+    lock_wait_timeout_ms = config.lock_timeout_ms;
+    early_lock_release = config.early_lock_release;
+    optimistic_descent = config.optimistic_descent;
+
+    if (init_db(config.num_buf, config.log_path) != SUCCESS){
+        printf("Unable to initialize the database.\n");
+        return 1;
+    }
+
+    int table_id = open_table((char *)config.table_path);
+    if (table_id < 0){
+        printf("Unable to open file at %s.\n", config.table_path);
+        shutdown_db();
+        return 1;
+    }
+
+    load_table(config, table_id);
+
+    // Computing zeta takes a pass over the keys, so it is done once for every client
+    ZipfGenerator * zipf = config.distribution == KeyDistribution::UNIFORM ? nullptr
+        : new ZipfGenerator(config.num_keys, config.zipf_theta);
+
+    int num_clients = config.num_threads + config.num_writers;
+    vector<ClientStat> stats(num_clients);
+    vector<thread> clients;
+
+    printf("Running %d clients for %.1f s: %.0f%% reads, %d operations per transaction, %ld %s keys, %s transactions (%s).\n",
+        config.num_threads, config.duration_s, config.read_ratio * 100, config.ops_per_trx, (long)config.num_keys,
+        distribution_name(config.distribution), mode_name(config.mode), isolation_name(config.isolation));
+    if (config.num_writers > 0){
+        printf("Running %d writers next to them: updates only, locking transactions (%s).\n",
+            config.num_writers, isolation_name(config.isolation));
+    }
+
+    stop_clients = false;
+    auto start = chrono::steady_clock::now();
+
+    for (int i = 0; i < num_clients; i++){
+        stats[i] = {0, 0, 0, 0, 0, {}};
+        clients.emplace_back(run_client, cref(config), table_id, zipf, i, i >= config.num_threads, &stats[i]);
+    }
+
+    this_thread::sleep_for(chrono::duration<double>(config.duration_s));
+    stop_clients = true;
+
+    for (auto & client : clients){
+        client.join();
+    }
+    double elapsed_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    ClientStat total, writers;
+    merge_stats(stats.begin(), stats.begin() + config.num_threads, total);
+    merge_stats(stats.begin() + config.num_threads, stats.end(), writers);
+
+    uint64_t num_trx = total.num_commits + total.num_aborts;
+    const vector<uint64_t> & latencies = total.latencies;
+
+    printf("Committed: %lu transactions (%.1f trx/s, %.1f ops/s)\n", total.num_commits, total.num_commits / elapsed_s, total.num_ops / elapsed_s);
+    printf("Aborted: %lu transactions (%.2f%%)\n", total.num_aborts, num_trx ? 100.0 * total.num_aborts / num_trx : 0.0);
+    printf("Latency (us): p50 %.1f / p99 %.1f / p999 %.1f / max %.1f\n",
+        percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+        latencies.empty() ? 0.0 : latencies.back() / 1000.0);
+    printf("Allocations: %.2f per transaction\n", num_trx ? (double)total.num_allocs / num_trx : 0.0);
+
+    if (config.num_writers > 0){
+        printf("Writers: %lu committed (%.1f trx/s), %lu aborted, latency (us) p50 %.1f / p99 %.1f / max %.1f\n",
+            writers.num_commits, writers.num_commits / elapsed_s, writers.num_aborts,
+            percentile(writers.latencies, 0.5), percentile(writers.latencies, 0.99),
+            writers.latencies.empty() ? 0.0 : writers.latencies.back() / 1000.0);
+    }
+
+    // Time spent waiting for locks tells contention apart from I/O
+    LockStat lock_stat;
+    get_lock_stat(0, &lock_stat);
+    printf("Lock waits: %lu of %lu locks (%.1f us on average, %.1f us at most), %lu deadlocks, %lu timeouts\n",
+        lock_stat.num_waits, lock_stat.num_acquired,
+        lock_stat.num_waits ? lock_stat.total_wait_ns / 1000.0 / lock_stat.num_waits : 0.0,
+        lock_stat.max_wait_ns / 1000.0, lock_stat.num_deadlocks, lock_stat.num_timeouts);
+
+    bool tree_ok = true;
+    if (config.change_ratio > 0){
+        printf("Inserts and deletes: %lu (%.1f /s)\n", total.num_changes, total.num_changes / elapsed_s);
+        tree_ok = check_tree(table_id) == SUCCESS;
+        printf("Tree check: %s\n", tree_ok ? "ok" : "broken");
+    }
+
+    if (config.json_path != nullptr){
+        FILE * out = strcmp(config.json_path, "-") ? fopen(config.json_path, "w") : stdout;
+        if (out == nullptr){
+            printf("Unable to write %s.\n", config.json_path);
+        }
+        else {
+            write_json(out, config, elapsed_s, total, writers, lock_stat);
+            if (out != stdout) fclose(out);
+        }
+    }
+
+    delete zipf;
+    shutdown_db();
+    return tree_ok ? 0 : 1;
+}
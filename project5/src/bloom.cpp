@@ -0,0 +1,299 @@
+#include <bloom.hpp>
+
+#include <cerrno>
+
+// "BPTBLOOM" in a little-endian word, and the layout of the file
+#define BLOOM_FILE_MAGIC 0x4d4f4f4c42545042ULL
+#define BLOOM_FILE_VERSION 1
+
+// The words start on the page after the header
+#define BLOOM_FILE_DATA_OFFSET PAGE_SIZE
+
+struct BloomFileHeader{
+
+    uint64_t magic;
+    uint32_t version;
+
+    // 1 while the table is closed, 0 while it is open
+    uint32_t is_clean;
+
+    uint64_t num_blocks;
+    uint64_t num_added;
+
+    // Header page of the data file when the filter was written
+    Pagenum_t num_page;
+    Pagenum_t root_page_num;
+};
+
+// Filter of a table, and filters replaced while it is open
+struct TableBloom_t{
+    atomic<BloomFilter *> filter;
+    vector<BloomFilter *> retired;
+    shared_timed_mutex latch;
+};
+
+static TableBloom_t table_blooms[MAX_TABLE_NUMBER + 1];
+
+BloomFilter::BloomFilter(uint64_t num_blocks, uint64_t num_added)
+    : words(NULL), num_blocks(num_blocks), num_added(num_added) {
+
+    // A block takes half a cache line, so aligned blocks never straddle two
+    void * aligned;
+    size_t size = num_blocks * BLOOM_BLOCK_WORDS * sizeof(uint32_t);
+    if (num_blocks > 0 && posix_memalign(&aligned, 64, size) == 0){
+        words = (uint32_t *)aligned;
+        memset(words, 0, size);
+    }
+}
+
+BloomFilter::~BloomFilter(){
+    free(words);
+}
+
+uint64_t BloomFilter::blocks_for(uint64_t num_keys, int bits_per_key){
+    uint64_t block_bits = BLOOM_BLOCK_WORDS * 32;
+    return (max(num_keys, (uint64_t)BLOOM_MIN_KEYS) * bits_per_key + block_bits - 1) / block_bits;
+}
+
+void BloomFilter::add(keyval_t key){
+
+    uint64_t hash = bloom_hash(key);
+    uint32_t * block = block_of(hash);
+
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++){
+        uint32_t bit = 1U << (((uint32_t)hash * bloom_salts[i]) >> 27);
+        __atomic_fetch_or(&block[i], bit, __ATOMIC_RELAXED);
+    }
+    num_added.fetch_add(1, memory_order_relaxed);
+}
+
+int BloomFilter::write_to(int fd, off_t offset) const {
+
+    const char * data = (const char *)words;
+    size_t length = num_blocks * BLOOM_BLOCK_WORDS * sizeof(uint32_t);
+
+    while (length > 0){
+        ssize_t written = pwrite(fd, data, length, offset);
+        if (written < 0){
+            if (errno == EINTR) continue;
+            return FAILURE;
+        }
+        data += written;
+        offset += written;
+        length -= written;
+    }
+    return SUCCESS;
+}
+
+int BloomFilter::read_from(int fd, off_t offset){
+
+    char * data = (char *)words;
+    size_t length = num_blocks * BLOOM_BLOCK_WORDS * sizeof(uint32_t);
+
+    while (length > 0){
+        ssize_t num_read = pread(fd, data, length, offset);
+        if (num_read < 0 && errno == EINTR) continue;
+        if (num_read <= 0){
+            return FAILURE;
+        }
+        data += num_read;
+        offset += num_read;
+        length -= num_read;
+    }
+    return SUCCESS;
+}
+
+static string bloom_path(const char * pathname){
+    return string(pathname) + BLOOM_FILE_SUFFIX;
+}
+
+static bool is_valid_table(int table_id){
+    return table_id >= 1 && table_id <= MAX_TABLE_NUMBER && tables.in_use[table_id];
+}
+
+// Write filter to the file of table_id, setting is_clean in its header
+static int save_filter(int table_id, BloomFilter * filter, bool is_clean){
+
+    HeaderPage_t data_header;
+    file_read_page(HEADER_PAGE_NUMBER, (Page_t *)&data_header, tables.fd[table_id]);
+
+    BloomFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = BLOOM_FILE_MAGIC;
+    header.version = BLOOM_FILE_VERSION;
+    header.is_clean = 0;
+    header.num_blocks = filter->get_num_blocks();
+    header.num_added = filter->get_num_added();
+    header.num_page = data_header.num_page;
+    header.root_page_num = data_header.root_page_num;
+
+    int fd = open(bloom_path(tables.pathname[table_id]).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        return FAILURE;
+    }
+
+    // The file is marked clean only once the words are on the disk
+    int result = SUCCESS;
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+        || filter->write_to(fd, BLOOM_FILE_DATA_OFFSET) != SUCCESS || fdatasync(fd) < 0){
+        result = FAILURE;
+    }
+    if (result == SUCCESS && is_clean){
+        header.is_clean = 1;
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fdatasync(fd) < 0){
+            result = FAILURE;
+        }
+    }
+
+    close(fd);
+    return result;
+}
+
+int db_build_bloom_filter(int table_id, int bits_per_key){
+
+    if (!is_valid_table(table_id) || bits_per_key <= 0){
+        return FAILURE;
+    }
+
+    TableBloom_t & bloom = table_blooms[table_id];
+    unique_lock<shared_timed_mutex> guard(bloom.latch);
+
+    // Leaves hold at most LEAF_ORDER - 1 keys, so the pages of the file bound the number of keys
+    BufferBlock_t * header = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
+    uint64_t max_keys = (header->frame.header_page.num_page - 1) * (LEAF_ORDER - 1);
+    buffer_unpin_page(header, 1);
+
+    BloomFilter * filter = new BloomFilter(BloomFilter::blocks_for(max_keys, bits_per_key));
+    if (!filter->is_valid()){
+        delete filter;
+        return FAILURE;
+    }
+
+    // No insert or delete runs, so the leaves can be read without their latches
+    Pagenum_t root_page_num = read_root_page_num(table_id);
+    Pagenum_t leaf = root_page_num == NO_ROOT_NODE ? 0 : find_leaf(table_id, root_page_num, INT64_MIN, false);
+
+    while (leaf != 0){
+        BufferBlock_t * frame = buffer_read_page(table_id, leaf);
+        NodePage_t & page = frame->frame.node_page;
+
+        for (int k = 0; k < page.num_key; k++){
+            filter->add(page.lf_record[k].key);
+        }
+        leaf = page.right_page_num;
+        buffer_unpin_page(frame, 1);
+    }
+
+    // The file stays marked until the table is closed
+    if (save_filter(table_id, filter, false) != SUCCESS){
+        delete filter;
+        return FAILURE;
+    }
+
+    BloomFilter * old_filter = bloom.filter.exchange(filter);
+    if (old_filter != NULL){
+        bloom.retired.push_back(old_filter);
+    }
+    return SUCCESS;
+}
+
+int db_drop_bloom_filter(int table_id){
+
+    if (!is_valid_table(table_id)){
+        return FAILURE;
+    }
+
+    TableBloom_t & bloom = table_blooms[table_id];
+    unique_lock<shared_timed_mutex> guard(bloom.latch);
+
+    BloomFilter * old_filter = bloom.filter.exchange(NULL);
+    if (old_filter == NULL){
+        return FAILURE;
+    }
+    bloom.retired.push_back(old_filter);
+
+    unlink(bloom_path(tables.pathname[table_id]).c_str());
+    return SUCCESS;
+}
+
+bool bloom_may_contain(int table_id, keyval_t key){
+    BloomFilter * filter = table_blooms[table_id].filter.load(memory_order_acquire);
+    return filter == NULL || filter->may_contain(key);
+}
+
+const BloomFilter * get_bloom_filter(int table_id){
+    return table_blooms[table_id].filter.load(memory_order_acquire);
+}
+
+bool has_bloom_filter(int table_id){
+    return get_bloom_filter(table_id) != NULL;
+}
+
+shared_timed_mutex & bloom_latch(int table_id){
+    return table_blooms[table_id].latch;
+}
+
+void bloom_add(int table_id, keyval_t key){
+    BloomFilter * filter = table_blooms[table_id].filter.load(memory_order_acquire);
+    if (filter != NULL){
+        filter->add(key);
+    }
+}
+
+void bloom_open_table(int table_id, const char * pathname, int fd){
+
+    TableBloom_t & bloom = table_blooms[table_id];
+    bloom.filter.store(NULL);
+
+    string path = bloom_path(pathname);
+    int bloom_fd = open(path.c_str(), O_RDWR);
+    if (bloom_fd < 0){
+        return;
+    }
+
+    HeaderPage_t data_header;
+    file_read_page(HEADER_PAGE_NUMBER, (Page_t *)&data_header, fd);
+
+    // A filter is used only if it was written by a clean close of the same file
+    BloomFileHeader header;
+    bool is_valid = pread(bloom_fd, &header, sizeof(header), 0) == sizeof(header)
+        && header.magic == BLOOM_FILE_MAGIC && header.version == BLOOM_FILE_VERSION && header.is_clean
+        && header.num_page == data_header.num_page && header.root_page_num == data_header.root_page_num;
+
+    BloomFilter * filter = NULL;
+    if (is_valid){
+        filter = new BloomFilter(header.num_blocks, header.num_added);
+        is_valid = filter->is_valid() && filter->read_from(bloom_fd, BLOOM_FILE_DATA_OFFSET) == SUCCESS;
+    }
+
+    // The mark must be on the disk before any change to the table is
+    if (is_valid){
+        header.is_clean = 0;
+        is_valid = pwrite(bloom_fd, &header, sizeof(header), 0) == sizeof(header) && fdatasync(bloom_fd) == 0;
+    }
+    close(bloom_fd);
+
+    if (!is_valid){
+        delete filter;
+        unlink(path.c_str());
+        return;
+    }
+    bloom.filter.store(filter);
+}
+
+void bloom_close_table(int table_id){
+
+    TableBloom_t & bloom = table_blooms[table_id];
+    BloomFilter * filter = bloom.filter.exchange(NULL);
+
+    // A filter that can't be written stays marked, and is dropped on the next open
+    if (filter != NULL){
+        save_filter(table_id, filter, true);
+        delete filter;
+    }
+
+    for (BloomFilter * old_filter : bloom.retired){
+        delete old_filter;
+    }
+    bloom.retired.clear();
+}
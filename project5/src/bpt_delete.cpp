@@ -1,4 +1,5 @@
 #include "bpt.hpp"
+#include "bloom.hpp"
 
 // DELETION
 
@@ -6,41 +7,60 @@
 // If success, return 0. Otherwise, return non-zero value.
 int db_delete( int table_id, keyval_t key ){
 
-    if (tables.in_use[table_id] == false){
+    // A merge could not be logged either
+    if (tables.in_use[table_id] == false || log_failed()){
         return FAILURE;
     }
 
-    BufferBlock_t * header_frame = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
-    HeaderPage_t header = header_frame->frame.header_page;
+    // A merge may move keys behind a rebuild of the filter
+    shared_lock<shared_timed_mutex> bloom_guard(bloom_latch(table_id));
 
-    Pagenum_t root_page_num = header.root_page_num;
-    Pagenum_t key_page_num, leaf_page_num;
-    Record_t key_record;
-    
-    key_record = find(table_id, root_page_num, key, false);
-    leaf_page_num = find_leaf(table_id, root_page_num, key, false);
-    if(!key_record.is_null && leaf_page_num != KEY_DO_NOT_EXISTS){
+    // The latches outlive the system operation, so that it ends before freed pages are reused
+    TreeLatches latches(table_id);
+    SystemOp op(LogType::DELETE);
+
+    Pagenum_t root_page_num, leaf_page_num;
+    BufferBlock_t * leaf_frame;
+    bool counted = has_subtree_counts(table_id), optimistic = !counted;
+    int i;
+
+    // Only the leaf is latched exclusively at first; if it may underflow,
+    // descend again keeping every node the merge may reach
+    // (a table keeping subtree counts changes every level, and keeps them all from the start)
+    while (true){
+        leaf_page_num = latches.descend(key, TreeOp::DELETE, optimistic);
+        root_page_num = latches.get_root_page_num();
+
+        if (leaf_page_num == NO_ROOT_NODE){
+            return FAILURE;
+        }
 
-        // // LINE(24) // buffer_print_all();
+        leaf_frame = buffer_read_page(table_id, leaf_page_num);
+        NodePage_t & leaf = PAGE_CONTENTS(leaf_frame);
 
-        root_page_num = delete_entry(table_id, root_page_num, leaf_page_num, key);
+        for (i = 0; i < leaf.num_key; i++)
+            if (leaf.lf_record[i].key == key) break;
 
-        // // LINE(28) // buffer_print_all();
+        bool exists = i < leaf.num_key, safe = is_safe(table_id, leaf, TreeOp::DELETE);
+        buffer_unpin_page(leaf_frame, 1);
 
-        // if root was changed, update header
-        if(root_page_num != header.root_page_num){
-            header = header_frame->frame.header_page;
-            header.root_page_num = root_page_num;
-            buffer_write_page(header_frame, PAGE_T(header));
-            buffer_unpin_page(header_frame, 1);
+        if (!exists){
+            return FAILURE;
         }
-        buffer_unpin_page(header_frame, 1);
-        return SUCCESS;
+        if (safe || !optimistic){
+            break;
+        }
+        optimistic = false;
     }
-    else {
-        buffer_unpin_page(header_frame, 1);
-        return FAILURE;
+
+    // Every subtree on the path loses the record, before a merge hands it to another node
+    if (counted){
+        add_to_subtree_counts(table_id, key, -1);
     }
+
+    // adjust_root updates the header if the root changes
+    delete_entry(table_id, root_page_num, leaf_page_num, key);
+    return SUCCESS;
 }
 
 /* Deletes an entry from the B+ tree.
@@ -136,12 +156,17 @@ Pagenum_t delete_entry( int table_id, Pagenum_t root_page_num, Pagenum_t node_pa
         neighbor_page_num = parent.in_record[neighbor_index - 1].page_num;
         break;
     }
-    capacity = node_page.is_leaf ? lf_order : in_order - 1;
+    capacity = node_page.is_leaf ? lf_order : internal_order(table_id) - 1;
 
     //printf("Capacity: %d\n", capacity);
+    latch_node(neighbor_page_num);
     BufferBlock_t * neighbor_frame = buffer_read_page(table_id, neighbor_page_num);
     neighbor = PAGE_CONTENTS(neighbor_frame);
 
+    // The neighbor may still have the parent page number a B-link split left in it
+    if (neighbor.parent_page_num != node_page.parent_page_num)
+        set_parent_page(table_id, neighbor_page_num, node_page.parent_page_num);
+
     // // LINE(145) // buffer_print_all();
 
     // Coalescence.
@@ -168,7 +193,7 @@ Pagenum_t delete_entry( int table_id, Pagenum_t root_page_num, Pagenum_t node_pa
 
 Pagenum_t remove_entry_from_node(int table_id, Pagenum_t node_page_num, keyval_t key) {
     // printf("remove_entry_from_node(node_page_num: %ld, key: %ld) called.\n", node_page_num, key);
-    int i, j, num_pointers;
+    int i, j;
     NodePage_t node_page;
 
     BufferBlock_t * node_page_frame = buffer_read_page(table_id, node_page_num);
@@ -190,6 +215,13 @@ Pagenum_t remove_entry_from_node(int table_id, Pagenum_t node_page_num, keyval_t
     else{
         while (node_page.in_record[i].key != key)
             i++;
+
+        // The child going with the key has handed its records to the one left of it
+        if (has_subtree_counts(table_id)){
+            for (j = i + 1; j < node_page.num_key; j++)
+                SUBTREE_COUNT(node_page, j) = SUBTREE_COUNT(node_page, j + 1);
+        }
+
         for (++i; i < node_page.num_key; i++){
             node_page.in_record[i - 1].key = node_page.in_record[i].key;
             node_page.in_record[i - 1].page_num = node_page.in_record[i].page_num;
@@ -212,9 +244,9 @@ Pagenum_t adjust_root(int table_id, Pagenum_t root_page_num) {
     // printf("adjust_root(root_page_num: %ld) called.\n", root_page_num);
 
     Pagenum_t new_root_num;
-    NodePage_t root, new_root;
+    NodePage_t root;
 
-    BufferBlock_t * root_frame, * new_root_frame;
+    BufferBlock_t * root_frame;
 
     root_frame = buffer_read_page(table_id, root_page_num);
     root = PAGE_CONTENTS(root_frame);
@@ -242,12 +274,7 @@ Pagenum_t adjust_root(int table_id, Pagenum_t root_page_num) {
         printf("the root become empty, so promote the first child as the new root.\n");
         new_root_num = root.extra_page_num;
 
-        new_root_frame = buffer_read_page(table_id, new_root_num);
-        new_root = PAGE_CONTENTS(new_root_frame);        
-        new_root.parent_page_num = NO_PARENT;
-        
-        buffer_write_page(new_root_frame, PAGE_T(new_root));
-        buffer_unpin_page(new_root_frame, 2);
+        set_parent_page(table_id, new_root_num, NO_PARENT);
         // buffer_print_page(new_root_frame); // // LINE(254) // buffer_print_all();
     }
 
@@ -257,11 +284,8 @@ Pagenum_t adjust_root(int table_id, Pagenum_t root_page_num) {
         new_root_num = NO_ROOT_NODE;
     }
 
-    buffer_free_page(root_frame);        
-
-    BufferBlock_t * header_frame = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
-    header_frame->frame.header_page.root_page_num = new_root_num;
-    header_frame->is_dirty = true; buffer_unpin_page(header_frame, 1);
+    free_node(root_frame);
+    buffer_set_root_page(table_id, new_root_num);
 
     // LINE(266) buffer_print_all();
 
@@ -329,8 +353,11 @@ Pagenum_t coalesce_nodes( int table_id,  Pagenum_t root_page_num, Pagenum_t node
      *       root_page_num, node_page_num, neighbor_page_num, neighbor_index, k_prime);
      */
     int i, j, neighbor_insertion_index, n_end;
-    Pagenum_t temp_page_num, temp_root;
-    NodePage_t node_page, neighbor, temp;
+    Pagenum_t temp_page_num;
+    NodePage_t node_page, neighbor, parent;
+    bool counted = has_subtree_counts(table_id);
+
+    LogScope scope(LogType::MERGE);
 
     /* Swap neighbor with node if node is on the
      * extreme left and neighbor is to its right.
@@ -345,7 +372,7 @@ Pagenum_t coalesce_nodes( int table_id,  Pagenum_t root_page_num, Pagenum_t node
     }
     // printf("node page num: %ld\nneighbor_page_num: %ld\n", node_page_num, neighbor_page_num);
 
-    BufferBlock_t * node_page_frame, * neighbor_page_frame, * temp_frame;
+    BufferBlock_t * node_page_frame, * neighbor_page_frame, * parent_frame;
 
     node_page_frame = buffer_read_page(table_id, node_page_num);
     node_page = PAGE_CONTENTS(node_page_frame);
@@ -353,6 +380,20 @@ Pagenum_t coalesce_nodes( int table_id,  Pagenum_t root_page_num, Pagenum_t node
     neighbor_page_frame = buffer_read_page(table_id, neighbor_page_num);
     neighbor = PAGE_CONTENTS(neighbor_page_frame);
 
+    /* The neighbor, left of n in the parent,
+     * takes the records of n over.
+     */
+    if (counted) {
+        parent_frame = buffer_read_page(table_id, node_page.parent_page_num);
+        parent = PAGE_CONTENTS(parent_frame);
+
+        for (i = 1; (INTERNAL_VAL(parent, i)) != node_page_num; i++);
+        SUBTREE_COUNT(parent, i - 1) += SUBTREE_COUNT(parent, i);
+
+        buffer_write_page(parent_frame, PAGE_T(parent));
+        buffer_unpin_page(parent_frame, 2);
+    }
+
     // LINE(355) buffer_print_page(node_page_frame); buffer_print_page(neighbor_page_frame);
 
     /* Starting point in the neighbor for copying
@@ -399,25 +440,24 @@ Pagenum_t coalesce_nodes( int table_id,  Pagenum_t root_page_num, Pagenum_t node
 
         neighbor.in_record[i].page_num = INTERNAL_VAL(node_page, j);
 
+        if (counted) {
+            for (j = 0; j <= n_end; j++)
+                SUBTREE_COUNT(neighbor, neighbor_insertion_index + 1 + j) = SUBTREE_COUNT(node_page, j);
+        }
+
         // LINE(401) print_node(neighbor, neighbor_page_num);
         // LINE(402) print_node(node_page, node_page_num);
 
         /* All children must now point up to the same parent.
+         * Only the children taken from n have to change.
          */
 
-        for (i = 0; i < (neighbor.num_key + 1); i++) {
+        for (i = neighbor_insertion_index + 1; i < (neighbor.num_key + 1); i++) {
             temp_page_num = INTERNAL_VAL(neighbor, i);
-
-            temp_frame = buffer_read_page(table_id, temp_page_num);
-            temp = PAGE_CONTENTS(temp_frame);
-
-            temp.parent_page_num = neighbor_page_num;
-            // print_node(temp, temp_page_num);
-            
-            buffer_write_page(temp_frame, PAGE_T(temp));
-            buffer_unpin_page(temp_frame, 2); // LINE(417) buffer_print_page(temp_frame);
+            set_parent_page(table_id, temp_page_num, neighbor_page_num);
         }
 
+        neighbor.next_page_num = node_page.next_page_num;
     }
     /* In a leaf, append the keys and pointers of
      * n to the neighbor.
@@ -435,13 +475,16 @@ Pagenum_t coalesce_nodes( int table_id,  Pagenum_t root_page_num, Pagenum_t node
         neighbor.right_page_num = node_page.right_page_num;
     }
 
+    // The neighbor takes the key range of n over
+    neighbor.high_key = node_page.high_key;
+
     buffer_write_page(neighbor_page_frame, PAGE_T(neighbor));
 
     root_page_num = delete_entry(table_id, root_page_num, node_page.parent_page_num, k_prime);
 
 
 
-    buffer_free_page(node_page_frame);
+    free_node(node_page_frame);
 
     buffer_unpin_page(neighbor_page_frame, 2);
 
@@ -462,15 +505,48 @@ Pagenum_t redistribute_nodes(  int table_id, Pagenum_t root_page_num, Pagenum_t
             root_page_num, node_page_num, neighbor_page_num, neighbor_index, k_prime_index, k_prime);
     int i;
     Pagenum_t temp_page_num, parent_page_num;
-    NodePage_t temp, root, node, neighbor, parent;
+    NodePage_t node, neighbor, parent;
+    uint32_t moved;
 
-    BufferBlock_t * node_frame, * neighbor_page_frame, * temp_frame, * root_frame, * parent_frame;
+    BufferBlock_t * node_frame, * neighbor_page_frame, * parent_frame;
 
     node_frame = buffer_read_page(table_id, node_page_num);
     node = PAGE_CONTENTS(node_frame);
     neighbor_page_frame = buffer_read_page(table_id, neighbor_page_num);
     neighbor = PAGE_CONTENTS(neighbor_page_frame);
 
+    /* The counts follow the record or the child
+     * that moves from the neighbor to n, which is
+     * the first child of the parent if the neighbor
+     * is the second, and right of it otherwise.
+     */
+    if (has_subtree_counts(table_id)) {
+        if (node.is_leaf) {
+            moved = 1;
+        }
+        else if (neighbor_index != -1) {
+            moved = SUBTREE_COUNT(neighbor, neighbor.num_key);
+            for (i = node.num_key + 1; i > 0; i--)
+                SUBTREE_COUNT(node, i) = SUBTREE_COUNT(node, i - 1);
+            SUBTREE_COUNT(node, 0) = moved;
+        }
+        else {
+            moved = SUBTREE_COUNT(neighbor, 0);
+            SUBTREE_COUNT(node, node.num_key + 1) = moved;
+            for (i = 0; i < neighbor.num_key; i++)
+                SUBTREE_COUNT(neighbor, i) = SUBTREE_COUNT(neighbor, i + 1);
+        }
+
+        parent_frame = buffer_read_page(table_id, node.parent_page_num);
+        parent = PAGE_CONTENTS(parent_frame);
+
+        SUBTREE_COUNT(parent, neighbor_index + 1) += moved;
+        SUBTREE_COUNT(parent, neighbor_index == -1 ? 1 : neighbor_index) -= moved;
+
+        buffer_write_page(parent_frame, PAGE_T(parent));
+        buffer_unpin_page(parent_frame, 2);
+    }
+
     // // LINE(473) // buffer_print_all();
 
     /* Case: n has a neighbor to the left. 
@@ -496,10 +572,7 @@ Pagenum_t redistribute_nodes(  int table_id, Pagenum_t root_page_num, Pagenum_t
             //n->pointers[0] = neighbor->pointers[neighbor->num_keys];
 
             temp_page_num = node.extra_page_num;
-            temp_frame = buffer_read_page(table_id, temp_page_num);
-            temp = PAGE_CONTENTS(temp_frame);
-
-            temp.parent_page_num = node.parent_page_num;
+            set_parent_page(table_id, temp_page_num, node_page_num);
 
             node.in_record[0].key = k_prime;
             parent_page_num = node.parent_page_num;
@@ -508,14 +581,12 @@ Pagenum_t redistribute_nodes(  int table_id, Pagenum_t root_page_num, Pagenum_t
             parent = PAGE_CONTENTS(parent_frame);
 
             parent.in_record[k_prime_index].key = neighbor.in_record[neighbor.num_key - 1].key;
+            neighbor.high_key = parent.in_record[k_prime_index].key;
 
             // n->keys[0] = k_prime;
             // n->parent->keys[k_prime_index] = neighbor->keys[neighbor->num_keys - 1];
 
-            buffer_write_page(temp_frame, PAGE_T(temp));
             buffer_write_page(parent_frame, PAGE_T(parent));
-
-            buffer_unpin_page(temp_frame, 2);
             buffer_unpin_page(parent_frame, 2);
 
             // // LINE(520) // buffer_print_all();
@@ -535,6 +606,7 @@ Pagenum_t redistribute_nodes(  int table_id, Pagenum_t root_page_num, Pagenum_t
             parent = PAGE_CONTENTS(parent_frame);
 
             parent.in_record[k_prime_index].key = node.lf_record[0].key;
+            neighbor.high_key = parent.in_record[k_prime_index].key;
 
             // n->parent->keys[k_prime_index] = n->keys[0];
             buffer_write_page(parent_frame, PAGE_T(parent));
@@ -560,7 +632,8 @@ Pagenum_t redistribute_nodes(  int table_id, Pagenum_t root_page_num, Pagenum_t
             parent_frame = buffer_read_page(table_id, parent_page_num);
             parent = PAGE_CONTENTS(parent_frame);
             
-            parent.in_record[k_prime_index].key = neighbor.in_record[1].key;
+            parent.in_record[k_prime_index].key = neighbor.lf_record[1].key;
+            node.high_key = parent.in_record[k_prime_index].key;
 
             // n->keys[node.num_key] = neighbor->keys[0];
             // n->pointers[node.num_key] = neighbor->pointers[0];
@@ -578,12 +651,7 @@ Pagenum_t redistribute_nodes(  int table_id, Pagenum_t root_page_num, Pagenum_t
 
 
             temp_page_num = node.in_record[node.num_key].page_num;
-            temp_frame = buffer_read_page(table_id, temp_page_num);
-            temp = PAGE_CONTENTS(temp_frame);
-            
-            temp.parent_page_num = node_page_num;
-            buffer_write_page(temp_frame, PAGE_T(temp));
-            buffer_unpin_page(temp_frame, 2);
+            set_parent_page(table_id, temp_page_num, node_page_num);
 
 
             parent_page_num = node.parent_page_num;
@@ -591,6 +659,7 @@ Pagenum_t redistribute_nodes(  int table_id, Pagenum_t root_page_num, Pagenum_t
             parent = PAGE_CONTENTS(parent_frame);
 
             parent.in_record[k_prime_index].key = neighbor.in_record[0].key;
+            node.high_key = parent.in_record[k_prime_index].key;
             buffer_write_page(parent_frame, PAGE_T(parent));
             buffer_unpin_page(parent_frame, 2);
 
@@ -1,4 +1,5 @@
 #include "bpt.hpp"
+#include "bloom.hpp"
 
 // INSERTION
 
@@ -18,12 +19,16 @@ Record_t make_record(char * value) {
 Pagenum_t make_node( int table_id, bool is_leaf) {
 
     BufferBlock_t * new_frame = buffer_allocate_page(table_id);
+    latch_node(new_frame->page_num);
     //cerr << "line 21" << endl; buffer->print_all();
-    NodePage_t new_node;
+    NodePage_t new_node = PAGE_CONTENTS(new_frame);
 
     new_node.is_leaf = is_leaf;
     new_node.num_key = 0;
     new_node.parent_page_num = NO_PARENT;
+    new_node.high_key = 0;
+    new_node.next_page_num = 0;
+    new_node.split_pending = false;
 
     buffer_write_page(new_frame, PAGE_T(new_node));
     buffer_unpin_page(new_frame, 2);
@@ -45,6 +50,18 @@ int get_left_index(NodePage_t parent, Pagenum_t left) {
     return left_index + 1;
 }
 
+/* Index at which key goes into an internal node.
+ * A B-link split looks the left node up by key,
+ * since it only knows the level of the parent.
+ */
+static int get_key_index(NodePage_t & parent, keyval_t key) {
+
+    int index = 0;
+    while (index < parent.num_key && parent.in_record[index].key < key)
+        index++;
+    return index;
+}
+
 /* Inserts a new pointer to a record and its corresponding
  * key into a leaf.
  * Returns the altered leaf.
@@ -84,17 +101,34 @@ Pagenum_t insert_into_leaf(int table_id, Pagenum_t leaf_page_num, keyval_t key,
 Pagenum_t insert_into_leaf_after_splitting(int table_id, Pagenum_t root_page_num, Pagenum_t leaf_page_num, keyval_t key, Record_t pointer) {
     // printf("insert_into_leaf_after_splitting called.\n");
 
+    Pagenum_t new_leaf_page_num;
+    keyval_t new_key;
+
+    LogScope scope(LogType::SPLIT);
+
+    new_leaf_page_num = split_leaf(table_id, leaf_page_num, key, pointer, &new_key, false);
+    return insert_into_parent(table_id, root_page_num, leaf_page_num, new_key, new_leaf_page_num);
+}
+
+
+/* Splits a full leaf in half, inserting
+ * the new key and pointer into either half,
+ * and links the new leaf to the right of it.
+ */
+Pagenum_t split_leaf(int table_id, Pagenum_t leaf_page_num, keyval_t key, Record_t pointer, keyval_t * k_prime, bool blink) {
 
     BufferBlock_t * leaf_frame, * new_leaf_frame;
 
-    Pagenum_t new_leaf_page_num, temp;
+    Pagenum_t new_leaf_page_num;
     NodePage_t leaf, new_leaf;
 
-    keyval_t * temp_keys, new_key;
+    keyval_t * temp_keys;
     Record_t * temp_records;
 
     int insertion_index, split, i, j;
 
+    LogScope scope(LogType::SPLIT);
+
     new_leaf_page_num = make_node(table_id, true);
 
     leaf_frame = buffer_read_page(table_id, leaf_page_num);
@@ -153,18 +187,21 @@ Pagenum_t insert_into_leaf_after_splitting(int table_id, Pagenum_t root_page_num
     new_leaf.right_page_num = leaf.right_page_num;
     leaf.right_page_num = new_leaf_page_num;
 
+    // the new leaf takes the upper part of the key range over
+    *k_prime = new_leaf.lf_record[0].key;
+    new_leaf.high_key = leaf.high_key;
+    leaf.high_key = *k_prime;
+    leaf.split_pending = blink;
+
     new_leaf.parent_page_num = leaf.parent_page_num;
 
     buffer_write_page(leaf_frame, PAGE_T(leaf));
     buffer_write_page(new_leaf_frame, PAGE_T(new_leaf));
 
-    new_key = new_leaf.lf_record[0].key;
-    temp = insert_into_parent(table_id, root_page_num, leaf_page_num, new_key, new_leaf_page_num);
-
     buffer_unpin_page(leaf_frame, 2);
     buffer_unpin_page(new_leaf_frame, 2);
 
-    return temp;
+    return new_leaf_page_num;
 }
 
 
@@ -180,6 +217,7 @@ Pagenum_t insert_into_node(int table_id, Pagenum_t root_page_num, Pagenum_t pare
 
     int i;
     NodePage_t parent;
+    uint64_t right_total;
 
     parent_frame = buffer_read_page(table_id, parent_page_num);
     parent = PAGE_CONTENTS(parent_frame);
@@ -193,6 +231,17 @@ Pagenum_t insert_into_node(int table_id, Pagenum_t root_page_num, Pagenum_t pare
     
     parent.num_key++;
 
+    /* The new right node took its records
+     * over from the node left of it.
+     */
+    if (has_subtree_counts(table_id)) {
+        right_total = subtree_total(table_id, right_page_num);
+        for (i = parent.num_key; i > left_index + 1; i--)
+            SUBTREE_COUNT(parent, i) = SUBTREE_COUNT(parent, i - 1);
+        SUBTREE_COUNT(parent, left_index + 1) = right_total;
+        SUBTREE_COUNT(parent, left_index) -= right_total;
+    }
+
     buffer_write_page(parent_frame, PAGE_T(parent));
     buffer_unpin_page(parent_frame, 2);
 
@@ -207,13 +256,44 @@ Pagenum_t insert_into_node(int table_id, Pagenum_t root_page_num, Pagenum_t pare
 Pagenum_t insert_into_node_after_splitting(int table_id, Pagenum_t root_page_num,
 Pagenum_t old_node_page_num, int left_index, keyval_t key, Pagenum_t right_page_num) {
     // printf("insert_into_node_after_splitting called.\n");
-    BufferBlock_t * old_node_frame, * right_frame, * new_node_frame, * child_frame;
 
-    int i, j, split;
-    Pagenum_t new_node_page_num, child_page_num;
-    NodePage_t old_node, new_node, child;
+    Pagenum_t new_node_page_num;
+    keyval_t k_prime;
+
+    LogScope scope(LogType::SPLIT);
+
+    new_node_page_num = split_node(table_id, old_node_page_num, left_index, key, right_page_num, &k_prime, false);
+
+    /* Insert a new key into the parent of the two
+     * nodes resulting from the split, with
+     * the old node to the left and the new to the right.
+     */
+    return insert_into_parent(table_id, root_page_num, old_node_page_num, k_prime, new_node_page_num);
+}
+
+
+/* Splits a full internal node in two,
+ * inserting the new key and pointer into either half,
+ * and links the new node to the right of it.
+ */
+Pagenum_t split_node(int table_id, Pagenum_t old_node_page_num, int left_index, keyval_t key,
+    Pagenum_t right_page_num, keyval_t * k_prime_out, bool blink) {
+
+    BufferBlock_t * old_node_frame, * new_node_frame;
+
+    int i, j, split, order;
+    Pagenum_t new_node_page_num;
+    NodePage_t old_node, new_node;
     keyval_t * temp_keys, k_prime;
     Pagenum_t * temp_records;
+    uint32_t * temp_counts = NULL;
+    uint64_t right_total;
+    bool counted;
+
+    LogScope scope(LogType::SPLIT);
+
+    counted = has_subtree_counts(table_id);
+    order = internal_order(table_id);
 
     old_node_frame = buffer_read_page(table_id, old_node_page_num);
 
@@ -233,16 +313,23 @@ Pagenum_t old_node_page_num, int left_index, keyval_t key, Pagenum_t right_page_
      * the other half to the new.
      */
 
-    temp_records = (Pagenum_t *)malloc( (in_order + 1) * sizeof(Pagenum_t) );
+    temp_records = (Pagenum_t *)malloc( (order + 1) * sizeof(Pagenum_t) );
     if (temp_records == NULL) {
         perror("Temporary pointers array for splitting nodes.");
         exit(EXIT_FAILURE);
     }
-    temp_keys = (keyval_t *)malloc( in_order * sizeof(keyval_t) );
+    temp_keys = (keyval_t *)malloc( order * sizeof(keyval_t) );
     if (temp_keys == NULL) {
         perror("Temporary keys array for splitting nodes.");
         exit(EXIT_FAILURE);
     }
+    if (counted) {
+        temp_counts = (uint32_t *)malloc( (order + 1) * sizeof(uint32_t) );
+        if (temp_counts == NULL) {
+            perror("Temporary subtree counts array for splitting nodes.");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     for (i = 0, j = 0; i < old_node.num_key + 1; i++, j++) {
         if (j == left_index + 1) j++;
@@ -258,12 +345,23 @@ Pagenum_t old_node_page_num, int left_index, keyval_t key, Pagenum_t right_page_
     temp_records[left_index + 1] = right_page_num;
     temp_keys[left_index] = key;
 
+    // The counts go along with the pointers, the right node taking its records from the left one
+    if (counted) {
+        for (i = 0, j = 0; i < old_node.num_key + 1; i++, j++) {
+            if (j == left_index + 1) j++;
+            temp_counts[j] = SUBTREE_COUNT(old_node, i);
+        }
+        right_total = subtree_total(table_id, right_page_num);
+        temp_counts[left_index + 1] = right_total;
+        temp_counts[left_index] -= right_total;
+    }
+
     /* Create the new node and copy
      * half the keys and pointers to the
      * old and half to the new.
      */  
 
-    split = cut(in_order);
+    split = cut(order);
 
     new_node_page_num = make_node(table_id, false);
     new_node_frame = buffer_read_page(table_id, new_node_page_num);
@@ -279,11 +377,10 @@ Pagenum_t old_node_page_num, int left_index, keyval_t key, Pagenum_t right_page_
     }
 
     old_node.in_record[i-1].page_num = temp_records[i];
-    buffer_write_page(old_node_frame, PAGE_T(old_node));
 
     k_prime = temp_keys[split - 1];
 
-    for (++i, j = 0; i < in_order; i++, j++) {
+    for (++i, j = 0; i < order; i++, j++) {
         if(!j) new_node.extra_page_num = temp_records[i];
         else new_node.in_record[j-1].page_num = temp_records[i];
         new_node.in_record[j].key = temp_keys[i];
@@ -291,39 +388,50 @@ Pagenum_t old_node_page_num, int left_index, keyval_t key, Pagenum_t right_page_
     }
     new_node.in_record[j-1].page_num = temp_records[i];
 
+    if (counted) {
+        for (i = 0; i < split; i++)
+            SUBTREE_COUNT(old_node, i) = temp_counts[i];
+        for (i = split; i <= order; i++)
+            SUBTREE_COUNT(new_node, i - split) = temp_counts[i];
+    }
+
     free(temp_records);
     free(temp_keys);
+    free(temp_counts);
+
+    // right sibling node connection, the new node taking the keys from k_prime up
+    new_node.next_page_num = old_node.next_page_num;
+    old_node.next_page_num = new_node_page_num;
+
+    new_node.high_key = old_node.high_key;
+    old_node.high_key = k_prime;
+    old_node.split_pending = blink;
 
     new_node.parent_page_num = old_node.parent_page_num;
+
+    buffer_write_page(old_node_frame, PAGE_T(old_node));
     buffer_write_page(new_node_frame, PAGE_T(new_node));
 
     //printf("new node page info: ");
     //print_node_page(new_node_page_num);
  
+    /* A B-link split holds the new node only, and children are
+     * never latched after their parent: they keep the old node
+     * as their parent page number, which is a hint from then on.
+     */
     Pagenum_t temp;
-    for (i = 0; i <= new_node.num_key; i++) {
+    for (i = 0; i <= new_node.num_key && !blink; i++) {
         if(!i) temp = new_node.extra_page_num;
         else temp = new_node.in_record[i-1].page_num;
 
-        BufferBlock_t * temp_frame = buffer_read_page(table_id, temp);
-        child = PAGE_CONTENTS(temp_frame);
-        child.parent_page_num = new_node_page_num;
-
-        buffer_write_page(temp_frame, PAGE_T(child));
-        buffer_unpin_page(temp_frame, 2);
+        set_parent_page(table_id, temp, new_node_page_num);
     }
 
-    /* Insert a new key into the parent of the two
-     * nodes resulting from the split, with
-     * the old node to the left and the new to the right.
-     */
-    //printf("call insert_into_parent(%ld, %ld, %ld, %ld)\n", root_page_num, old_node_page_num, k_prime, new_node_page_num);
-    temp = insert_into_parent(table_id, root_page_num, old_node_page_num, k_prime, new_node_page_num);
-
     buffer_unpin_page(old_node_frame, 2);
     buffer_unpin_page(new_node_frame, 2);
 
-    return temp;
+    *k_prime_out = k_prime;
+    return new_node_page_num;
 }
 
 
@@ -379,7 +487,7 @@ Pagenum_t insert_into_parent(int table_id, Pagenum_t root_page_num,
     /* Simple case: the new key fits into the node. 
      */
 
-    if (parent.num_key < in_order - 1){
+    if (parent.num_key < internal_order(table_id) - 1){
         //printf("insert_into_node(%ld, %ld, %d, %ld, %ld) called.\n", root_page_num, parent_page_num, left_index, key, right_page_num);
         temp = insert_into_node(table_id, root_page_num, parent_page_num, left_index, key, right_page_num);        
         buffer_unpin_page(left_frame, 1);
@@ -411,6 +519,7 @@ Pagenum_t insert_into_new_root(int table_id, Pagenum_t left_page_num, keyval_t k
     NodePage_t root, right;
 
     root_frame = buffer_read_page(table_id, root_page_num);
+    root = PAGE_CONTENTS(root_frame);
  
     root.parent_page_num = NO_PARENT;
     root.is_leaf = false;
@@ -419,6 +528,11 @@ Pagenum_t insert_into_new_root(int table_id, Pagenum_t left_page_num, keyval_t k
     root.in_record[0].key = key;
     root.in_record[0].page_num = right_page_num;
 
+    if (has_subtree_counts(table_id)) {
+        SUBTREE_COUNT(root, 0) = subtree_total(table_id, left_page_num);
+        SUBTREE_COUNT(root, 1) = subtree_total(table_id, right_page_num);
+    }
+
     right_frame = buffer_read_page(table_id, right_page_num);
     right = PAGE_CONTENTS(right_frame);
     right.parent_page_num = root_page_num;
@@ -458,6 +572,189 @@ Pagenum_t start_new_tree(int table_id, keyval_t key, Record_t pointer) {
 
 
 
+/* Records in both halves of a B-link split
+ * that the parents point at them now.
+ */
+static void end_split(int table_id, Pagenum_t left_page_num, Pagenum_t left_parent,
+    Pagenum_t right_page_num, Pagenum_t right_parent) {
+
+    BufferBlock_t * left_frame = buffer_read_page(table_id, left_page_num);
+    NodePage_t left = PAGE_CONTENTS(left_frame);
+
+    left.split_pending = false;
+    left.parent_page_num = left_parent;
+
+    buffer_write_page(left_frame, PAGE_T(left));
+    buffer_unpin_page(left_frame, 2);
+
+    set_parent_page(table_id, right_page_num, right_parent);
+}
+
+
+/* Finds the node above page_num, which was the root
+ * when it was put into the path. A former root is the
+ * first node of its level, and every root since has
+ * the one before it as its first child.
+ */
+static Pagenum_t get_first_parent(int table_id, Pagenum_t page_num) {
+
+    Pagenum_t parent_page_num = read_root_page_num(table_id), child_page_num;
+
+    while (true) {
+        BufferBlock_t * frame = buffer_read_page(table_id, parent_page_num);
+        frame->latch.lock_shared();
+        child_page_num = PAGE_CONTENTS(frame).extra_page_num;
+        frame->latch.unlock_shared();
+        buffer_unpin_page(frame, 1);
+
+        if (child_page_num == page_num)
+            return parent_page_num;
+        parent_page_num = child_page_num;
+    }
+}
+
+
+/* Inserts the key and the new right node of a B-link split
+ * of left, on the given level of path, into the parents.
+ * Both nodes are latched, and the parent is latched before
+ * they are let go. Each level is written by a system operation
+ * of its own, after which the tree is whole again: lookups
+ * reach the new node through its parent or through the right
+ * link of the left node, as long as the left node is marked.
+ */
+static void insert_into_parent_blink(int table_id, TreeLatches & latches, vector<Pagenum_t> & path,
+    size_t level, Pagenum_t left_page_num, keyval_t key, Pagenum_t right_page_num) {
+
+    Pagenum_t parent_page_num, new_node_page_num;
+    keyval_t k_prime;
+
+    while (true) {
+
+        /* Case: new root, unless the tree grew
+         * above the left node in the meantime.
+         */
+        if (level + 1 == path.size()) {
+            if (read_root_page_num(table_id) == left_page_num) {
+                SystemOp op(LogType::SPLIT);
+
+                Pagenum_t root_page_num = insert_into_new_root(table_id, left_page_num, key, right_page_num);
+                end_split(table_id, left_page_num, root_page_num, right_page_num, root_page_num);
+                buffer_set_root_page(table_id, root_page_num);
+                return;
+            }
+            path.push_back(get_first_parent(table_id, path.back()));
+        }
+
+        /* The parent is the node on the next level whose
+         * key range holds key, right of the one in the path.
+         */
+        parent_page_num = latches.latch_right(path[level + 1], key);
+
+        BufferBlock_t * parent_frame = buffer_read_page(table_id, parent_page_num);
+        NodePage_t & parent = PAGE_CONTENTS(parent_frame);
+        int left_index = get_key_index(parent, key);
+        bool fits = is_safe(table_id, parent, TreeOp::INSERT);
+        buffer_unpin_page(parent_frame, 1);
+
+        if (fits) {
+            SystemOp op(LogType::SPLIT);
+
+            insert_into_node(table_id, NO_ROOT_NODE, parent_page_num, left_index, key, right_page_num);
+            end_split(table_id, left_page_num, parent_page_num, right_page_num, parent_page_num);
+        }
+        else {
+            SystemOp op(LogType::SPLIT);
+
+            // The left node goes to the new node only if key is pushed up, the right one if it isn't smaller
+            new_node_page_num = split_node(table_id, parent_page_num, left_index, key, right_page_num, &k_prime, true);
+            end_split(table_id, left_page_num, key <= k_prime ? parent_page_num : new_node_page_num,
+                right_page_num, key < k_prime ? parent_page_num : new_node_page_num);
+        }
+
+        latches.unlatch(left_page_num);
+        latches.unlatch(right_page_num);
+
+        if (fits)
+            return;
+
+        left_page_num = parent_page_num;
+        right_page_num = new_node_page_num;
+        key = k_prime;
+        level++;
+    }
+}
+
+
+/* Finishes the B-link splits a crash cut short
+ * before the parent was given the new node.
+ * Recovery calls this once it rolled back every
+ * unfinished operation; the split nodes are still
+ * marked, and their right links lead to the new nodes.
+ */
+void finish_splits(int table_id) {
+
+    BufferBlock_t * header_frame = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
+    Pagenum_t num_page = header_frame->frame.header_page.num_page;
+    buffer_unpin_page(header_frame, 1);
+
+    for (Pagenum_t page_num = HEADER_PAGE_NUMBER + 1; page_num < num_page; page_num++) {
+
+        BufferBlock_t * frame = buffer_read_page(table_id, page_num);
+        NodePage_t node = PAGE_CONTENTS(frame);
+        buffer_unpin_page(frame, 1);
+
+        // free pages are zeroed
+        if (!node.split_pending)
+            continue;
+
+        // The level of the node counts the first children down to a leaf
+        size_t level = 0;
+        for (Pagenum_t child_page_num = page_num; ; level++) {
+            frame = buffer_read_page(table_id, child_page_num);
+            bool is_leaf = PAGE_CONTENTS(frame).is_leaf;
+            child_page_num = PAGE_CONTENTS(frame).extra_page_num;
+            buffer_unpin_page(frame, 1);
+            if (is_leaf)
+                break;
+        }
+
+        TreeLatches latches(table_id);
+        vector<Pagenum_t> path;
+
+        // The last key below the high key leads through the node
+        Pagenum_t leaf_page_num = latches.descend_blink(node.high_key - 1, path);
+        if (leaf_page_num != page_num) {
+            latches.unlatch(leaf_page_num);
+            latches.latch(page_num);
+        }
+        latches.latch(right_link(node));
+
+        insert_into_parent_blink(table_id, latches, path, level, page_num, node.high_key, right_link(node));
+    }
+}
+
+
+/* Looks key up in a latched leaf.
+ * Returns whether the key is there, setting fits
+ * to whether the leaf has room for one more record.
+ */
+static bool leaf_contains(int table_id, Pagenum_t leaf_page_num, keyval_t key, bool * fits) {
+
+    int i;
+    BufferBlock_t * leaf_frame = buffer_read_page(table_id, leaf_page_num);
+    NodePage_t & leaf = PAGE_CONTENTS(leaf_frame);
+
+    for (i = 0; i < leaf.num_key; i++)
+        if (leaf.lf_record[i].key == key) break;
+
+    bool is_duplicate = i < leaf.num_key;
+    *fits = is_safe(table_id, leaf, TreeOp::INSERT);
+    buffer_unpin_page(leaf_frame, 1);
+
+    return is_duplicate;
+}
+
+
 /* Master insertion function.
  * Inserts a key and an associated value into
  * the B+ tree, causing the tree to be adjusted
@@ -470,107 +767,119 @@ Pagenum_t start_new_tree(int table_id, keyval_t key, Record_t pointer) {
 int db_insert(int table_id, keyval_t key, char * value ) {
     // printf("db_insert called.\n");
     Pagenum_t root_page_num;
-    Pagenum_t leaf_page_num, temp_page_num;
-    HeaderPage_t header;
-    NodePage_t leaf;
+    Pagenum_t leaf_page_num, new_root_page_num, new_leaf_page_num;
     Record_t new_record;
-
-    BufferBlock_t * header_frame, * leaf_frame;
+    keyval_t new_key;
+    bool fits, counted;
 
     if (tables.in_use[table_id] == false){
         printf("Required table is not opened yet!\n");
         return FAILURE;
     }
 
-    header_frame = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
-    header = header_frame->frame.header_page;
-    root_page_num = header.root_page_num;
+    // A split could not be logged
+    if (log_failed()){
+        return FAILURE;
+    }
 
-    //cerr << "line 489" << endl; buffer->print_all();
+    // The key goes into the filter before the leaf, so a lookup never finds it only in the leaf
+    shared_lock<shared_timed_mutex> bloom_guard(bloom_latch(table_id));
+    bloom_add(table_id, key);
 
-    /* The current implementation ignores
-     * duplicates.
-     */
+    // The latches outlive the system operation, so that it ends before anyone sees its pages
+    TreeLatches latches(table_id);
+    SystemOp op(LogType::INSERT);
 
-    Record_t temp = find(table_id, root_page_num, key, false);
+    new_record = make_record(value);
 
-    //cerr << "line 497" << endl; buffer->print_all();
-    
-    if (temp.is_null == false){
-        // insertion failure
-        // root page number doesn't change
-        buffer_unpin_page(header_frame, 1);
-        //cerr << "line 503" << endl; buffer->print_all();
-        return KEY_ALREADY_EXISTS;
+    /* Most insertions fit into their leaf, so only
+     * the leaf is latched exclusively at first.
+     * An insertion into a table keeping subtree counts
+     * changes every level, and starts with the last case.
+     */
+    counted = has_subtree_counts(table_id);
+    leaf_page_num = counted ? NO_ROOT_NODE : latches.descend(key, TreeOp::INSERT, true);
+
+    if (leaf_page_num != NO_ROOT_NODE){
+
+        /* The current implementation ignores
+         * duplicates.
+         */
+        if (leaf_contains(table_id, leaf_page_num, key, &fits)){
+            return KEY_ALREADY_EXISTS;
+        }
+
+        /* Case: leaf has room for key and value.
+         */
+        if (fits){
+            insert_into_leaf(table_id, leaf_page_num, key, new_record);
+            return SUCCESS;
+        }
+
+        /* Case: B-link split. The leaf is latched again
+         * with the root latch held shared, and the split
+         * goes up from it.
+         */
+        vector<Pagenum_t> path;
+
+        if (blink_insert && (leaf_page_num = latches.descend_blink(key, path)) != NO_ROOT_NODE){
+
+            if (leaf_contains(table_id, leaf_page_num, key, &fits)){
+                return KEY_ALREADY_EXISTS;
+            }
+
+            if (fits){
+                insert_into_leaf(table_id, leaf_page_num, key, new_record);
+                return SUCCESS;
+            }
+
+            {
+                SystemOp split_op(LogType::SPLIT);
+                new_leaf_page_num = split_leaf(table_id, leaf_page_num, key, new_record, &new_key, true);
+            }
+
+            insert_into_parent_blink(table_id, latches, path, 0, leaf_page_num, new_key, new_leaf_page_num);
+            return SUCCESS;
+        }
     }
 
-    /* Create a new record for the
-     * value.
+    /* The leaf must be split or the tree is empty:
+     * descend again, keeping every node the split may reach.
      */
-    new_record = make_record(value);
-    //cerr << "line 511" << endl; buffer->print_all();
+    leaf_page_num = latches.descend(key, TreeOp::INSERT, false);
+    root_page_num = latches.get_root_page_num();
 
     /* Case: the tree does not exist yet.
      * Start a new tree.
      */
-    // new root page has been allocated!
-    // root page number change
-    if (root_page_num == NO_ROOT_NODE){
-        temp_page_num = start_new_tree(table_id, key, new_record);
-        //cerr << "line 520" << endl; buffer->print_all();
-
-        //header_frame = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
-        header = header_frame->frame.header_page;
-
-        //update_header(header.free_page_num, temp_page_num, header.num_page);
-
-        header.root_page_num = temp_page_num;
-        buffer_write_page(header_frame, PAGE_T(header));
-        buffer_unpin_page(header_frame, 2);
-        //cerr << "line 530" << endl; buffer->print_all();
-        //printf("start_new_tree() called.\n");
+    if (leaf_page_num == NO_ROOT_NODE){
+        buffer_set_root_page(table_id, start_new_tree(table_id, key, new_record));
         return SUCCESS;
     }
 
-    /* Case: the tree already exists.
-     * (Rest of function body.)
-     */
-
-    leaf_page_num = find_leaf(table_id, root_page_num, key, false);
+    if (leaf_contains(table_id, leaf_page_num, key, &fits)){
+        return KEY_ALREADY_EXISTS;
+    }
 
-    leaf_frame = buffer_read_page(table_id, leaf_page_num);
-    leaf = PAGE_CONTENTS(leaf_frame);
-    //cerr << "line 543" << endl; buffer->print_all();
+    // Every subtree on the path gets the record, before a split hands part of it to a new node
+    if (counted){
+        add_to_subtree_counts(table_id, key, 1);
+    }
 
-    /* Case: leaf has room for key and value.
-     */
-    // nothing changes
-    if (leaf.num_key < lf_order - 1){
+    // Others may have made room in the meantime
+    if (fits){
         insert_into_leaf(table_id, leaf_page_num, key, new_record);
-        //printf("insert_into_leaf() called.\n");
-
-        buffer_unpin_page(header_frame, 1);
-        buffer_unpin_page(leaf_frame, 1);
-        //cerr << "line 554" << endl; buffer->print_all();
         return SUCCESS;
     }
 
     /* Case:  leaf must be split.
      */
-    //printf("insert_into_leaf_after_splitting() called.\n");
-    Pagenum_t new_root_page_num = insert_into_leaf_after_splitting(table_id, root_page_num, leaf_page_num, key, new_record);
-    //cerr << "line 562" << endl; buffer->print_all();
+    new_root_page_num = insert_into_leaf_after_splitting(table_id, root_page_num, leaf_page_num, key, new_record);
 
     // if root page number was changed, header page need to be updated
-    if(new_root_page_num != root_page_num){
-        header = header_frame->frame.header_page;
-        header.root_page_num = new_root_page_num;
-        buffer_write_page(header_frame, PAGE_T(header));
-        buffer_unpin_page(header_frame, 1);
+    if (new_root_page_num != root_page_num){
+        buffer_set_root_page(table_id, new_root_page_num);
     }
-    
-    buffer_unpin_page(header_frame, 1);
-    buffer_unpin_page(leaf_frame, 1);
-    //cerr << "line 574" << endl; buffer->print_all();
+
     return SUCCESS;
-}
\ No newline at end of file
+}
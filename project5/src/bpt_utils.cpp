@@ -1,4 +1,5 @@
 #include "bpt.hpp"
+#include "bloom.hpp"
 
 // GLOBALS.
 
@@ -24,6 +25,647 @@ bool verbose_output = true;
 
 struct QNode * queue = NULL;
 
+thread_local TreeLatches * tree_latches = nullptr;
+
+bool optimistic_descent = true;
+
+bool blink_insert = true;
+
+// How the leaf at the end of a descent is latched
+enum class LeafLatch { NONE, SHARED, EXCLUSIVE };
+
+// Index of the child of an internal node whose subtree may hold key
+// The node may be read without its latch, so the number of keys is bounded
+static int child_index(NodePage_t & node_page, keyval_t key){
+    int i = 0, num_key = min(node_page.num_key, in_order - 1);
+    while (i < num_key && key >= node_page.in_record[i].key)
+        i++;
+    return i;
+}
+
+Pagenum_t right_link(NodePage_t & node){
+    return node.is_leaf ? node.right_page_num : node.next_page_num;
+}
+
+bool beyond_high_key(NodePage_t & node, keyval_t key){
+    return right_link(node) != 0 && key >= node.high_key;
+}
+
+Pagenum_t read_root_page_num(int table_id){
+    BufferBlock_t * header_frame = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
+    unique_lock<mutex> guard(header_frame->content_latch);
+    Pagenum_t root_page_num = header_frame->frame.header_page.root_page_num;
+    guard.unlock();
+    buffer_unpin_page(header_frame, 1);
+    return root_page_num;
+}
+
+// Latch a node on the way down
+// The node is latched shared, or exclusively if it is a leaf and mode is EXCLUSIVE
+// A leaf is relatched in place; if it is split in between, the descent moves right from it
+// Return whether the node was latched exclusively
+static bool latch_child(BufferBlock_t * frame, LeafLatch mode){
+    frame->latch.lock_shared();
+    if (mode != LeafLatch::EXCLUSIVE || !PAGE_CONTENTS(frame).is_leaf){
+        return false;
+    }
+    frame->latch.unlock_shared();
+    frame->latch.lock();
+    return true;
+}
+
+static void unlatch(BufferBlock_t * frame, bool exclusive){
+    if (exclusive) frame->latch.unlock();
+    else frame->latch.unlock_shared();
+    buffer_unpin_page(frame, 1);
+}
+
+// Latch the leaf an optimistic descent read at version in mode
+// Return false, leaving it unlatched, if a writer took it since
+static bool latch_unchanged(BufferBlock_t * frame, uint64_t version, LeafLatch mode){
+    switch (mode){
+    case LeafLatch::EXCLUSIVE:
+        frame->latch.lock();
+        // taking the latch exclusively moved the version by one
+        if (frame->latch.get_version() == version + 1) return true;
+        frame->latch.unlock();
+        return false;
+    case LeafLatch::SHARED:
+        frame->latch.lock_shared();
+        if (frame->latch.validate(version)) return true;
+        frame->latch.unlock_shared();
+        return false;
+    default:
+        return frame->latch.validate(version);
+    }
+}
+
+// Descend from the node at page_num to the leaf that may hold key, latching one node at a time
+// Called with the root latch held shared, so that no node on the way is freed;
+// a node split since the pointer to it was read is left through its right link
+// If path is given, the first node reached on each level is appended to it, from the top down
+// Return the leaf pinned and latched in mode
+static BufferBlock_t * descend_links(int table_id, Pagenum_t page_num, keyval_t key, LeafLatch mode, bool verbose, vector<Pagenum_t> * path){
+
+    int i;
+    BufferBlock_t * frame = buffer_read_page(table_id, page_num), * next_frame;
+    bool is_exclusive = latch_child(frame, mode), moved_right = false;
+
+    while (true){
+
+        NodePage_t & node_page = PAGE_CONTENTS(frame);
+
+        if (path != nullptr && !moved_right)
+            path->push_back(frame->page_num);
+
+        moved_right = beyond_high_key(node_page, key);
+
+        if (moved_right){
+            if (verbose)
+                printf("right ->\n");
+            page_num = right_link(node_page);
+        }
+        else {
+            if (node_page.is_leaf)
+                break;
+
+            if (verbose) {
+                printf("[");
+                for (i = 0; i < node_page.num_key - 1; i++)
+                    printf("%ld ", node_page.in_record[i].key);
+                printf("%ld] ", node_page.in_record[i].key);
+            }
+
+            i = child_index(node_page, key);
+
+            if (verbose)
+                printf("%d ->\n", i);
+
+            page_num = INTERNAL_VAL(node_page, i);
+        }
+
+        // B-link splits latch a parent while holding its child,
+        // so a node is let go before the next one is latched
+        next_frame = buffer_read_page(table_id, page_num);
+        unlatch(frame, is_exclusive);
+        frame = next_frame;
+        is_exclusive = latch_child(frame, mode);
+    }
+
+    if (mode == LeafLatch::NONE){
+        frame->latch.unlock_shared();
+    }
+    return frame;
+}
+
+// Descend to the leaf that may hold key with shared latches
+// Return the leaf pinned and latched in mode, or nullptr if the tree is empty
+static BufferBlock_t * descend_shared(int table_id, keyval_t key, LeafLatch mode, bool verbose, Pagenum_t * root_page_num){
+
+    PageLatch & root_latch = tables.root_latch[table_id];
+
+    root_latch.lock_shared();
+    Pagenum_t page_num = read_root_page_num(table_id);
+    *root_page_num = page_num;
+
+    if (page_num == NO_ROOT_NODE){
+        root_latch.unlock_shared();
+        if (verbose)
+            printf("Empty tree.\n");
+        return nullptr;
+    }
+
+    BufferBlock_t * frame = descend_links(table_id, page_num, key, mode, verbose, nullptr);
+    root_latch.unlock_shared();
+    return frame;
+}
+
+// Descend to the leaf that may hold key without latching anything above it
+// The page number of each node is trusted only once the node it was read from
+// is validated, after the version of the next node has been read
+// Return the leaf pinned and latched in mode, or nullptr if the tree is empty
+// Set *conflict, returning nullptr, if a writer got in the way
+static BufferBlock_t * descend_optimistic(int table_id, keyval_t key, LeafLatch mode, Pagenum_t * root_page_num, bool * conflict){
+
+    PageLatch * parent_latch = &tables.root_latch[table_id];
+    BufferBlock_t * parent_frame = nullptr, * frame;
+    uint64_t parent_version, version;
+    Pagenum_t page_num;
+
+    *conflict = true;
+
+    // An insert or delete holding the root latch may be replacing the root
+    if (!parent_latch->read_begin(&parent_version)){
+        return nullptr;
+    }
+
+    page_num = read_root_page_num(table_id);
+    *root_page_num = page_num;
+
+    if (page_num == NO_ROOT_NODE){
+        *conflict = !parent_latch->validate(parent_version);
+        return nullptr;
+    }
+
+    while (true){
+
+        frame = buffer_read_page(table_id, page_num);
+        bool is_valid = frame->latch.read_begin(&version) && parent_latch->validate(parent_version);
+
+        if (parent_frame != nullptr){
+            buffer_unpin_page(parent_frame, 1);
+        }
+
+        NodePage_t & node_page = PAGE_CONTENTS(frame);
+        bool is_leaf = node_page.is_leaf, move_right = beyond_high_key(node_page, key);
+
+        if (move_right){
+            page_num = right_link(node_page);
+        }
+        else if (!is_leaf){
+            page_num = INTERNAL_VAL(node_page, child_index(node_page, key));
+        }
+
+        // A page number read from a node a writer changed meanwhile may be garbage
+        if (!is_valid || !frame->latch.validate(version)){
+            buffer_unpin_page(frame, 1);
+            return nullptr;
+        }
+
+        if (is_leaf && !move_right){
+            if (!latch_unchanged(frame, version, mode)){
+                buffer_unpin_page(frame, 1);
+                return nullptr;
+            }
+            *conflict = false;
+            return frame;
+        }
+
+        parent_frame = frame;
+        parent_latch = &frame->latch;
+        parent_version = version;
+    }
+}
+
+// Descend optimistically, falling back to shared latches if writers keep getting in the way
+static BufferBlock_t * descend_leaf(int table_id, keyval_t key, LeafLatch mode, Pagenum_t * root_page_num){
+
+    BufferBlock_t * frame;
+    bool conflict;
+
+    if (optimistic_descent){
+        for (int i = 0; i < OPTIMISTIC_DESCENT_RETRIES; i++){
+            frame = descend_optimistic(table_id, key, mode, root_page_num, &conflict);
+            if (!conflict){
+                return frame;
+            }
+        }
+    }
+
+    return descend_shared(table_id, key, mode, false, root_page_num);
+}
+
+bool is_safe(int table_id, NodePage_t & node, TreeOp op){
+    switch (op){
+    case TreeOp::INSERT:
+        return node.num_key < (node.is_leaf ? lf_order - 1 : internal_order(table_id) - 1);
+    case TreeOp::DELETE:
+        return node.num_key > 1;
+    default:
+        return true;
+    }
+}
+
+TreeLatches::TreeLatches(int table_id)
+    : table_id(table_id), saved(tree_latches), holds_root(false), root_exclusive(false), root_page_num(NO_ROOT_NODE) {
+    tree_latches = this;
+}
+
+TreeLatches::~TreeLatches(){
+    release();
+    tree_latches = saved;
+}
+
+void TreeLatches::push(BufferBlock_t * frame, bool is_exclusive){
+    frames.push_back(frame);
+    exclusive.push_back(is_exclusive);
+}
+
+void TreeLatches::release_ancestors(TreeOp op){
+
+    // A delete keeps the root latch until it ends: lookups latching one node at a time
+    // may still be heading for a node it frees, and B-link splits, which latch upwards,
+    // must not run into the latches it holds
+    if (holds_root && op != TreeOp::DELETE){
+        tables.root_latch[table_id].unlock();
+        holds_root = false;
+    }
+
+    for (size_t i = 0; i + 1 < frames.size(); i++){
+        ::unlatch(frames[i], exclusive[i]);
+    }
+
+    if (frames.size() > 1){
+        frames.erase(frames.begin(), frames.end() - 1);
+        exclusive.erase(exclusive.begin(), exclusive.end() - 1);
+    }
+}
+
+Pagenum_t TreeLatches::descend(keyval_t key, TreeOp op, bool optimistic){
+
+    release();
+
+    if (optimistic){
+        BufferBlock_t * frame = descend_leaf(table_id, key, LeafLatch::EXCLUSIVE, &root_page_num);
+        if (frame == nullptr){
+            return NO_ROOT_NODE;
+        }
+        push(frame, true);
+        return frame->page_num;
+    }
+
+    tables.root_latch[table_id].lock();
+    holds_root = true;
+    root_exclusive = true;
+
+    root_page_num = read_root_page_num(table_id);
+    if (root_page_num == NO_ROOT_NODE){
+        return NO_ROOT_NODE;
+    }
+
+    // A change updates subtree counts on every level, so no node is safe
+    bool keeps_path = has_subtree_counts(table_id);
+    Pagenum_t page_num = root_page_num, parent_page_num = NO_PARENT;
+
+    while (true){
+
+        BufferBlock_t * frame = buffer_read_page(table_id, page_num);
+
+        frame->latch.lock();
+        push(frame, true);
+
+        // B-link splits leave their old parent in the children they move,
+        // while merges and these splits go up through it
+        NodePage_t & node_page = PAGE_CONTENTS(frame);
+        if (node_page.parent_page_num != parent_page_num)
+            set_parent_page(table_id, page_num, parent_page_num);
+
+        if (!keeps_path && is_safe(table_id, node_page, op))
+            release_ancestors(op);
+
+        if (node_page.is_leaf){
+            return page_num;
+        }
+        parent_page_num = page_num;
+        page_num = INTERNAL_VAL(node_page, child_index(node_page, key));
+    }
+}
+
+Pagenum_t TreeLatches::descend_blink(keyval_t key, vector<Pagenum_t> & path){
+
+    release();
+    path.clear();
+
+    tables.root_latch[table_id].lock_shared();
+    holds_root = true;
+    root_exclusive = false;
+
+    root_page_num = read_root_page_num(table_id);
+    if (root_page_num == NO_ROOT_NODE){
+        return NO_ROOT_NODE;
+    }
+
+    vector<Pagenum_t> levels;
+    BufferBlock_t * frame = descend_links(table_id, root_page_num, key, LeafLatch::EXCLUSIVE, false, &levels);
+    path.assign(levels.rbegin(), levels.rend());
+
+    push(frame, true);
+    return frame->page_num;
+}
+
+Pagenum_t TreeLatches::get_root_page_num(){
+    return root_page_num;
+}
+
+bool TreeLatches::holds(Pagenum_t page_num){
+    for (BufferBlock_t * frame : frames){
+        if (frame->page_num == page_num){
+            return true;
+        }
+    }
+    return false;
+}
+
+void TreeLatches::latch(Pagenum_t page_num){
+
+    if (holds(page_num)){
+        return;
+    }
+
+    BufferBlock_t * frame = buffer_read_page(table_id, page_num);
+    frame->latch.lock();
+    push(frame, true);
+}
+
+Pagenum_t TreeLatches::latch_right(Pagenum_t page_num, keyval_t key){
+
+    latch(page_num);
+    BufferBlock_t * frame = buffer_read_page(table_id, page_num);
+
+    while (beyond_high_key(PAGE_CONTENTS(frame), key)){
+        Pagenum_t next_page_num = right_link(PAGE_CONTENTS(frame));
+        buffer_unpin_page(frame, 1);
+
+        latch(next_page_num);
+        unlatch(page_num);
+
+        page_num = next_page_num;
+        frame = buffer_read_page(table_id, page_num);
+    }
+
+    buffer_unpin_page(frame, 1);
+    return page_num;
+}
+
+void TreeLatches::unlatch(Pagenum_t page_num){
+    for (size_t i = 0; i < frames.size(); i++){
+        if (frames[i]->page_num == page_num){
+            ::unlatch(frames[i], exclusive[i]);
+            frames.erase(frames.begin() + i);
+            exclusive.erase(exclusive.begin() + i);
+            return;
+        }
+    }
+}
+
+void TreeLatches::free_later(BufferBlock_t * frame){
+    latch(frame->page_num);
+    freed.push_back(frame);
+}
+
+void TreeLatches::release(){
+
+    // The latches are still held, so nobody reaches a page while it is freed
+    for (BufferBlock_t * frame : freed){
+        buffer_free_page(frame);
+        buffer_unpin_page(frame, 1);
+    }
+    freed.clear();
+
+    if (holds_root){
+        if (root_exclusive) tables.root_latch[table_id].unlock();
+        else tables.root_latch[table_id].unlock_shared();
+        holds_root = false;
+    }
+
+    for (size_t i = 0; i < frames.size(); i++){
+        ::unlatch(frames[i], exclusive[i]);
+    }
+    frames.clear();
+    exclusive.clear();
+}
+
+void latch_node(Pagenum_t page_num){
+    if (tree_latches != nullptr){
+        tree_latches->latch(page_num);
+    }
+}
+
+void set_parent_page(int table_id, Pagenum_t page_num, Pagenum_t parent_page_num){
+
+    bool is_held = tree_latches != nullptr && tree_latches->holds(page_num);
+    BufferBlock_t * frame = buffer_read_page(table_id, page_num);
+    if (!is_held) frame->latch.lock();
+
+    NodePage_t node = PAGE_CONTENTS(frame);
+    node.parent_page_num = parent_page_num;
+    buffer_write_page(frame, PAGE_T(node));
+
+    if (!is_held) frame->latch.unlock();
+    buffer_unpin_page(frame, 2);
+}
+
+void free_node(BufferBlock_t * frame){
+    if (tree_latches != nullptr){
+        tree_latches->free_later(frame);
+    }
+    else {
+        buffer_free_page(frame);
+        buffer_unpin_page(frame, 1);
+    }
+}
+
+BufferBlock_t * find_leaf_frame(int table_id, keyval_t key, bool exclusive){
+    Pagenum_t root_page_num;
+    return descend_leaf(table_id, key, exclusive ? LeafLatch::EXCLUSIVE : LeafLatch::SHARED, &root_page_num);
+}
+
+BufferBlock_t * find_leaf_frame_shared(int table_id, keyval_t key){
+    Pagenum_t root_page_num = read_root_page_num(table_id);
+    if (root_page_num == NO_ROOT_NODE){
+        return nullptr;
+    }
+    return descend_links(table_id, root_page_num, key, LeafLatch::SHARED, false, nullptr);
+}
+
+bool has_subtree_counts(int table_id){
+    return tables.subtree_counts[table_id].load(memory_order_relaxed);
+}
+
+int internal_order(int table_id){
+    return has_subtree_counts(table_id) ? COUNTED_INTERNAL_ORDER : in_order;
+}
+
+// Records in the subtree of node, given that of each child
+static uint64_t node_total(NodePage_t & node){
+    if (node.is_leaf){
+        return node.num_key;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i <= node.num_key; i++){
+        total += SUBTREE_COUNT(node, i);
+    }
+    return total;
+}
+
+uint64_t subtree_total(int table_id, Pagenum_t page_num){
+    BufferBlock_t * frame = buffer_read_page(table_id, page_num);
+    uint64_t total = node_total(PAGE_CONTENTS(frame));
+    buffer_unpin_page(frame, 1);
+    return total;
+}
+
+void add_to_subtree_counts(int table_id, keyval_t key, int delta){
+
+    Pagenum_t page_num = read_root_page_num(table_id);
+
+    while (page_num != NO_ROOT_NODE){
+        BufferBlock_t * frame = buffer_read_page(table_id, page_num);
+        NodePage_t node = PAGE_CONTENTS(frame);
+
+        if (node.is_leaf){
+            buffer_unpin_page(frame, 1);
+            return;
+        }
+
+        int i = child_index(node, key);
+        SUBTREE_COUNT(node, i) += delta;
+        page_num = INTERNAL_VAL(node, i);
+
+        buffer_write_page(frame, PAGE_T(node));
+        buffer_unpin_page(frame, 2);
+    }
+}
+
+// Descend from the root to the leaf that may hold key, adding up the records left of the path
+// Nothing changes the counts while the root latch is held shared, so one node is latched at a time
+uint64_t count_keys_below(int table_id, keyval_t key, bool inclusive){
+
+    uint64_t count = 0;
+    Pagenum_t page_num = read_root_page_num(table_id);
+
+    while (page_num != NO_ROOT_NODE){
+        BufferBlock_t * frame = buffer_read_page(table_id, page_num);
+        frame->latch.lock_shared();
+        NodePage_t & node = PAGE_CONTENTS(frame);
+
+        if (node.is_leaf){
+            int i = 0;
+            while (i < node.num_key && (node.lf_record[i].key < key || (inclusive && node.lf_record[i].key == key)))
+                i++;
+            count += i;
+            page_num = NO_ROOT_NODE;
+        }
+        else {
+            int i = child_index(node, key);
+            for (int j = 0; j < i; j++)
+                count += SUBTREE_COUNT(node, j);
+            page_num = INTERNAL_VAL(node, i);
+        }
+        unlatch(frame, false);
+    }
+    return count;
+}
+
+int db_keep_subtree_counts(int table_id){
+
+    if (table_id < 1 || table_id > MAX_TABLE_NUMBER || tables.in_use[table_id] == false){
+        return FAILURE;
+    }
+
+    PageLatch & root_latch = tables.root_latch[table_id];
+    root_latch.lock();
+
+    // Nodes written without counts can't be given them in place
+    int result = FAILURE;
+    if (read_root_page_num(table_id) == NO_ROOT_NODE){
+        SystemOp op(LogType::INSERT);
+        buffer_set_subtree_counts(table_id);
+        result = SUCCESS;
+    }
+
+    root_latch.unlock();
+    return result;
+}
+
+int db_rank(int table_id, keyval_t key, uint64_t * rank){
+
+    if (table_id < 1 || table_id > MAX_TABLE_NUMBER || tables.in_use[table_id] == false
+        || !has_subtree_counts(table_id)){
+        return FAILURE;
+    }
+
+    PageLatch & root_latch = tables.root_latch[table_id];
+    root_latch.lock_shared();
+    *rank = count_keys_below(table_id, key, false);
+    root_latch.unlock_shared();
+    return SUCCESS;
+}
+
+int db_select(int table_id, uint64_t rank, keyval_t * key, char * ret_val){
+
+    if (table_id < 1 || table_id > MAX_TABLE_NUMBER || tables.in_use[table_id] == false
+        || !has_subtree_counts(table_id)){
+        return FAILURE;
+    }
+
+    PageLatch & root_latch = tables.root_latch[table_id];
+    root_latch.lock_shared();
+
+    int result = FAILURE;
+    Pagenum_t page_num = read_root_page_num(table_id);
+
+    // Skip the subtrees left of the one holding the record at rank, counting rank down
+    while (page_num != NO_ROOT_NODE){
+        BufferBlock_t * frame = buffer_read_page(table_id, page_num);
+        frame->latch.lock_shared();
+        NodePage_t & node = PAGE_CONTENTS(frame);
+        page_num = NO_ROOT_NODE;
+
+        if (node.is_leaf){
+            if (rank < (uint64_t)node.num_key){
+                *key = node.lf_record[rank].key;
+                if (ret_val != NULL)
+                    strcpy(ret_val, node.lf_record[rank].value);
+                result = SUCCESS;
+            }
+        }
+        else {
+            for (int i = 0; i <= node.num_key; i++){
+                if (rank < SUBTREE_COUNT(node, i)){
+                    page_num = INTERNAL_VAL(node, i);
+                    break;
+                }
+                rank -= SUBTREE_COUNT(node, i);
+            }
+        }
+        unlatch(frame, false);
+    }
+
+    root_latch.unlock_shared();
+    return result;
+}
+
 // Find the record containing input ‘key’.
 // If found matching ‘key’, store matched ‘value’ string in ret_val and return 0. Otherwise, return non-zero value.
 // Memory allocation for record structure(ret_val) should occur in caller function.
@@ -33,23 +675,19 @@ int db_find (int table_id, keyval_t key, char * ret_val){
         return FAILURE;
     }
 
-    BufferBlock_t * header_frame, * node_page_frame;
-    HeaderPage_t header;
-
-    header_frame = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
-    header = header_frame->frame.header_page;
+    // Most absent keys end here, without a descent
+    if (!bloom_may_contain(table_id, key)){
+        return FAILURE;
+    }
 
     int i = 0, result;
-    Pagenum_t page_num = find_leaf( table_id, header.root_page_num, key, false );
-    NodePage_t node_page;
-    Record_t new_record;
+    BufferBlock_t * node_page_frame = find_leaf_frame(table_id, key, false);
 
-    if (page_num == KEY_DO_NOT_EXISTS){
+    if (node_page_frame == nullptr){
         return FAILURE;
     }
 
-    node_page_frame = buffer_read_page(table_id, page_num);
-    node_page = PAGE_CONTENTS(node_page_frame);
+    NodePage_t & node_page = PAGE_CONTENTS(node_page_frame);
 
     for (i = 0; i < node_page.num_key; i++)
         if (node_page.lf_record[i].key == key) break;
@@ -61,7 +699,7 @@ int db_find (int table_id, keyval_t key, char * ret_val){
         result = SUCCESS;
     }
 
-    buffer_unpin_page(header_frame, 1);
+    node_page_frame->latch.unlock_shared();
     buffer_unpin_page(node_page_frame, 1);
 
     return result;
@@ -105,12 +743,10 @@ Pagenum_t dequeue( void ) {
 
 void print_tree( int table_id) {
 
-    NodePage_t node, parent;
-    Pagenum_t temp;
+    NodePage_t node;
+    Pagenum_t temp, next_level = NO_ROOT_NODE;
     int i = 0;
-    int rank = 0;
-    int new_rank = 0;
-    BufferBlock_t * node_frame, * parent_frame;
+    BufferBlock_t * node_frame;
     BufferBlock_t * header_frame = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
     HeaderPage_t header = header_frame->frame.header_page;
     Pagenum_t root_page_num = header.root_page_num;
@@ -128,20 +764,13 @@ void print_tree( int table_id) {
         node_frame = buffer_read_page(table_id, temp);
         node = PAGE_CONTENTS(node_frame);
 
-        if (node.parent_page_num != NO_PARENT) {
-
-            parent_frame = buffer_read_page(table_id, node.parent_page_num);
-            parent = PAGE_CONTENTS(parent_frame);
-            
-            if(temp == parent.extra_page_num){
-                new_rank = path_to_root( table_id, root_page_num, temp );
-                if (new_rank != rank) {
-                    rank = new_rank;
-                    printf("\n");
-                }
-            }
-            
-            buffer_unpin_page(parent_frame, 1);
+        // The first child of the first node of a level starts the next level
+        if (temp == next_level) {
+            next_level = NO_ROOT_NODE;
+            printf("\n");
+        }
+        if (!node.is_leaf && next_level == NO_ROOT_NODE) {
+            next_level = node.extra_page_num;
         }
         printf("[%ld] ", temp);
         for (i = 0; i < node.num_key; i++) {
@@ -210,6 +839,146 @@ void print_leaves(int table_id){
     return;
 }
 
+// State carried from leaf to leaf while checking a tree in key order
+struct TreeCheck{
+    int table_id;
+    Pagenum_t num_page;
+
+    // order of the internal nodes, and whether they keep subtree counts
+    int in_order;
+    bool counted;
+
+    int leaf_depth;
+
+    // right link of the last node checked on each level
+    vector<Pagenum_t> next_page;
+
+    bool has_key;
+    keyval_t last_key;
+};
+
+static int tree_violation(int table_id, Pagenum_t page_num, const char * message){
+    printf("Invalid tree (table %d, page %ld): %s\n", table_id, page_num, message);
+    return FAILURE;
+}
+
+// Check the subtree at page_num, whose keys must lie in [lower, upper),
+// storing the number of records in it in num_records
+static int check_node(TreeCheck & check, Pagenum_t page_num, int depth,
+    bool has_lower, keyval_t lower, bool has_upper, keyval_t upper, uint64_t * num_records){
+
+    int i;
+    NodePage_t node;
+    BufferBlock_t * node_frame;
+
+    if (page_num == HEADER_PAGE_NUMBER || page_num >= check.num_page){
+        return tree_violation(check.table_id, page_num, "page number out of the file");
+    }
+
+    node_frame = buffer_read_page(check.table_id, page_num);
+    node = PAGE_CONTENTS(node_frame);
+    buffer_unpin_page(node_frame, 1);
+
+    // The parent page number is only a hint, which B-link splits leave behind
+    if (node.split_pending){
+        return tree_violation(check.table_id, page_num, "split not finished");
+    }
+
+    int max_keys = node.is_leaf ? lf_order - 1 : check.in_order - 1;
+    if (node.num_key < 1 || node.num_key > max_keys){
+        return tree_violation(check.table_id, page_num, "number of keys out of range");
+    }
+
+    for (i = 0; i < node.num_key; i++){
+        keyval_t key = node.is_leaf ? node.lf_record[i].key : node.in_record[i].key;
+
+        if ((has_lower && key < lower) || (has_upper && key >= upper)){
+            return tree_violation(check.table_id, page_num, "key out of the range of its parent");
+        }
+        if (node.is_leaf && check.has_key && key <= check.last_key){
+            return tree_violation(check.table_id, page_num, "keys are not in ascending order");
+        }
+        if (!node.is_leaf && i > 0 && key <= node.in_record[i - 1].key){
+            return tree_violation(check.table_id, page_num, "keys are not in ascending order");
+        }
+
+        if (node.is_leaf){
+            check.has_key = true;
+            check.last_key = key;
+        }
+    }
+
+    if (node.is_leaf){
+        if (check.leaf_depth < 0){
+            check.leaf_depth = depth;
+        }
+        else if (check.leaf_depth != depth){
+            return tree_violation(check.table_id, page_num, "leaves are not at the same depth");
+        }
+    }
+
+    // The high key and the right link follow the bounds the parent gives
+    Pagenum_t link = right_link(node);
+
+    if (check.next_page.size() <= (size_t)depth){
+        check.next_page.resize(depth + 1, 0);
+    }
+    if (check.next_page[depth] != 0 && check.next_page[depth] != page_num){
+        return tree_violation(check.table_id, page_num, "broken right link");
+    }
+    if (has_upper ? link == 0 || node.high_key != upper : link != 0){
+        return tree_violation(check.table_id, page_num, "high key does not match the parent");
+    }
+    check.next_page[depth] = link;
+
+    if (node.is_leaf){
+        *num_records = node.num_key;
+        return SUCCESS;
+    }
+
+    *num_records = 0;
+    for (i = 0; i <= node.num_key; i++){
+        uint64_t child_records;
+
+        bool child_has_lower = i > 0 ? true : has_lower;
+        keyval_t child_lower = i > 0 ? node.in_record[i - 1].key : lower;
+        bool child_has_upper = i < node.num_key ? true : has_upper;
+        keyval_t child_upper = i < node.num_key ? node.in_record[i].key : upper;
+
+        if (check_node(check, INTERNAL_VAL(node, i), depth + 1,
+            child_has_lower, child_lower, child_has_upper, child_upper, &child_records) != SUCCESS){
+            return FAILURE;
+        }
+        if (check.counted && SUBTREE_COUNT(node, i) != child_records){
+            return tree_violation(check.table_id, page_num, "subtree count does not match the child");
+        }
+        *num_records += child_records;
+    }
+
+    return SUCCESS;
+}
+
+int check_tree(int table_id){
+
+    if (table_id < 1 || table_id > MAX_TABLE_NUMBER || tables.in_use[table_id] == false){
+        return FAILURE;
+    }
+
+    BufferBlock_t * header_frame = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
+    HeaderPage_t header = header_frame->frame.header_page;
+    buffer_unpin_page(header_frame, 1);
+
+    if (header.root_page_num == NO_ROOT_NODE){
+        return SUCCESS;
+    }
+
+    bool counted = header.subtree_counts != 0;
+    TreeCheck check = {table_id, header.num_page, counted ? COUNTED_INTERNAL_ORDER : in_order, counted, -1, {}, false, 0};
+    uint64_t num_records;
+
+    return check_node(check, header.root_page_num, 0, false, 0, false, 0, &num_records);
+}
+
 /* Utility function to give the height
  * of the tree, which length in number of edges
  * of the path from the root to any leaf.
@@ -268,48 +1037,22 @@ int path_to_root( int table_id, Pagenum_t root_page_num, Pagenum_t child_page_nu
  * Returns the leaf containing the given key.
  */
 Pagenum_t find_leaf( int table_id, Pagenum_t root_page_num, keyval_t key, bool verbose ) {
-    // printf("find_leaf called.\n");
-    int i = 0;
-    NodePage_t node_page;
-    Pagenum_t page_num = root_page_num;
-    
+
     if (root_page_num == NO_ROOT_NODE) {
         if (verbose) 
             printf("Empty tree.\n");
         return KEY_DO_NOT_EXISTS;
     }
-    
-    BufferBlock_t * node_page_frame = buffer_read_page(table_id, page_num);
-    // LINE(286) buffer_print_all();
-    node_page = PAGE_CONTENTS(node_page_frame);
-    while (!node_page.is_leaf) {
-
-        if (verbose) {
-            printf("[");
-            for (i = 0; i < node_page.num_key - 1; i++)
-                printf("%ld ", node_page.in_record[i].key);
-            printf("%ld] ", node_page.in_record[i].key);
-        }
-        i = 0;
-        while (i < node_page.num_key) {
-            if (key >= node_page.in_record[i].key){
-                i++;
-            }
-            else break;
-        }
-        
-        if (verbose)
-            printf("%d ->\n", i);
 
-        page_num = INTERNAL_VAL(node_page, i);
-
-        buffer_unpin_page(node_page_frame, 1);
-        node_page_frame = buffer_read_page(table_id, page_num);
-        node_page = PAGE_CONTENTS(node_page_frame);               
-    }   
+    // The path is printed only from a stable tree
+    BufferBlock_t * node_page_frame = verbose ? descend_shared(table_id, key, LeafLatch::NONE, verbose, &root_page_num)
+        : descend_leaf(table_id, key, LeafLatch::NONE, &root_page_num);
+    if (node_page_frame == nullptr) {
+        return KEY_DO_NOT_EXISTS;
+    }
 
+    Pagenum_t page_num = node_page_frame->page_num;
     buffer_unpin_page(node_page_frame, 1);
-    // LINE(315) buffer_print_all();
     return page_num;
 }
 
@@ -318,22 +1061,20 @@ Pagenum_t find_leaf( int table_id, Pagenum_t root_page_num, keyval_t key, bool v
  * a key refers.
  */
 Record_t find( int table_id, Pagenum_t root_page_num, keyval_t key, bool verbose ) {
-    // printf("find() called.\n");
+
     int i = 0;
-    
-    Pagenum_t page_num = find_leaf( table_id, root_page_num, key, verbose );
-    //printf("// LINE #326: "); buffer_print_all();
-    NodePage_t node_page;
     Record_t new_record;
-    if (page_num == KEY_DO_NOT_EXISTS){
+
+    BufferBlock_t * node_page_frame = root_page_num == NO_ROOT_NODE ? nullptr
+        : verbose ? descend_shared(table_id, key, LeafLatch::SHARED, verbose, &root_page_num)
+        : find_leaf_frame(table_id, key, false);
+
+    if (node_page_frame == nullptr){
         new_record.is_null = true;
         return new_record;
     }
 
-    BufferBlock_t * node_page_frame = buffer_read_page(table_id, page_num);
-    // LINE(337) buffer_print_all();
-
-    node_page = PAGE_CONTENTS(node_page_frame);
+    NodePage_t & node_page = PAGE_CONTENTS(node_page_frame);
     for (i = 0; i < node_page.num_key; i++)
         if (node_page.lf_record[i].key == key) break;
     if (i == node_page.num_key) {
@@ -343,8 +1084,7 @@ Record_t find( int table_id, Pagenum_t root_page_num, keyval_t key, bool verbose
         new_record.is_null = false;
         strcpy(new_record.value, node_page.lf_record[i].value);
     }
-    buffer_unpin_page(node_page_frame, 1);
-    // LINE(338) buffer_print_all();
+    unlatch(node_page_frame, false);
     return new_record;
 }
 
@@ -1,8 +1,44 @@
 #include <buffer.hpp>
+#include <bloom.hpp>
 
 TableInfo_t tables;
 Buffer *buffer;
 
+PageLatch::PageLatch() : version(0) {}
+
+void PageLatch::lock(){
+    latch.lock();
+    version.fetch_add(1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void PageLatch::unlock(){
+    version.fetch_add(1, memory_order_release);
+    latch.unlock();
+}
+
+void PageLatch::lock_shared(){
+    latch.lock_shared();
+}
+
+void PageLatch::unlock_shared(){
+    latch.unlock_shared();
+}
+
+bool PageLatch::read_begin(uint64_t * version){
+    *version = this->version.load(memory_order_acquire);
+    return (*version & 1) == 0;
+}
+
+bool PageLatch::validate(uint64_t version){
+    atomic_thread_fence(memory_order_acquire);
+    return this->version.load(memory_order_relaxed) == version;
+}
+
+uint64_t PageLatch::get_version(){
+    return version.load(memory_order_acquire);
+}
+
 size_t PIDHasher::operator()(const pair<int, Pagenum_t> & pInfo) const{
     return (hash<int>()(pInfo.first) >> 1) ^ (hash<uint64_t>()(pInfo.second) << 1);
 }
@@ -17,6 +53,8 @@ Buffer::~Buffer() {
 
 BufferBlock_t& Buffer::read_page(const int table_id, const Pagenum_t page_num){
 
+    lock_guard<recursive_mutex> guard(latch);
+
     BufferBlock_t * temp = pool, * empty = nullptr, * victim = nullptr;
 
     if (table_id < 1 || table_id > MAX_TABLE_NUMBER){
@@ -42,7 +80,8 @@ BufferBlock_t& Buffer::read_page(const int table_id, const Pagenum_t page_num){
             while(1){}
         }
         // If current buffer block is not in use, store its pointer
-        if(empty == nullptr && temp->table_id == 0){
+        // (a freed page may still be pinned by the operation that freed it)
+        if(empty == nullptr && temp->table_id == 0 && temp->pin_count == 0){
             empty = temp;
         }
 
@@ -72,6 +111,7 @@ BufferBlock_t& Buffer::read_page(const int table_id, const Pagenum_t page_num){
         }
 
         // Clean the content of the buffer frame
+        remove_lookup(victim->table_id, victim->page_num);
         victim->clear();
         empty = victim;
     }
@@ -90,51 +130,160 @@ BufferBlock_t& Buffer::read_page(const int table_id, const Pagenum_t page_num){
 }
 
 BufferBlock_t& Buffer::write_page(BufferBlock_t &frame, const Page_t &page){
+
+    lock_guard<mutex> guard(frame.content_latch);
+
+    lsn_t lsn = log_page_write(frame.table_id, frame.page_num, &frame.frame, &page);
+
     frame.frame = page;
+    if (lsn != NO_LSN){
+        set_page_lsn(frame.page_num, &frame.frame, lsn);
+    }
+
+    // Covers redo and undo of the header as well as db_keep_subtree_counts
+    if (frame.page_num == HEADER_PAGE_NUMBER){
+        tables.subtree_counts[frame.table_id] = page.header_page.subtree_counts != 0;
+    }
+
+    if (!frame.is_dirty){
+        frame.rec_lsn = get_page_lsn(frame.page_num, &frame.frame);
+    }
     frame.is_dirty = true;
     frame.pin_page();
-    
 
-
-    
     return frame;
 }
 
 BufferBlock_t& Buffer::allocate_page(const int table_id){
 
+    lock_guard<recursive_mutex> guard(latch);
+
+    // Concurrent operations share the header page, so undoing an allocation would undo
+    // theirs too. If the operation that needed the page is rolled back, the page leaks.
+    SystemOp op(LogType::ALLOCATE);
+
     BufferBlock_t& header_frame = Buffer::read_page(table_id, HEADER_PAGE_NUMBER);
-    
-    Pagenum_t page_num = file_alloc_page(&header_frame.frame.header_page, tables.fd[table_id]);
-    header_frame.is_dirty = true;
-    header_frame.unpin_page(1);
+    Page_t header = header_frame.frame;
+
+    Pagenum_t page_num = file_alloc_page(&header.header_page, tables.fd[table_id]);
+    write_page(header_frame, header);
+    header_frame.unpin_page(2);
     
     BufferBlock_t& temp = Buffer::read_page(table_id, page_num);
     
-    NodePage_t node;
+    Page_t node = temp.frame;
 
-    node.parent_page_num = 0;
-    node.num_key = 0;
-    node.extra_page_num = 0;
+    node.node_page.parent_page_num = 0;
+    node.node_page.num_key = 0;
+    node.node_page.extra_page_num = 0;
 
-    temp.frame.node_page = node;
+    write_page(temp, node);
+    temp.unpin_page(1);
     
     return temp;
 }
 
 void Buffer::free_page(BufferBlock_t& frame){
+
+    lock_guard<recursive_mutex> guard(latch);
+
+    SystemOp op(LogType::FREE);
     
     BufferBlock_t& header_frame = Buffer::read_page(frame.table_id, HEADER_PAGE_NUMBER);
+    Page_t header = header_frame.frame, free_page;
 
-    file_free_page(frame.page_num, &header_frame.frame.header_page, tables.fd[frame.table_id]);
+    if (frame.page_num == HEADER_PAGE_NUMBER || frame.page_num >= header.header_page.num_page){
+        printf("Error: It is not allowed to free header page or non existing page!\n");
+        header_frame.unpin_page(1);
+        return;
+    }
+
+    // Turn the frame into a free page in front of the free page list
+    // [header - old_free_page_num]  ->  [header - new_free_page_num - old_free_page_num]
+    // The free page is written through the log and flushed before it leaves the buffer,
+    // because the next allocation reads it back from the disk
+    memset(&free_page, 0, sizeof(free_page));
+    free_page.free_page.next_free_page_num = header.header_page.free_page_num;
+    write_page(frame, free_page);
+    frame.flush();
+    frame.unpin_page(1);
+
+    header.header_page.free_page_num = frame.page_num;
+    write_page(header_frame, header);
+
+    // The frame keeps the pins of its users, so that it isn't reused before they let it go
+    int pin_count = frame.pin_count;
     remove_lookup(frame.table_id, frame.page_num);
     frame.clear();
+    frame.pin_count = pin_count;
 
-    header_frame.is_dirty = true;
-    header_frame.unpin_page(1);
+    header_frame.unpin_page(2);
 
     return;
 }
 
+void Buffer::set_root_page(const int table_id, const Pagenum_t root_page_num){
+
+    lock_guard<recursive_mutex> guard(latch);
+
+    BufferBlock_t& header_frame = Buffer::read_page(table_id, HEADER_PAGE_NUMBER);
+    Page_t header = header_frame.frame;
+
+    header.header_page.root_page_num = root_page_num;
+    write_page(header_frame, header);
+    header_frame.unpin_page(2);
+}
+
+void Buffer::set_subtree_counts(const int table_id){
+
+    lock_guard<recursive_mutex> guard(latch);
+
+    BufferBlock_t& header_frame = Buffer::read_page(table_id, HEADER_PAGE_NUMBER);
+    Page_t header = header_frame.frame;
+
+    header.header_page.subtree_counts = 1;
+    write_page(header_frame, header);
+    header_frame.unpin_page(2);
+}
+
+void Buffer::flush_page(BufferBlock_t& frame){
+    lock_guard<recursive_mutex> guard(latch);
+    frame.flush();
+}
+
+int Buffer::clean_pages(lsn_t lsn){
+
+    lock_guard<recursive_mutex> guard(latch);
+
+    BufferBlock_t * temp;
+    lsn_t rec_lsn;
+    int count = 0;
+
+    for (temp = pool; temp != nullptr; temp = temp->next){
+        if (temp->table_id != 0 && temp->dirty_since(&rec_lsn) && rec_lsn < lsn){
+            temp->flush();
+            count++;
+        }
+    }
+
+    return count;
+}
+
+void Buffer::get_dirty_pages(vector<DirtyPage_t> & dirty_pages){
+
+    lock_guard<recursive_mutex> guard(latch);
+
+    BufferBlock_t * temp;
+    lsn_t rec_lsn;
+
+    dirty_pages.clear();
+    for (temp = pool; temp != nullptr; temp = temp->next){
+        if (temp->table_id != 0 && temp->dirty_since(&rec_lsn)){
+            dirty_pages.push_back({temp->table_id, temp->page_num, rec_lsn});
+        }
+    }
+}
+
 int Buffer::init(int num_buf){
 
     BufferBlock_t * temp = nullptr;
@@ -168,12 +317,14 @@ int Buffer::init(int num_buf){
 }
 
 void Buffer::add_lookup(const int table_id, const Pagenum_t page_num, BufferBlock_t * frame){
+    lock_guard<recursive_mutex> guard(latch);
     pair<int, Pagenum_t> PID = make_pair(table_id, page_num);
 
     lookup.insert(make_pair(PID, frame));
 }
 
 void Buffer::remove_lookup(const int table_id, const Pagenum_t page_num){
+    lock_guard<recursive_mutex> guard(latch);
     pair<int, Pagenum_t> PID = make_pair(table_id, page_num);
 
     if(lookup.find(PID) != lookup.end()){
@@ -183,6 +334,8 @@ void Buffer::remove_lookup(const int table_id, const Pagenum_t page_num){
 
 void Buffer::clear_pages(int table_id){
 
+    lock_guard<recursive_mutex> guard(latch);
+
     BufferBlock_t * temp = pool;
 
     if(table_id < 1 || table_id > MAX_TABLE_NUMBER){
@@ -246,12 +399,12 @@ void Buffer::print_lookup(){
     }
 }
 
-BufferBlock_t::BufferBlock_t() : table_id(0), page_num(0), is_dirty(false), pin_count(0) {
+BufferBlock_t::BufferBlock_t() : table_id(0), page_num(0), is_dirty(false), rec_lsn(NO_LSN), pin_count(0) {
     prev = next = nullptr;
 }
 
 BufferBlock_t::BufferBlock_t(Page_t page, int tid, Pagenum_t pid, bool dirty)
-    : table_id(tid), page_num(pid), is_dirty(dirty), pin_count(0) {
+    : table_id(tid), page_num(pid), is_dirty(dirty), rec_lsn(NO_LSN), pin_count(0) {
     frame = page;
     prev = next = nullptr;
 }
@@ -305,7 +458,32 @@ void BufferBlock_t::clear(){
 }
 
 void BufferBlock_t::flush(){
-    file_write_page(page_num, PAGE_ADDRESS(frame), tables.fd[table_id]);
+
+    Page_t page;
+
+    // Take a copy, so that writers are not blocked during the I/O
+    unique_lock<mutex> guard(content_latch);
+    if (!is_dirty){
+        return;
+    }
+    page = frame;
+    is_dirty = false;
+    guard.unlock();
+
+    // Write-ahead rule: the log must be durable up to the page LSN before the page.
+    // The page can be neither written nor dropped if the log is not, so give up.
+    // Once the log has failed, the page may also hold changes it refused to log.
+    if (log_manager != nullptr && (log_manager->has_failed() || log_manager->flush(get_page_lsn(page_num, &page)) != SUCCESS)){
+        cerr << "Error detected: the log is not durable, page " << page_num << " can't be written!" << endl;
+        exit(1);
+    }
+    file_write_page(page_num, &page, tables.fd[table_id]);
+}
+
+bool BufferBlock_t::dirty_since(lsn_t * rec_lsn){
+    lock_guard<mutex> guard(content_latch);
+    *rec_lsn = this->rec_lsn;
+    return is_dirty;
 }
 
 // Print some information about the frame in buffer
@@ -321,7 +499,7 @@ void BufferBlock_t::print(){
         if (this->is_dirty) printf("Is dirty: true\n");
         else printf("Is dirty: false\n");
 
-        printf("Pin count: %d\n", this->pin_count);
+        printf("Pin count: %d\n", this->pin_count.load());
         printf("In-this page info:\n");
         if(this->page_num == HEADER_PAGE_NUMBER){
             print_header_page(this->frame.header_page);
@@ -351,6 +529,10 @@ int open_table (char * pathname){
     if(!pathname || pathname[0] == 0 || tables.num_table == (MAX_TABLE_NUMBER))
         return FAILURE;
 
+    // Recovery could not tell which file the records of the table refer to
+    if (log_failed())
+        return FAILURE;
+
     result = file_open_if_exist(pathname, &fd);
 
     if(fd == -1) return FAILURE;
@@ -358,11 +540,17 @@ int open_table (char * pathname){
     // When the file in pathname is not available
     // Create a new file and initialize the header file
     if(!result){
+        memset(&header, 0, sizeof(header));
         header.free_page_num = 0;
         header.root_page_num = NO_ROOT_NODE;
         header.num_page = 1;
         file_write_page(HEADER_PAGE_NUMBER, (Page_t *)&header, fd);
     }
+    else {
+        file_read_page(HEADER_PAGE_NUMBER, (Page_t *)&header, fd);
+    }
+
+    lock_guard<mutex> guard(tables.latch);
 
     for (i = 1; i <= MAX_TABLE_NUMBER; ++i){
 
@@ -390,10 +578,15 @@ int open_table (char * pathname){
     }
 
     tables.fd[empty_id] = fd;
+    tables.subtree_counts[empty_id] = header.subtree_counts != 0;
     tables.in_use[empty_id] = true;
     strncpy(tables.pathname[empty_id], pathname, 511);
     tables.num_table++;
-    
+
+    bloom_open_table(empty_id, tables.pathname[empty_id], fd);
+
+    tables.open_lsn[empty_id] = log_table_open(empty_id, tables.pathname[empty_id]);
+
     return empty_id;
 }
 
@@ -405,6 +598,9 @@ int close_table(int table_id){
     }
 
     buffer->clear_pages(table_id);
+    bloom_close_table(table_id);
+
+    lock_guard<mutex> guard(tables.latch);
 
     close(tables.fd[table_id]);
     //printf("file closed.\n");
@@ -430,13 +626,24 @@ BufferBlock_t * buffer_read_page(int table_id, Pagenum_t page_num){
 
 // Write page to buffer
 // This makes frame dirty and increases pin count by 1
+// The change is logged under the log owner of the calling thread and the page LSN is stamped
 void buffer_write_page(BufferBlock_t * frame, Page_t page){
     buffer->write_page(*frame, page);
 }
 
 // Flush all data of frame into coresponding disk page 
 void buffer_flush_page(BufferBlock_t * frame){
-    frame->flush();
+    buffer->flush_page(*frame);
+}
+
+// Change the root page number in the header page
+void buffer_set_root_page(int table_id, Pagenum_t root_page_num){
+    buffer->set_root_page(table_id, root_page_num);
+}
+
+// Mark the header page as that of a table keeping subtree counts
+void buffer_set_subtree_counts(int table_id){
+    buffer->set_subtree_counts(table_id);
 }
 
 // Allocate new page from disk and stage it on a buffer frame
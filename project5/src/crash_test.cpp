@@ -0,0 +1,272 @@
+#include "transaction.hpp"
+
+#include <getopt.h>
+#include <random>
+#include <sys/wait.h>
+
+/*
+ * Crash test of the recovery
+ *
+ * Every round forks a child that opens the table, arms the crash point of
+ * the log manager at a random number of records and runs a stream of inserts
+ * and deletes on random keys: a key the table has is deleted, any other key
+ * is inserted with the number of the operation as its value. Every so often
+ * the child forces the log and tells the parent how many operations are
+ * durable. The child dies at the crash point, or exits without closing
+ * anything once its operations run out.
+ *
+ * The parent then recovers the database and checks it: check_tree must pass,
+ * and since a single thread ran the operations, the table must hold exactly
+ * what some prefix of them left, no shorter than the durable one. The table
+ * and log are kept, so each round recovers on top of the previous ones.
+ */
+
+#define CRASH_TEST_VALUE_FORMAT "%ld"
+
+struct CrashTestConfig{
+    int num_rounds;
+    int ops_per_round;
+    int sync_interval;
+    keyval_t num_keys;
+    uint64_t max_crash_point;
+    int num_buf;
+    unsigned int seed;
+    const char * table_path;
+    const char * log_path;
+};
+
+// Value of the i-th operation (from 1) of a round, unique over the whole run
+static long op_stamp(const CrashTestConfig & config, int round, int i){
+    return (long)round * config.ops_per_round + i;
+}
+
+// Body of the child: run the operations of the round until the crash point
+static void run_child(const CrashTestConfig & config, int round, uint64_t crash_point, int pipe_fd){
+
+    char value[120];
+
+    if (init_db(config.num_buf, config.log_path) != SUCCESS){
+        _exit(2);
+    }
+    int table_id = open_table((char *)config.table_path);
+    if (table_id < 0){
+        _exit(2);
+    }
+
+    log_manager->set_crash_point(crash_point);
+
+    mt19937_64 rng(config.seed + round);
+
+    for (int i = 1; i <= config.ops_per_round; i++){
+        keyval_t key = rng() % config.num_keys;
+
+        if (db_find(table_id, key, value) == SUCCESS){
+            db_delete(table_id, key);
+        }
+        else {
+            sprintf(value, CRASH_TEST_VALUE_FORMAT, op_stamp(config, round, i));
+            db_insert(table_id, key, value);
+        }
+
+        if (i % config.sync_interval == 0 || i == config.ops_per_round){
+            if (log_manager->flush(log_manager->get_next_lsn() - 1) != SUCCESS
+                || write(pipe_fd, &i, sizeof(i)) != sizeof(i)){
+                _exit(2);
+            }
+        }
+    }
+
+    // Leave without closing the tables: the buffer is never written back
+    _exit(0);
+}
+
+// Recover the database, check it against the operations of the round and move state along
+// Return SUCCESS, or FAILURE after printing what is wrong
+static int verify_round(const CrashTestConfig & config, int round, int num_durable, vector<long> & state){
+
+    char value[120];
+
+    if (init_db(config.num_buf, config.log_path) != SUCCESS){
+        printf("Round %d: unable to recover the database.\n", round);
+        return FAILURE;
+    }
+    int table_id = open_table((char *)config.table_path);
+    if (table_id < 0){
+        printf("Round %d: unable to open %s.\n", round, config.table_path);
+        shutdown_db();
+        return FAILURE;
+    }
+
+    if (check_tree(table_id) != SUCCESS){
+        printf("Round %d: the tree is broken.\n", round);
+        shutdown_db();
+        return FAILURE;
+    }
+
+    // Stamp of every key in the recovered table, -1 if it is absent
+    vector<long> recovered(config.num_keys, -1);
+    for (keyval_t key = 0; key < config.num_keys; key++){
+        if (db_find(table_id, key, value) == SUCCESS){
+            recovered[key] = strtol(value, nullptr, 10);
+        }
+    }
+    shutdown_db();
+
+    // Replay the round on state, counting the keys on which it differs from the table
+    keyval_t num_diffs = 0;
+    for (keyval_t key = 0; key < config.num_keys; key++){
+        if (state[key] != recovered[key]) num_diffs++;
+    }
+
+    mt19937_64 rng(config.seed + round);
+    int num_recovered = -1;
+
+    for (int i = 0; ; i++){
+        if (num_diffs == 0 && i >= num_durable){
+            num_recovered = i;
+            break;
+        }
+        if (i == config.ops_per_round){
+            break;
+        }
+
+        keyval_t key = rng() % config.num_keys;
+        long stamp = state[key] == -1 ? op_stamp(config, round, i + 1) : -1;
+
+        num_diffs -= state[key] != recovered[key];
+        state[key] = stamp;
+        num_diffs += state[key] != recovered[key];
+    }
+
+    if (num_recovered < 0){
+        printf("Round %d: the table matches no prefix of the operations from the %d durable ones.\n", round, num_durable);
+        return FAILURE;
+    }
+
+    printf("Round %d: %d of %d operations recovered (%d durable), tree ok.\n",
+        round, num_recovered, config.ops_per_round, num_durable);
+    return SUCCESS;
+}
+
+static void print_usage(const char * program){
+    printf("Usage: %s [options]\n\n", program);
+    printf("-r, --rounds N       : Number of crashes (default 20).\n");
+    printf("-n, --ops N          : Inserts and deletes run by each child (default 5000).\n");
+    printf("-y, --sync N         : Operations between two log forces of the child (default 500).\n");
+    printf("-k, --keys N         : Keys drawn from [0, N) (default 10000).\n");
+    printf("-c, --crash N        : The child crashes after 1 to N log records (default 12000).\n");
+    printf("-b, --buffer N       : Number of buffer frames, small enough to write pages before the crash (default 64).\n");
+    printf("-s, --seed N         : Seed of the operations and crash points (default 1).\n");
+    printf("-f, --table PATH     : Table file, removed first (default crash_test.db).\n");
+    printf("-l, --log PATH       : Log file, removed first (default crash_test.log).\n");
+    printf("-h, --help           : Print this message.\n");
+}
+
+// Return SUCCESS, or FAILURE after printing what is wrong with the arguments
+static int parse_args(int argc, char ** argv, CrashTestConfig & config){
+
+    static const struct option options[] = {
+        {"rounds", required_argument, nullptr, 'r'},
+        {"ops", required_argument, nullptr, 'n'},
+        {"sync", required_argument, nullptr, 'y'},
+        {"keys", required_argument, nullptr, 'k'},
+        {"crash", required_argument, nullptr, 'c'},
+        {"buffer", required_argument, nullptr, 'b'},
+        {"seed", required_argument, nullptr, 's'},
+        {"table", required_argument, nullptr, 'f'},
+        {"log", required_argument, nullptr, 'l'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:n:y:k:c:b:s:f:l:h", options, nullptr)) != -1){
+        switch (opt){
+        case 'r': config.num_rounds = atoi(optarg); break;
+        case 'n': config.ops_per_round = atoi(optarg); break;
+        case 'y': config.sync_interval = atoi(optarg); break;
+        case 'k': config.num_keys = atol(optarg); break;
+        case 'c': config.max_crash_point = atol(optarg); break;
+        case 'b': config.num_buf = atoi(optarg); break;
+        case 's': config.seed = atoi(optarg); break;
+        case 'f': config.table_path = optarg; break;
+        case 'l': config.log_path = optarg; break;
+        default:
+            print_usage(argv[0]);
+            return FAILURE;
+        }
+    }
+
+    if (config.num_rounds < 1 || config.ops_per_round < 1 || config.sync_interval < 1 || config.num_keys < 1
+        || config.max_crash_point < 1 || config.num_buf < 1){
+        printf("Invalid arguments.\n");
+        print_usage(argv[0]);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+int main(int argc, char ** argv){
+
+    CrashTestConfig config = {20, 5000, 500, 10000, 12000, 64, 1, "crash_test.db", "crash_test.log"};
+
+    if (parse_args(argc, argv, config) != SUCCESS){
+        return 1;
+    }
+
+    unlink(config.table_path);
+    unlink(config.log_path);
+
+    mt19937_64 rng(config.seed);
+    vector<long> state(config.num_keys, -1);
+
+    for (int round = 0; round < config.num_rounds; round++){
+
+        uint64_t crash_point = rng() % config.max_crash_point + 1;
+
+        int fds[2];
+        if (pipe(fds) != 0){
+            printf("Unable to create a pipe.\n");
+            return 1;
+        }
+
+        // Nothing is buffered in stdout for the child to print twice
+        fflush(stdout);
+
+        pid_t child = fork();
+        if (child < 0){
+            printf("Unable to fork.\n");
+            return 1;
+        }
+        if (child == 0){
+            close(fds[0]);
+            run_child(config, round, crash_point, fds[1]);
+        }
+        close(fds[1]);
+
+        // The last count read is the number of operations known to be durable
+        int num_durable = 0, count;
+        while (read(fds[0], &count, sizeof(count)) == sizeof(count)){
+            num_durable = count;
+        }
+        close(fds[0]);
+
+        int status;
+        waitpid(child, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) > 1){
+            printf("Round %d: the child failed.\n", round);
+            return 1;
+        }
+
+        printf("Round %d: child %s record %lu.\n", round,
+            WEXITSTATUS(status) == 1 ? "crashed at" : "finished before", crash_point);
+
+        if (verify_round(config, round, num_durable, state) != SUCCESS){
+            return 1;
+        }
+    }
+
+    printf("All %d rounds recovered.\n", config.num_rounds);
+    return 0;
+}
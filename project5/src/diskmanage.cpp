@@ -4,35 +4,27 @@
 // update information of header page
 Pagenum_t file_alloc_page(HeaderPage_t * header, int fd){
 
-    NodePage_t allocated_page;
-    // file_read_page(HEADER_PAGE_NUMBER, PAGE_ADDRESS(header), fd);
-
     if(header->free_page_num != 0){ // If there is at least one free page in file
 
         // Selecting a page number of a page that will be allocated as a node page
         Pagenum_t page_num = header->free_page_num;
         
         // Read the free page to get next free page number that should be connected to header page structure variable
-        // And update data of header page in  file on the disk
+        // The free page itself is left untouched on the disk, so that its page LSN stays valid
+        // until the caller overwrites it through the buffer
         FreePage_t free_page;
         file_read_page(page_num, (Page_t *)&free_page, fd);
 
         header->free_page_num = free_page.next_free_page_num;
-        // file_write_page(HEADER_PAGE_NUMBER, PAGE_ADDRESS(header), fd);
-
-        // Create a new node page structure variable and write it on the disk
-        file_write_page(page_num, (Page_t *)&allocated_page, fd);
 
         return page_num;
     }
     else{ // If there isn't any free page left
 
         // Array of new pages to be written on the file
+        // Zero-filled so that every new page starts with page LSN 0
         Page_t new_pages[DEFAULT_NEW_PAGE_COUNT];
-
-        // Create new node page and allocate
-        NodePage_t new_node_page;
-        new_pages[0] = PAGE_T(new_node_page);
+        memset(new_pages, 0, sizeof(new_pages));
 
         Pagenum_t new_page_num = header->num_page;
 
@@ -41,10 +33,11 @@ Pagenum_t file_alloc_page(HeaderPage_t * header, int fd){
             ((FreePage_t *)(new_pages + i))->next_free_page_num = new_page_num + i + 1;
         ((FreePage_t *)(new_pages + DEFAULT_NEW_PAGE_COUNT - 1))->next_free_page_num = NO_MORE_FREE_PAGE;
 
-        // Update information to the header and file
+        // Update information to the header
+        // The new pages are synced before the header change can be logged,
+        // so a durable header never points at pages missing from the file
         header->free_page_num = new_page_num + 1;
         header->num_page = header->num_page + DEFAULT_NEW_PAGE_COUNT;
-        // file_write_page(HEADER_PAGE_NUMBER, (Page_t *)&header, fd);
 
         file_write_multi_pages(new_page_num, new_pages, DEFAULT_NEW_PAGE_COUNT, fd);
 
@@ -57,6 +50,7 @@ void file_free_page(Pagenum_t pagenum, HeaderPage_t * header, int fd){
 
     if(pagenum > 0 && pagenum < header->num_page){
         FreePage_t free_page;
+        memset(&free_page, 0, sizeof(free_page));
 
         // Adding new free page in front of the free page list
         // [header - old_free_page_num]  ->  [header - new_free_page_num - old_free_page_num]
@@ -77,9 +71,10 @@ void file_read_page(Pagenum_t pagenum, Page_t* dest, int fd){
 }
 
 // Write an in-memory page(src) to the on-disk page
+// Durability of a single page write comes from the write-ahead log,
+// so the page is not synced here
 void file_write_page(Pagenum_t pagenum, const Page_t* src, int fd){
     pwrite(fd, src, PAGE_SIZE, PAGE_OFFSET(pagenum));
-    fdatasync(fd);
 }
 
 // Write some multiple pages stored in an array into the file
@@ -88,6 +83,24 @@ void file_write_multi_pages(Pagenum_t pagenum, const Page_t* src, const int num_
     fdatasync(fd);
 }
 
+// Get the LSN stamped on a page
+lsn_t get_page_lsn(Pagenum_t pagenum, const Page_t * page){
+    if (pagenum == HEADER_PAGE_NUMBER){
+        return page->header_page.page_lsn;
+    }
+    return page->node_page.page_lsn;
+}
+
+// Stamp the LSN on a page
+void set_page_lsn(Pagenum_t pagenum, Page_t * page, lsn_t lsn){
+    if (pagenum == HEADER_PAGE_NUMBER){
+        page->header_page.page_lsn = lsn;
+    }
+    else{
+        page->node_page.page_lsn = lsn;
+    }
+}
+
 // If the file exists in given pathname, open it in fd and return 1
 // If the file doesn't exist or has error, create a new file and return 0
 int file_open_if_exist(const char * pathname, int * fd){
@@ -120,7 +133,8 @@ void print_header_page(HeaderPage_t header){
     printf("<header page status> ");
     printf("Free page number: %ld / ", header.free_page_num);
     printf("Root page number: %ld / ", header.root_page_num);
-    printf("Number of pages in current file: %ld\n", header.num_page);
+    printf("Number of pages in current file: %ld / ", header.num_page);
+    printf("Page LSN: %ld\n", header.page_lsn);
 }
 
 // Print the information of a single node page
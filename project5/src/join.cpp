@@ -1,147 +1,695 @@
 #include <join.hpp>
+#include <bloom.hpp>
 
-Join::Join(const char * pathname, int left_table_id, int right_table_id) : left(NULL), right(NULL) {
+#include <algorithm>
 
-    output.open(pathname);
-    if (output.fail() || !tables.in_use[left_table_id] || !tables.in_use[right_table_id]){
-        is_valid = false;
+JoinIterator::JoinIterator(int left_table_id, int right_table_id, const JoinOptions & options)
+    : left_table_id(left_table_id), right_table_id(right_table_id), left(NULL), right(NULL),
+      left_idx(0), right_idx(0), left_in_batch(false), right_in_batch(false),
+      lower_bound(INT64_MIN), upper_bound(INT64_MAX), has_upper_bound(false),
+      type(options.type), skip_leaves(options.skip_leaves), matched(false), is_started(false), is_done(false) {
+
+    is_valid = tables.in_use[left_table_id] && tables.in_use[right_table_id];
+}
+
+JoinIterator::~JoinIterator(){
+    finish();
+    release_held();
+}
+
+void JoinIterator::set_range(keyval_t lower, keyval_t upper, bool has_upper){
+    lower_bound = lower;
+    upper_bound = upper;
+    has_upper_bound = has_upper;
+}
+
+void JoinIterator::start(Pagenum_t left_leaf, Pagenum_t right_leaf){
+
+    // An empty side ends the join unless the rows of the other one are kept
+    is_started = true;
+    if (left_leaf != 0){
+        left = buffer_read_page(left_table_id, left_leaf);
     }
-    else {
-        is_valid = true;
+    if (right_leaf != 0){
+        right = buffer_read_page(right_table_id, right_leaf);
     }
+    left_idx = right_idx = 0;
+}
 
-    this->left_table_id = left_table_id;
-    this->right_table_id = right_table_id;
-
+bool JoinIterator::keeps_unmatched(int location){
+    if (location == LEFT){
+        return type == JoinType::ANTI || type == JoinType::LEFT_OUTER || type == JoinType::FULL_OUTER;
+    }
+    return type == JoinType::FULL_OUTER;
 }
 
-Join::~Join(){
+void JoinIterator::release_held(){
 
-    if (left != NULL){
-        buffer_unpin_page(left);
+    for (BufferBlock_t * frame : held){
+        buffer_unpin_page(frame);
     }
+    held.clear();
+}
+
+void JoinIterator::drop_leaf(int location){
+
+    BufferBlock_t *& frame = location == LEFT ? left : right;
+    bool & in_batch = location == LEFT ? left_in_batch : right_in_batch;
 
-    if (right != NULL){
-        buffer_unpin_page(right);
+    if (frame == NULL){
+        return;
     }
 
-    if (output.is_open()){
-        output << endl;
-        output.flush();
-        output.close();
+    // Rows of the batch being filled point into the leaf
+    if (in_batch){
+        held.push_back(frame);
+    }
+    else{
+        buffer_unpin_page(frame);
     }
+    frame = NULL;
+    in_batch = false;
+}
+
+void JoinIterator::finish(){
+    drop_leaf(LEFT);
+    drop_leaf(RIGHT);
+    is_done = true;
 }
 
-void Join::write_line(keyval_t key, int left_idx, int right_idx){
+// First leaf of table_id past leaf that may hold key
+static Pagenum_t seek_next_leaf(int table_id, NodePage_t & leaf, keyval_t key){
 
-    output << key   << COMMA << left->frame.node_page.lf_record[left_idx].value 
-    << COMMA << key << COMMA << right->frame.node_page.lf_record[right_idx].value << endl;
+    Pagenum_t next = leaf.right_page_num;
+    if (next == 0){
+        return 0;
+    }
+
+    // Descend from the root only if the whole next leaf is below the key,
+    // so walking sparse overlaps costs one leaf per gap rather than every leaf in it
+    BufferBlock_t * frame = buffer_read_page(table_id, next);
+    NodePage_t & page = frame->frame.node_page;
+    bool is_below = page.right_page_num != 0 && (page.num_key == 0 || page.lf_record[page.num_key - 1].key < key);
+    buffer_unpin_page(frame);
+
+    if (!is_below){
+        return next;
+    }
+    return find_leaf(table_id, read_root_page_num(table_id), key, false);
 }
 
-void Join::set_block(Pagenum_t page_num, int location){
-    if (location != LEFT && location != RIGHT){
+void JoinIterator::advance(int location){
+
+    BufferBlock_t * frame = location == LEFT ? left : right;
+    BufferBlock_t * other = location == LEFT ? right : left;
+    int other_idx = location == LEFT ? right_idx : left_idx;
+
+    // Leaves without a common key may start a gap in this side,
+    // which ends at the key the other side is waiting at, if it has one left
+    // A side whose unmatched rows are part of the result is never skipped.
+    Pagenum_t next;
+    if (skip_leaves && !matched && other != NULL && other_idx < other->frame.node_page.num_key && !keeps_unmatched(location)){
+        next = seek_next_leaf(location == LEFT ? left_table_id : right_table_id, frame->frame.node_page,
+            other->frame.node_page.lf_record[other_idx].key);
+    }
+    else{
+        next = frame->frame.node_page.right_page_num;
+    }
+
+    drop_leaf(location);
+    matched = false;
+
+    if (next == 0){
         return;
     }
 
     if (location == LEFT){
-        
-        if (left != NULL){
-            buffer_unpin_page(left, 1);
-        }
-        left = buffer_read_page(left_table_id, page_num);
+        left = buffer_read_page(left_table_id, next);
+        left_idx = 0;
+    }
+    else{
+        right = buffer_read_page(right_table_id, next);
+        right_idx = 0;
+    }
+}
+
+int JoinIterator::next_batch(JoinRow * rows, int max_rows){
+
+    release_held();
+
+    if (!is_started){
+        Pagenum_t left_leaf, right_leaf;
+        find_leftmost_page_num(left_table_id, right_table_id, &left_leaf, &right_leaf);
+        start(left_leaf, right_leaf);
     }
 
-    
-    if (location == RIGHT){
-        
-        if (right != NULL){
-            buffer_unpin_page(right, 1);
+    // Semi and anti joins only tell which keys there are
+    bool reads_values = type != JoinType::SEMI && type != JoinType::ANTI;
+
+    int count = 0;
+    while (count < max_rows && !is_done){
+
+        // A side is done once it runs out of leaves or reaches the end of the range
+        if (left != NULL && left_idx == left->frame.node_page.num_key){
+            advance(LEFT);
+            continue;
         }
-        right = buffer_read_page(right_table_id, page_num);
+        if (right != NULL && right_idx == right->frame.node_page.num_key){
+            advance(RIGHT);
+            continue;
+        }
+
+        LeafRecord * left_record = left != NULL ? &left->frame.node_page.lf_record[left_idx] : NULL;
+        LeafRecord * right_record = right != NULL ? &right->frame.node_page.lf_record[right_idx] : NULL;
+
+        if (has_upper_bound && left_record != NULL && left_record->key >= upper_bound){
+            drop_leaf(LEFT);
+            continue;
+        }
+        if (has_upper_bound && right_record != NULL && right_record->key >= upper_bound){
+            drop_leaf(RIGHT);
+            continue;
+        }
+
+        // Without one side, only the unmatched rows of the other one are left
+        if ((left_record == NULL && (right_record == NULL || !keeps_unmatched(RIGHT)))
+            || (right_record == NULL && !keeps_unmatched(LEFT))){
+            finish();
+            break;
+        }
+
+        bool from_left = right_record == NULL || (left_record != NULL && left_record->key <= right_record->key);
+        bool from_right = left_record == NULL || (right_record != NULL && right_record->key <= left_record->key);
+        keyval_t key = from_left ? left_record->key : right_record->key;
+
+        bool is_row;
+        if (from_left && from_right){
+            is_row = type != JoinType::ANTI;
+            matched = true;
+        }
+        else{
+            is_row = keeps_unmatched(from_left ? LEFT : RIGHT);
+        }
+
+        if (is_row && key >= lower_bound){
+            rows[count].key = key;
+            rows[count].left_value = from_left && reads_values ? left_record->value : NULL;
+            rows[count].right_value = from_right && reads_values ? right_record->value : NULL;
+            count++;
+            left_in_batch |= from_left && reads_values;
+            right_in_batch |= from_right && reads_values;
+        }
+
+        if (from_left) left_idx++;
+        if (from_right) right_idx++;
     }
+    return count;
 }
 
-int Join::join_two_blocks(){
+Join::Join(const char * pathname, int left_table_id, int right_table_id, const JoinOptions & options)
+    : output(pathname, options.output_buffer_size, options.output_flags), rows(left_table_id, right_table_id, options),
+      type(options.type) {
 
-    int i, j, left_num_keys, right_num_keys;
-    LeafRecord * left_records, * right_records;
-    
-    left_num_keys = left->frame.node_page.num_key;
-    right_num_keys = right->frame.node_page.num_key;
+    is_valid = output.is_open() && rows.is_valid;
+}
 
-    left_records = left->frame.node_page.lf_record;
-    right_records = right->frame.node_page.lf_record;
+Join::~Join(){
+    close_output();
+}
 
-    i = j = 0;
-    while(i < left_num_keys){
+int Join::close_output(bool terminate){
 
-        while (left_records[i].key != right_records[j].key) {
-            while (left_records[i].key < right_records[j].key) {
-                i++;
-                if (i == left_num_keys){
-                    return LEFT;
-                }
-            }
-            while (left_records[i].key > right_records[j].key) {
-                j++;
-                if (j == right_num_keys){
-                    return RIGHT;
-                }
-            }
+    if (!output.is_open()){
+        return FAILURE;
+    }
+    if (terminate){
+        output.put('\n');
+    }
+    return output.close();
+}
+
+void Join::set_range(keyval_t lower, keyval_t upper, bool has_upper){
+    rows.set_range(lower, upper, has_upper);
+}
+
+void Join::write_row(keyval_t key, const char * left_value, const char * right_value){
+
+    if (type == JoinType::SEMI || type == JoinType::ANTI){
+        output.write_int(key);
+        output.put('\n');
+        return;
+    }
+
+    // A side without the key leaves both of its fields empty
+    if (left_value != NULL){
+        output.write_int(key);
+        output.put(COMMA);
+        output.write_str(left_value, JOIN_VALUE_SIZE);
+    }
+    else{
+        output.put(COMMA);
+    }
+
+    output.put(COMMA);
+    if (right_value != NULL){
+        output.write_int(key);
+        output.put(COMMA);
+        output.write_str(right_value, JOIN_VALUE_SIZE);
+    }
+    else{
+        output.put(COMMA);
+    }
+    output.put('\n');
+}
+
+void Join::proceed(Pagenum_t left_leaf, Pagenum_t right_leaf){
+
+    JoinRow batch[JOIN_BATCH_SIZE];
+    int num_rows;
+
+    rows.start(left_leaf, right_leaf);
+    while ((num_rows = rows.next_batch(batch, JOIN_BATCH_SIZE)) > 0){
+        for (int k = 0; k < num_rows; k++){
+            write_row(batch[k].key, batch[k].left_value, batch[k].right_value);
         }
+    }
+}
 
-        // cout << "Left key: " << left_records[i].key << " / Right Key: " << right_records[j].key << endl;
-        write_line(left_records[i].key, i, j);
-        i++; 
+MultiJoinIterator::MultiJoinIterator(const vector<int> & table_ids, int min_matches, const JoinOptions & options)
+    : num_live(0), min_matches(min_matches), skip_leaves(options.skip_leaves), is_started(false), is_done(false) {
+
+    is_valid = !table_ids.empty() && min_matches >= 1 && min_matches <= (int)table_ids.size();
+    for (int table_id : table_ids){
+        if (!tables.in_use[table_id]){
+            is_valid = false;
+        }
+        cursors.push_back({table_id, NULL, 0, false});
     }
-    return LEFT;
+    current_keys.assign(cursors.size(), INT64_MAX);
 }
 
-Pagenum_t Join::get_next_leaf(int location){
+MultiJoinIterator::~MultiJoinIterator(){
+    finish();
+    release_held();
+}
 
-    if (location == LEFT){
-        return left->frame.node_page.right_page_num;
+void MultiJoinIterator::release_held(){
+
+    for (BufferBlock_t * frame : held){
+        buffer_unpin_page(frame);
     }
-    else if (location == RIGHT){
-        return right->frame.node_page.right_page_num;
+    held.clear();
+}
+
+void MultiJoinIterator::drop_leaf(Cursor & cursor){
+
+    if (cursor.frame == NULL){
+        return;
+    }
+
+    // Rows of the batch being filled point into the leaf
+    if (cursor.in_batch){
+        held.push_back(cursor.frame);
     }
     else{
-        // cout << "뭔가 잘못됨. Join::get_next_leaf 에서 발생" << endl;
-        return FAILURE;
+        buffer_unpin_page(cursor.frame);
     }
+    cursor.frame = NULL;
+    cursor.in_batch = false;
 }
 
-void Join::proceed(Pagenum_t left_leaf, Pagenum_t right_leaf){
+void MultiJoinIterator::finish(){
 
-    while(left_leaf != 0 && right_leaf != 0){
+    for (Cursor & cursor : cursors){
+        drop_leaf(cursor);
+    }
+    is_done = true;
+}
 
-        set_block(left_leaf, LEFT);
-        set_block(right_leaf, RIGHT);
+void MultiJoinIterator::load_leaf(int c, Pagenum_t page_num){
 
-        int result = join_two_blocks();
+    Cursor & cursor = cursors[c];
+    bool was_live = cursor.frame != NULL;
 
-        if (result == LEFT){
-            left_leaf = get_next_leaf(LEFT);
+    drop_leaf(cursor);
+    if (page_num != 0){
+        cursor.frame = buffer_read_page(cursor.table_id, page_num);
+        cursor.idx = 0;
+    }
+    else{
+        current_keys[c] = INT64_MAX;
+        if (was_live) num_live--;
+    }
+}
+
+void MultiJoinIterator::settle(int c){
+
+    Cursor & cursor = cursors[c];
+    while (cursor.frame != NULL && cursor.idx == cursor.frame->frame.node_page.num_key){
+        load_leaf(c, cursor.frame->frame.node_page.right_page_num);
+    }
+    if (cursor.frame != NULL){
+        current_keys[c] = cursor.frame->frame.node_page.lf_record[cursor.idx].key;
+    }
+}
+
+void MultiJoinIterator::seek(int c, keyval_t key){
+
+    Cursor & cursor = cursors[c];
+
+    while (cursor.frame != NULL){
+        NodePage_t & page = cursor.frame->frame.node_page;
+
+        // Leaves entirely below the key are left through the chain, or by a descent past a gap
+        if (page.num_key == 0 || page.lf_record[page.num_key - 1].key < key){
+            load_leaf(c, skip_leaves ? seek_next_leaf(cursor.table_id, page, key) : page.right_page_num);
+            continue;
         }
 
-        if (result == RIGHT){
-            right_leaf = get_next_leaf(RIGHT);
+        LeafRecord * end = page.lf_record + page.num_key;
+        cursor.idx = lower_bound(page.lf_record + cursor.idx, end, key,
+            [](const LeafRecord & r, keyval_t key){ return r.key < key; }) - page.lf_record;
+        break;
+    }
+    settle(c);
+}
+
+int MultiJoinIterator::next_batch(keyval_t * keys, const char ** values, int max_rows){
+
+    release_held();
+
+    int num_cursors = cursors.size();
+
+    if (!is_started){
+        is_started = true;
+        for (int c = 0; c < num_cursors; c++){
+            Pagenum_t leaf = find_leftmost_leaf(cursors[c].table_id);
+            if (leaf != 0){
+                cursors[c].frame = buffer_read_page(cursors[c].table_id, leaf);
+                cursors[c].idx = 0;
+                num_live++;
+                settle(c);
+            }
         }
     }
 
-    buffer_unpin_page(left);
-    buffer_unpin_page(right);
+    int count = 0;
+    while (count < max_rows && !is_done){
 
-    left = right = NULL;
+        if (num_live < min_matches){
+            finish();
+            break;
+        }
+
+        // Done cursors sit at INT64_MAX, so the minimum is a plain loop over the keys
+        keyval_t min_key = current_keys[0];
+        for (int c = 1; c < num_cursors; c++){
+            min_key = current_keys[c] < min_key ? current_keys[c] : min_key;
+        }
+
+        // No key below the min_matches-th smallest current key can be in enough tables
+        if (min_matches > 1){
+            sorted_keys = current_keys;
+            nth_element(sorted_keys.begin(), sorted_keys.begin() + (min_matches - 1), sorted_keys.end());
+            keyval_t target = sorted_keys[min_matches - 1];
+
+            if (target != min_key){
+                for (int c = 0; c < num_cursors; c++){
+                    if (cursors[c].frame != NULL && current_keys[c] < target){
+                        seek(c, target);
+                    }
+                }
+                continue;
+            }
+        }
+
+        int num_equal = 0;
+        for (int c = 0; c < num_cursors; c++){
+            if (cursors[c].frame != NULL && current_keys[c] == min_key) num_equal++;
+        }
+
+        bool is_row = num_equal >= min_matches;
+        if (is_row){
+            keys[count] = min_key;
+        }
+
+        for (int c = 0; c < num_cursors; c++){
+            Cursor & cursor = cursors[c];
+            bool has_key = cursor.frame != NULL && current_keys[c] == min_key;
+
+            if (is_row){
+                values[count * num_cursors + c] = has_key ? cursor.frame->frame.node_page.lf_record[cursor.idx].value : NULL;
+                cursor.in_batch |= has_key;
+            }
+            if (has_key){
+                cursor.idx++;
+                settle(c);
+            }
+        }
+
+        if (is_row){
+            count++;
+        }
+    }
+    return count;
 }
 
 // Do natural join with given two tables and write result table to the file using given pathname.
 // Return 0 if success, otherwise return non-zero value.
 // Two tables should have been opened earlier.
 int join_table(int table_id_1, int table_id_2, char * pathname){
+    return join_table(table_id_1, table_id_2, pathname, JoinOptions());
+}
+
+// Number of pages in the file of table_id, free pages included
+static Pagenum_t count_pages(int table_id){
 
-    bool is_finished = false;
-    Join join(pathname, table_id_1, table_id_2);
+    BufferBlock_t * header = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
+    Pagenum_t num_page = header->frame.header_page.num_page;
+    buffer_unpin_page(header);
+    return num_page;
+}
+
+// Copy every record of table_id, in key order
+static void scan_table(int table_id, vector<LeafRecord> & records){
+
+    Pagenum_t leaf = find_leftmost_leaf(table_id);
+
+    while (leaf != 0){
+        BufferBlock_t * frame = buffer_read_page(table_id, leaf);
+        NodePage_t & page = frame->frame.node_page;
+
+        records.insert(records.end(), page.lf_record, page.lf_record + page.num_key);
+        leaf = page.right_page_num;
+        buffer_unpin_page(frame);
+    }
+}
+
+// Estimate the fraction of the leaves of table_id holding keys from low to high
+// from the children of the root
+static double covered_fraction(int table_id, keyval_t low, keyval_t high){
+
+    Pagenum_t root_page_num = read_root_page_num(table_id);
+    if (root_page_num == NO_ROOT_NODE){
+        return 0;
+    }
+
+    BufferBlock_t * root = buffer_read_page(table_id, root_page_num);
+    NodePage_t & page = root->frame.node_page;
+
+    // Child i holds the keys from the separator before it up to the one after it
+    double fraction = 1;
+    if (!page.is_leaf){
+        int first = 0, last = page.num_key;
+        while (first < page.num_key && page.in_record[first].key <= low) first++;
+        while (last > 0 && page.in_record[last - 1].key > high) last--;
+        fraction = (double)(last - first + 1) / (page.num_key + 1);
+    }
+
+    buffer_unpin_page(root);
+    return fraction;
+}
+
+// Write a row of the build and the probe side in the order of the tables
+static inline void write_probe_row(Join & join, bool build_is_left, keyval_t key, const char * build_value, const char * probe_value){
+    if (build_is_left) join.write_row(key, build_value, probe_value);
+    else join.write_row(key, probe_value, build_value);
+}
+
+// Put the build records in a hash table and probe it with the records of probe_id
+// Only the leaves of probe_id within the keys of the build side are read.
+static void hash_join(Join & join, const vector<LeafRecord> & build, int probe_id, bool build_is_left){
+
+    unordered_map<keyval_t, const char *> hash_table(build.size() * 2);
+    for (const LeafRecord & record : build){
+        hash_table.emplace(record.key, record.value);
+    }
+
+    keyval_t low = build.front().key, high = build.back().key;
+    Pagenum_t leaf = find_leaf(probe_id, read_root_page_num(probe_id), low, false);
+
+    while (leaf != 0){
+        BufferBlock_t * frame = buffer_read_page(probe_id, leaf);
+        NodePage_t & page = frame->frame.node_page;
+
+        leaf = page.right_page_num;
+        for (int k = 0; k < page.num_key; k++){
+            keyval_t key = page.lf_record[k].key;
+            if (key > high){
+                leaf = 0;
+                break;
+            }
+
+            auto it = hash_table.find(key);
+            if (it != hash_table.end()){
+                write_probe_row(join, build_is_left, key, it->second, page.lf_record[k].value);
+            }
+        }
+        buffer_unpin_page(frame);
+    }
+}
+
+// Merge the build records, which are sorted, with the leaves of probe_id within their keys
+static void range_merge_join(Join & join, const vector<LeafRecord> & build, int probe_id, bool build_is_left){
+
+    keyval_t low = build.front().key, high = build.back().key;
+    Pagenum_t leaf = find_leaf(probe_id, read_root_page_num(probe_id), low, false);
+    size_t next = 0;
+
+    while (leaf != 0){
+        BufferBlock_t * frame = buffer_read_page(probe_id, leaf);
+        NodePage_t & page = frame->frame.node_page;
+
+        leaf = page.right_page_num;
+        for (int k = 0; k < page.num_key; k++){
+            keyval_t key = page.lf_record[k].key;
+            if (key > high){
+                leaf = 0;
+                break;
+            }
+
+            while (build[next].key < key) next++;
+            if (build[next].key == key){
+                write_probe_row(join, build_is_left, key, build[next].value, page.lf_record[k].value);
+            }
+        }
+        buffer_unpin_page(frame);
+    }
+}
+
+// Look every build key up in probe_id
+// The build keys are sorted, so a leaf is searched again before descending from the root,
+// and a key the filter of probe_id rules out costs no descent.
+static void index_join(Join & join, const vector<LeafRecord> & build, int probe_id, bool build_is_left){
+
+    BufferBlock_t * frame = NULL;
+    const BloomFilter * filter = get_bloom_filter(probe_id);
+
+    for (const LeafRecord & record : build){
+
+        if (frame == NULL || beyond_high_key(frame->frame.node_page, record.key)){
+            if (filter != NULL && !filter->may_contain(record.key)){
+                continue;
+            }
+            if (frame != NULL){
+                buffer_unpin_page(frame);
+            }
+            Pagenum_t leaf = find_leaf(probe_id, read_root_page_num(probe_id), record.key, false);
+            if (leaf == 0){
+                return;
+            }
+            frame = buffer_read_page(probe_id, leaf);
+        }
+
+        NodePage_t & page = frame->frame.node_page;
+        LeafRecord * end = page.lf_record + page.num_key;
+        LeafRecord * found = lower_bound(page.lf_record, end, record.key,
+            [](const LeafRecord & r, keyval_t key){ return r.key < key; });
+
+        if (found != end && found->key == record.key){
+            write_probe_row(join, build_is_left, record.key, record.value, found->value);
+        }
+    }
+
+    if (frame != NULL){
+        buffer_unpin_page(frame);
+    }
+}
+
+// Join by reading the smaller table and probing the other one with its keys
+static int probe_join_table(int table_id_1, int table_id_2, char * pathname, const JoinOptions & options,
+    JoinMethod method, bool build_is_left, Pagenum_t probe_pages){
+
+    Join join(pathname, table_id_1, table_id_2, options);
+    if (!join.is_valid){
+        return FAILURE;
+    }
+
+    int build_id = build_is_left ? table_id_1 : table_id_2;
+    int probe_id = build_is_left ? table_id_2 : table_id_1;
+
+    vector<LeafRecord> build;
+    scan_table(build_id, build);
+
+    if (!build.empty()){
+
+        // Knowing the build side, weigh a lookup per key against a scan of the probe leaves it covers
+        // Both sides are sorted, so a scan merges them rather than hashing.
+        // Keys the filter of probe_id rules out aren't looked up.
+        if (method == JoinMethod::AUTO){
+            const BloomFilter * filter = get_bloom_filter(probe_id);
+            size_t num_lookups = filter == NULL ? build.size() : count_if(build.begin(), build.end(),
+                [filter](const LeafRecord & record){ return filter->may_contain(record.key); });
+
+            double lookup_cost = (double)num_lookups * JOIN_RANDOM_PAGE_COST;
+            double scan_cost = probe_pages * covered_fraction(probe_id, build.front().key, build.back().key);
+            method = lookup_cost < scan_cost ? JoinMethod::INDEX_NESTED_LOOP : JoinMethod::MERGE;
+        }
+
+        if (method == JoinMethod::HASH){
+            hash_join(join, build, probe_id, build_is_left);
+        }
+        else if (method == JoinMethod::INDEX_NESTED_LOOP){
+            index_join(join, build, probe_id, build_is_left);
+        }
+        else{
+            range_merge_join(join, build, probe_id, build_is_left);
+        }
+    }
+
+    return join.close_output();
+}
+
+int join_table(int table_id_1, int table_id_2, char * pathname, const JoinOptions & options){
+
+    if (!tables.in_use[table_id_1] || !tables.in_use[table_id_2]){
+        return FAILURE;
+    }
+
+    // Tables of similar size are merged. Otherwise the smaller one is read,
+    // and the other one probed by key, by scan or lookups as cheaper.
+    JoinMethod method = options.method;
+    Pagenum_t pages_1 = count_pages(table_id_1), pages_2 = count_pages(table_id_2);
+    bool build_is_left = pages_1 <= pages_2;
+
+    if (method == JoinMethod::AUTO && min(pages_1, pages_2) * JOIN_BUILD_RATIO > max(pages_1, pages_2)){
+        method = JoinMethod::MERGE;
+    }
+
+    // Only the merge keeps or drops the rows without a match
+    if (options.type != JoinType::INNER){
+        method = JoinMethod::MERGE;
+    }
+
+    if (method != JoinMethod::MERGE){
+        return probe_join_table(table_id_1, table_id_2, pathname, options, method, build_is_left, max(pages_1, pages_2));
+    }
+
+    if (options.num_threads > 1){
+        return parallel_join_table(table_id_1, table_id_2, pathname, options);
+    }
+
+    Join join(pathname, table_id_1, table_id_2, options);
     if (!join.is_valid){
         return FAILURE;
     }
@@ -149,46 +697,275 @@ int join_table(int table_id_1, int table_id_2, char * pathname){
     Pagenum_t left_leaf, right_leaf;
     find_leftmost_page_num(table_id_1, table_id_2, &left_leaf, &right_leaf);
 
-    if (left_leaf == 0 || right_leaf == 0){
-        return SUCCESS;
+    join.proceed(left_leaf, right_leaf);
+
+    return join.close_output();
+}
+
+int join_tables(const vector<int> & table_ids, char * pathname, int min_matches, const JoinOptions & options){
+
+    MultiJoinIterator rows(table_ids, min_matches, options);
+    OutputSink output(pathname, options.output_buffer_size, options.output_flags);
+    if (!rows.is_valid || !output.is_open()){
+        return FAILURE;
     }
 
-    join.proceed(left_leaf, right_leaf);
+    int num_tables = rows.num_tables();
+    vector<keyval_t> keys(JOIN_BATCH_SIZE);
+    vector<const char *> values(JOIN_BATCH_SIZE * num_tables);
+    int num_rows;
+
+    while ((num_rows = rows.next_batch(keys.data(), values.data(), JOIN_BATCH_SIZE)) > 0){
+        for (int r = 0; r < num_rows; r++){
+            for (int t = 0; t < num_tables; t++){
+                const char * value = values[r * num_tables + t];
+                if (t > 0){
+                    output.put(COMMA);
+                }
+                if (value != NULL){
+                    output.write_int(keys[r]);
+                    output.put(COMMA);
+                    output.write_str(value, JOIN_VALUE_SIZE);
+                }
+                else{
+                    output.put(COMMA);
+                }
+            }
+            output.put('\n');
+        }
+    }
 
-    return SUCCESS;    
+    output.put('\n');
+    return output.close();
 }
 
-void find_leftmost_page_num(int table_id_1, int table_id_2, Pagenum_t * left_leaf, Pagenum_t * right_leaf){
-    
-    int table_id[2] = {table_id_1, table_id_2};
-    Pagenum_t * leaf_number[2] = {left_leaf, right_leaf};
+Pagenum_t find_leftmost_leaf(int table_id){
 
     BufferBlock_t * header, * node;
     Pagenum_t root_page_num, left_page_num;
 
-    for (int i = 0; i < 2; i++){
+    header = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
+    root_page_num = header->frame.header_page.root_page_num;
+    buffer_unpin_page(header);
+
+    if (root_page_num == NO_ROOT_NODE){
+        return NO_ROOT_NODE;
+    }
 
-        header = buffer_read_page(table_id[i], HEADER_PAGE_NUMBER);
+    node = buffer_read_page(table_id, root_page_num);
+    left_page_num = root_page_num;
 
-        if ((root_page_num = header->frame.header_page.root_page_num) == NO_ROOT_NODE){
-            *leaf_number[i] = NO_ROOT_NODE;
-        }
-        else{
-            node = buffer_read_page(table_id[i], root_page_num);
-            left_page_num = root_page_num;
-    
-            while(!node->frame.node_page.is_leaf){
-                left_page_num = node->frame.node_page.extra_page_num;
+    while(!node->frame.node_page.is_leaf){
+        left_page_num = node->frame.node_page.extra_page_num;
+
+        buffer_unpin_page(node);
+        node = buffer_read_page(table_id, left_page_num);
+    }
+
+    buffer_unpin_page(node);
+    return left_page_num;
+}
+
+void find_leftmost_page_num(int table_id_1, int table_id_2, Pagenum_t * left_leaf, Pagenum_t * right_leaf){
+    *left_leaf = find_leftmost_leaf(table_id_1);
+    *right_leaf = find_leftmost_leaf(table_id_2);
+}
+
+// Add the keys of the highest internal level of table_id that has at least wanted keys,
+// or else of the level right above the leaves, to samples
+static void sample_separators(int table_id, size_t wanted, vector<keyval_t> & samples){
 
+    BufferBlock_t * header = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
+    Pagenum_t root_page_num = header->frame.header_page.root_page_num;
+    buffer_unpin_page(header);
+
+    if (root_page_num == NO_ROOT_NODE){
+        return;
+    }
+
+    vector<Pagenum_t> level(1, root_page_num), children;
+    vector<keyval_t> keys;
+
+    while (true){
+
+        keys.clear();
+        children.clear();
+
+        for (Pagenum_t page_num : level){
+            BufferBlock_t * node = buffer_read_page(table_id, page_num);
+            NodePage_t & page = node->frame.node_page;
+
+            if (page.is_leaf){
+                // A root leaf has no separators
                 buffer_unpin_page(node);
-                node = buffer_read_page(table_id[i], left_page_num);
+                return;
             }
 
-            *leaf_number[i] = left_page_num;
+            children.push_back(page.extra_page_num);
+            for (int k = 0; k < page.num_key; k++){
+                keys.push_back(page.in_record[k].key);
+                children.push_back(page.in_record[k].page_num);
+            }
             buffer_unpin_page(node);
         }
 
-        buffer_unpin_page(header);
+        bool is_last_level = keys.size() >= wanted;
+        if (!is_last_level){
+            BufferBlock_t * child = buffer_read_page(table_id, children.front());
+            is_last_level = child->frame.node_page.is_leaf;
+            buffer_unpin_page(child);
+        }
+
+        if (is_last_level){
+            samples.insert(samples.end(), keys.begin(), keys.end());
+            return;
+        }
+        level.swap(children);
+    }
+}
+
+// Split the keys of both tables into at most num_partitions ranges of similar size,
+// storing the bounds between consecutive ranges
+static void choose_partition_bounds(int table_id_1, int table_id_2, int num_partitions, vector<keyval_t> & bounds){
+
+    vector<keyval_t> samples;
+    size_t wanted = (size_t)num_partitions * JOIN_SAMPLES_PER_PARTITION;
+
+    sample_separators(table_id_1, wanted, samples);
+    sample_separators(table_id_2, wanted, samples);
+
+    sort(samples.begin(), samples.end());
+    samples.erase(unique(samples.begin(), samples.end()), samples.end());
+
+    bounds.clear();
+    for (int p = 1; p < num_partitions; p++){
+        size_t idx = samples.size() * p / num_partitions;
+        if (idx < samples.size() && (bounds.empty() || bounds.back() < samples[idx])){
+            bounds.push_back(samples[idx]);
+        }
+    }
+}
+
+// Join the keys of one range into pathname, storing 0 in result if success, otherwise -1
+static void join_partition(int table_id_1, int table_id_2, const char * pathname, const JoinOptions & options,
+    keyval_t lower, keyval_t upper, bool is_first, bool is_last, int * result){
+
+    Join join(pathname, table_id_1, table_id_2, options);
+    if (!join.is_valid){
+        *result = FAILURE;
+        return;
+    }
+    join.set_range(lower, upper, !is_last);
+
+    Pagenum_t left_leaf, right_leaf;
+    if (is_first){
+        find_leftmost_page_num(table_id_1, table_id_2, &left_leaf, &right_leaf);
+    }
+    else{
+        left_leaf = find_leaf(table_id_1, read_root_page_num(table_id_1), lower, false);
+        right_leaf = find_leaf(table_id_2, read_root_page_num(table_id_2), lower, false);
+    }
+
+    join.proceed(left_leaf, right_leaf);
+
+    *result = join.close_output(false);
+}
+
+// Append the file at pathname to out_fd at *offset
+static int append_file(int out_fd, off_t * offset, const char * pathname){
+
+    int in_fd = open(pathname, O_RDONLY);
+    if (in_fd < 0){
+        return FAILURE;
+    }
+
+    // Let the kernel copy, and fall back to reading and writing where it can't
+    int result = SUCCESS;
+    ssize_t copied;
+    while ((copied = copy_file_range(in_fd, NULL, out_fd, offset, 1 << 30, 0)) > 0);
+
+    if (copied < 0){
+        vector<char> chunk(1 << 20);
+        ssize_t num_read;
+        while ((num_read = read(in_fd, chunk.data(), chunk.size())) > 0){
+            if (pwrite(out_fd, chunk.data(), num_read, *offset) != num_read){
+                result = FAILURE;
+                break;
+            }
+            *offset += num_read;
+        }
+        if (num_read < 0){
+            result = FAILURE;
+        }
+    }
+
+    close(in_fd);
+    return result;
+}
+
+// Join the tables in options.num_threads key ranges at once
+// Each range is written to a file of its own next to pathname, and the files
+// are then appended to pathname in key order.
+int parallel_join_table(int table_id_1, int table_id_2, char * pathname, const JoinOptions & options){
+
+    if (!tables.in_use[table_id_1] || !tables.in_use[table_id_2]){
+        return FAILURE;
     }
-    
-}
\ No newline at end of file
+
+    vector<keyval_t> bounds;
+    choose_partition_bounds(table_id_1, table_id_2, options.num_threads, bounds);
+
+    // The first range goes straight to pathname, which is made durable only at the end
+    int num_partitions = bounds.size() + 1;
+    vector<string> paths(num_partitions, string(pathname));
+    for (int p = 1; p < num_partitions; p++){
+        paths[p] += "." + to_string(p);
+    }
+
+    JoinOptions partition_options = options;
+    partition_options.output_flags &= ~SINK_SYNC;
+
+    vector<int> results(num_partitions, FAILURE);
+    vector<thread> workers;
+    for (int p = 0; p < num_partitions; p++){
+        keyval_t lower = p == 0 ? INT64_MIN : bounds[p - 1];
+        keyval_t upper = p == num_partitions - 1 ? INT64_MAX : bounds[p];
+        workers.emplace_back(join_partition, table_id_1, table_id_2, paths[p].c_str(), cref(partition_options),
+            lower, upper, p == 0, p == num_partitions - 1, &results[p]);
+    }
+    for (auto & worker : workers){
+        worker.join();
+    }
+
+    int result = SUCCESS;
+    for (int p = 0; p < num_partitions; p++){
+        if (results[p] != SUCCESS) result = FAILURE;
+    }
+
+    int out_fd = result == SUCCESS ? open(pathname, O_WRONLY) : -1;
+    if (out_fd < 0){
+        result = FAILURE;
+    }
+    else{
+        off_t offset = lseek(out_fd, 0, SEEK_END);
+        for (int p = 1; p < num_partitions && result == SUCCESS; p++){
+            result = append_file(out_fd, &offset, paths[p].c_str());
+        }
+
+        // End the output like a serial join does
+        if (result == SUCCESS && pwrite(out_fd, "\n", 1, offset) != 1){
+            result = FAILURE;
+        }
+        if (result == SUCCESS && (options.output_flags & SINK_SYNC) && fdatasync(out_fd) < 0){
+            result = FAILURE;
+        }
+        if (close(out_fd) < 0){
+            result = FAILURE;
+        }
+    }
+
+    for (int p = 1; p < num_partitions; p++){
+        unlink(paths[p].c_str());
+    }
+    return result;
+}
@@ -0,0 +1,333 @@
+#include "join.hpp"
+#include "bloom.hpp"
+
+#include <getopt.h>
+
+/*
+ * Benchmark of join output
+ *
+ * Two tables are loaded, the right one with every key of the left one or with
+ * fewer keys spread evenly over them, so the natural join writes one row per
+ * key of the right table. They are then joined a number of times. Each run is timed
+ * from join_table to the closed (and, with --sync, durable) output file.
+ *
+ * To tell how close the join comes to the disk, the same number of bytes is
+ * then written to a scratch file through the same kind of sink in large
+ * slices, without any join in front of it, and both rates are printed.
+ *
+ * With --iterate the rows of a merge join are pulled from a JoinIterator
+ * and only counted, which times the join without any output. With --filter
+ * both tables get a Bloom filter first, which the probe joins consult.
+ */
+
+#define JOIN_BENCH_VALUE_FORMAT "%c%015ld"
+
+struct JoinBenchConfig{
+    keyval_t num_keys;
+    keyval_t num_right_keys;
+    int num_runs;
+    int num_threads;
+    JoinMethod method;
+    JoinType type;
+    int num_buf;
+    size_t output_buffer_size;
+    int output_flags;
+    bool iterate;
+    bool filter;
+    const char * left_path;
+    const char * right_path;
+    const char * output_path;
+    const char * log_path;
+    const char * json_path;
+};
+
+static const char * method_name(JoinMethod method){
+    switch (method){
+    case JoinMethod::MERGE: return "merge";
+    case JoinMethod::HASH: return "hash";
+    case JoinMethod::INDEX_NESTED_LOOP: return "index";
+    default: return "auto";
+    }
+}
+
+static const char * type_name(JoinType type){
+    switch (type){
+    case JoinType::SEMI: return "semi";
+    case JoinType::ANTI: return "anti";
+    case JoinType::LEFT_OUTER: return "left";
+    case JoinType::FULL_OUTER: return "full";
+    default: return "inner";
+    }
+}
+
+static void print_usage(const char * program){
+    printf("Usage: %s [options]\n\n", program);
+    printf("-k, --keys N         : Number of keys in each table (default 200000).\n");
+    printf("-K, --right-keys N   : Number of keys in the right table (default as many as the left one).\n");
+    printf("-M, --method NAME    : Join method: auto, merge, hash or index (default auto).\n");
+    printf("-T, --type NAME      : Join type: inner, semi, anti, left or full (default inner).\n");
+    printf("-n, --runs N         : Number of joins to time (default 3).\n");
+    printf("-t, --threads N      : Key ranges joined in parallel (default 1).\n");
+    printf("-b, --buffer N       : Number of buffer frames (default 30000).\n");
+    printf("-B, --output-kb N    : Size of the output buffer in KB (default %d).\n", DEFAULT_SINK_BUFFER_SIZE / 1024);
+    printf("-I, --iterate        : Pull the rows of a merge join without writing them.\n");
+    printf("-F, --filter         : Build Bloom filters on both tables before joining.\n");
+    printf("-D, --direct         : Write the output with O_DIRECT.\n");
+    printf("-S, --sync           : Make the output durable before the clock stops.\n");
+    printf("-L, --left PATH      : Left table file (default join_left.db).\n");
+    printf("-R, --right PATH     : Right table file (default join_right.db).\n");
+    printf("-o, --output PATH    : Output file (default join.csv).\n");
+    printf("-l, --log PATH       : Log file (default join_bench.log).\n");
+    printf("-j, --json PATH      : Write the results as JSON to PATH (- for stdout).\n");
+    printf("-h, --help           : Print this message.\n");
+}
+
+// Return SUCCESS, or FAILURE after printing what is wrong with the arguments
+static int parse_args(int argc, char ** argv, JoinBenchConfig & config){
+
+    static const struct option options[] = {
+        {"keys", required_argument, nullptr, 'k'},
+        {"right-keys", required_argument, nullptr, 'K'},
+        {"method", required_argument, nullptr, 'M'},
+        {"type", required_argument, nullptr, 'T'},
+        {"runs", required_argument, nullptr, 'n'},
+        {"threads", required_argument, nullptr, 't'},
+        {"buffer", required_argument, nullptr, 'b'},
+        {"output-kb", required_argument, nullptr, 'B'},
+        {"iterate", no_argument, nullptr, 'I'},
+        {"filter", no_argument, nullptr, 'F'},
+        {"direct", no_argument, nullptr, 'D'},
+        {"sync", no_argument, nullptr, 'S'},
+        {"left", required_argument, nullptr, 'L'},
+        {"right", required_argument, nullptr, 'R'},
+        {"output", required_argument, nullptr, 'o'},
+        {"log", required_argument, nullptr, 'l'},
+        {"json", required_argument, nullptr, 'j'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "k:K:M:T:n:t:b:B:IFDSL:R:o:l:j:h", options, nullptr)) != -1){
+        switch (opt){
+        case 'k': config.num_keys = atol(optarg); break;
+        case 'K': config.num_right_keys = atol(optarg); break;
+        case 'M':
+            if (!strcmp(optarg, "auto")) config.method = JoinMethod::AUTO;
+            else if (!strcmp(optarg, "merge")) config.method = JoinMethod::MERGE;
+            else if (!strcmp(optarg, "hash")) config.method = JoinMethod::HASH;
+            else if (!strcmp(optarg, "index")) config.method = JoinMethod::INDEX_NESTED_LOOP;
+            else {
+                printf("Unknown join method %s.\n", optarg);
+                return FAILURE;
+            }
+            break;
+        case 'T':
+            if (!strcmp(optarg, "inner")) config.type = JoinType::INNER;
+            else if (!strcmp(optarg, "semi")) config.type = JoinType::SEMI;
+            else if (!strcmp(optarg, "anti")) config.type = JoinType::ANTI;
+            else if (!strcmp(optarg, "left")) config.type = JoinType::LEFT_OUTER;
+            else if (!strcmp(optarg, "full")) config.type = JoinType::FULL_OUTER;
+            else {
+                printf("Unknown join type %s.\n", optarg);
+                return FAILURE;
+            }
+            break;
+        case 'n': config.num_runs = atoi(optarg); break;
+        case 't': config.num_threads = atoi(optarg); break;
+        case 'b': config.num_buf = atoi(optarg); break;
+        case 'B': config.output_buffer_size = (size_t)atol(optarg) * 1024; break;
+        case 'I': config.iterate = true; break;
+        case 'F': config.filter = true; break;
+        case 'D': config.output_flags |= SINK_DIRECT; break;
+        case 'S': config.output_flags |= SINK_SYNC; break;
+        case 'L': config.left_path = optarg; break;
+        case 'R': config.right_path = optarg; break;
+        case 'o': config.output_path = optarg; break;
+        case 'l': config.log_path = optarg; break;
+        case 'j': config.json_path = optarg; break;
+        default:
+            print_usage(argv[0]);
+            return FAILURE;
+        }
+    }
+
+    if (config.num_right_keys == 0){
+        config.num_right_keys = config.num_keys;
+    }
+
+    if (config.num_keys < 1 || config.num_right_keys < 1 || config.num_right_keys > config.num_keys || config.num_runs < 1 || config.num_threads < 1 || config.num_buf < 1 || config.output_buffer_size < 1){
+        printf("Invalid arguments.\n");
+        print_usage(argv[0]);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+// Insert the keys the table doesn't have yet: num_keys keys, stride apart
+static void load_table(int table_id, const char * path, char tag, keyval_t num_keys, keyval_t stride){
+    char value[120];
+    keyval_t num_loaded = 0;
+
+    for (keyval_t key = 0; key < num_keys * stride; key += stride){
+        sprintf(value, JOIN_BENCH_VALUE_FORMAT, tag, (long)key);
+        if (db_insert(table_id, key, value) == SUCCESS)
+            num_loaded++;
+    }
+    printf("Loaded %ld keys into %s.\n", num_loaded, path);
+}
+
+static off_t file_size(const char * path){
+    FILE * file = fopen(path, "r");
+    if (file == nullptr) return 0;
+    fseeko(file, 0, SEEK_END);
+    off_t size = ftello(file);
+    fclose(file);
+    return size;
+}
+
+// Seconds taken to write num_bytes through a sink in 1 MB slices, or -1 on failure
+static double time_raw_write(const JoinBenchConfig & config, off_t num_bytes){
+
+    string scratch_path = string(config.output_path) + ".raw";
+    vector<char> slice(1 << 20, 'x');
+
+    auto start = chrono::steady_clock::now();
+    OutputSink sink(scratch_path.c_str(), config.output_buffer_size, config.output_flags);
+    if (!sink.is_open()){
+        return -1;
+    }
+    for (off_t left = num_bytes; left > 0; left -= slice.size()){
+        sink.write(slice.data(), left < (off_t)slice.size() ? left : slice.size());
+    }
+    int result = sink.close();
+    double elapsed_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    unlink(scratch_path.c_str());
+    return result == SUCCESS ? elapsed_s : -1;
+}
+
+// Merge the tables through an iterator, counting the rows
+static int iterate_join(int left_id, int right_id, const JoinOptions & options, keyval_t * num_rows){
+
+    JoinIterator rows(left_id, right_id, options);
+    if (!rows.is_valid){
+        return FAILURE;
+    }
+
+    JoinRow batch[JOIN_BATCH_SIZE];
+    int count;
+    *num_rows = 0;
+    while ((count = rows.next_batch(batch, JOIN_BATCH_SIZE)) > 0){
+        *num_rows += count;
+    }
+    return SUCCESS;
+}
+
+int main(int argc, char ** argv){
+
+    JoinBenchConfig config = {200000, 0, 3, 1, JoinMethod::AUTO, JoinType::INNER, 30000, DEFAULT_SINK_BUFFER_SIZE, 0, false, false,
+        "join_left.db", "join_right.db", "join.csv", "join_bench.log", nullptr};
+
+    if (parse_args(argc, argv, config) != SUCCESS){
+        return 1;
+    }
+
+    if (init_db(config.num_buf, config.log_path) != SUCCESS){
+        printf("Unable to initialize the database.\n");
+        return 1;
+    }
+
+    int left_id = open_table((char *)config.left_path);
+    int right_id = open_table((char *)config.right_path);
+    if (left_id < 0 || right_id < 0){
+        printf("Unable to open %s and %s.\n", config.left_path, config.right_path);
+        shutdown_db();
+        return 1;
+    }
+
+    load_table(left_id, config.left_path, 'l', config.num_keys, 1);
+    load_table(right_id, config.right_path, 'r', config.num_right_keys, config.num_keys / config.num_right_keys);
+
+    // Filters are kept with the tables, so runs without them drop the ones an earlier run left
+    if (config.filter && (db_build_bloom_filter(left_id) != SUCCESS || db_build_bloom_filter(right_id) != SUCCESS)){
+        printf("Unable to build the Bloom filters.\n");
+    }
+    else if (!config.filter){
+        db_drop_bloom_filter(left_id);
+        db_drop_bloom_filter(right_id);
+    }
+
+    JoinOptions options;
+    options.output_buffer_size = config.output_buffer_size;
+    options.output_flags = config.output_flags;
+    options.num_threads = config.num_threads;
+    options.method = config.method;
+    options.type = config.type;
+
+    if (config.iterate){
+        printf("Iterating over the merge of %ld and %ld keys %d times.\n", (long)config.num_keys,
+            (long)config.num_right_keys, config.num_runs);
+    }
+    else {
+        printf("Joining %ld to %ld keys %d times (%s, %s) on %d threads: %zu KB output buffer%s%s.\n", (long)config.num_keys,
+            (long)config.num_right_keys, config.num_runs, method_name(config.method), type_name(config.type),
+            config.num_threads, config.output_buffer_size / 1024, config.output_flags & SINK_DIRECT ? ", O_DIRECT" : "",
+            config.output_flags & SINK_SYNC ? ", synced" : "");
+    }
+
+    // The best run, after the first one has brought the tables into the buffer
+    double best_s = 0;
+    keyval_t num_rows = config.num_right_keys;
+    for (int run = 0; run < config.num_runs; run++){
+        auto start = chrono::steady_clock::now();
+        int result = config.iterate ? iterate_join(left_id, right_id, options, &num_rows)
+            : join_table(left_id, right_id, (char *)config.output_path, options);
+        if (result != SUCCESS){
+            printf("Join into %s failed.\n", config.output_path);
+            shutdown_db();
+            return 1;
+        }
+        double elapsed_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        printf("Run %d: %.3f s\n", run + 1, elapsed_s);
+        if (run == 0 || elapsed_s < best_s) best_s = elapsed_s;
+    }
+
+    off_t num_bytes = config.iterate ? 0 : file_size(config.output_path);
+    double raw_s = config.iterate ? 0 : time_raw_write(config, num_bytes);
+    double join_mb_s = num_bytes / best_s / (1 << 20);
+    double raw_mb_s = raw_s > 0 ? num_bytes / raw_s / (1 << 20) : 0;
+
+    printf("Join: %ld rows, %.1f MB in %.3f s (%.0f rows/s, %.1f MB/s)\n", (long)num_rows,
+        num_bytes / (double)(1 << 20), best_s, num_rows / best_s, join_mb_s);
+    if (!config.iterate){
+        printf("Raw write of the same bytes: %.3f s (%.1f MB/s), join at %.0f%% of it\n",
+            raw_s, raw_mb_s, raw_mb_s > 0 ? 100 * join_mb_s / raw_mb_s : 0.0);
+    }
+
+    if (config.json_path != nullptr){
+        FILE * out = strcmp(config.json_path, "-") ? fopen(config.json_path, "w") : stdout;
+        if (out == nullptr){
+            printf("Unable to write %s.\n", config.json_path);
+        }
+        else {
+            fprintf(out, "{\n");
+            fprintf(out, "  \"config\": {\"keys\": %ld, \"right_keys\": %ld, \"method\": \"%s\", \"type\": \"%s\", \"runs\": %d, \"threads\": %d, \"buffer\": %d, \"output_kb\": %zu, \"direct\": %s, \"sync\": %s, \"iterate\": %s, \"filter\": %s},\n",
+                (long)config.num_keys, (long)config.num_right_keys, method_name(config.method), type_name(config.type), config.num_runs, config.num_threads, config.num_buf, config.output_buffer_size / 1024,
+                config.output_flags & SINK_DIRECT ? "true" : "false", config.output_flags & SINK_SYNC ? "true" : "false", config.iterate ? "true" : "false",
+                config.filter ? "true" : "false");
+            fprintf(out, "  \"rows\": %ld,\n", (long)num_rows);
+            fprintf(out, "  \"bytes\": %ld,\n", (long)num_bytes);
+            fprintf(out, "  \"join_s\": %.3f,\n", best_s);
+            fprintf(out, "  \"rows_per_s\": %.1f,\n", num_rows / best_s);
+            fprintf(out, "  \"join_mb_per_s\": %.1f,\n", join_mb_s);
+            fprintf(out, "  \"raw_mb_per_s\": %.1f\n", raw_mb_s);
+            fprintf(out, "}\n");
+            if (out != stdout) fclose(out);
+        }
+    }
+
+    shutdown_db();
+    return 0;
+}
@@ -0,0 +1,444 @@
+#include <log.hpp>
+
+#include <cerrno>
+
+LogManager * log_manager;
+
+static thread_local LogContext log_context = {0, LogType::UPDATE, nullptr, 0, NO_LSN};
+
+// FNV-1a hash used as the checksum of a log record
+static uint32_t checksum_bytes(uint32_t hash, const char * bytes, size_t length){
+    for (size_t i = 0; i < length; i++){
+        hash ^= (unsigned char)bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t record_checksum(const LogRecord_t & record, const char * images){
+    LogRecord_t temp = record;
+    temp.checksum = 0;
+
+    uint32_t hash = checksum_bytes(2166136261u, (const char *)&temp, sizeof(LogRecord_t));
+    return checksum_bytes(hash, images, record.size - sizeof(LogRecord_t));
+}
+
+LogManager::LogManager(const char * pathname, size_t buffer_capacity)
+    : fd(-1), buffer_capacity(buffer_capacity), terminate(false), failed(false), next_system_op_id(-1), num_records(0),
+      num_syncs(0), crash_point(0) {
+
+    if (open_log(pathname) != SUCCESS){
+        cerr << "Unable to open log file at " << pathname << endl;
+        exit(1);
+    }
+
+    log_buffer.reserve(buffer_capacity);
+    flusher = thread(&LogManager::flush_loop, this);
+}
+
+LogManager::~LogManager(){
+
+    unique_lock<mutex> guard(latch);
+    terminate = true;
+    flush_cond.notify_one();
+    guard.unlock();
+
+    flusher.join();
+    close(fd);
+}
+
+// Open the log file (or create one) and find the end of the valid records
+// A torn record at the tail is cut off
+int LogManager::open_log(const char * pathname){
+
+    LogRecord_t record;
+    vector<char> images;
+
+    fd = open(pathname, O_RDWR | O_CREAT, 0644);
+    if (fd < 0){
+        return FAILURE;
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != LOG_MAGIC){
+        memset(&header, 0, sizeof(header));
+        header.magic = LOG_MAGIC;
+        header.base_lsn = sizeof(LogFileHeader_t);
+
+        if (ftruncate(fd, 0) || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)){
+            return FAILURE;
+        }
+        fdatasync(fd);
+    }
+
+    base_lsn = header.base_lsn;
+    start_lsn = header.start_lsn != 0 ? header.start_lsn : base_lsn;
+
+    // Every record on the disk is readable while scanning
+    flushed_lsn = next_lsn = (lsn_t)-1;
+
+    lsn_t lsn = start_lsn;
+    while (read_record(lsn, record, images)){
+        lsn += record.size;
+    }
+
+    if (ftruncate(fd, sizeof(LogFileHeader_t) + (lsn - base_lsn))){
+        return FAILURE;
+    }
+
+    flushed_lsn = next_lsn = requested_lsn = lsn;
+    return SUCCESS;
+}
+
+// Write the records in data at lsn and sync them
+int LogManager::write_log(const char * data, size_t length, lsn_t lsn){
+
+    off_t offset = sizeof(LogFileHeader_t) + (lsn - base_lsn);
+
+    while (length > 0){
+        ssize_t written = pwrite(fd, data, length, offset);
+        if (written < 0){
+            if (errno == EINTR) continue;
+            return FAILURE;
+        }
+        data += written;
+        length -= written;
+        offset += written;
+    }
+
+    while (fdatasync(fd) != 0){
+        if (errno != EINTR) return FAILURE;
+    }
+    return SUCCESS;
+}
+
+// Body of the group commit thread
+// Every round hands the whole log buffer to the disk with a single fdatasync,
+// so commits that arrive while a sync is in progress share the next one.
+// A failed write leaves flushed_lsn where it was and fails the log manager for good:
+// what reached the disk is unknown, so nothing after it may be reported durable.
+void LogManager::flush_loop(){
+
+    vector<char> pending;
+    pending.reserve(buffer_capacity);
+
+    unique_lock<mutex> guard(latch);
+
+    while (true){
+
+        flush_cond.wait(guard, [&]{
+            return terminate || requested_lsn > flushed_lsn || log_buffer.size() >= buffer_capacity;
+        });
+
+        if (log_buffer.empty()){
+            if (terminate) break;
+            continue;
+        }
+
+        lsn_t write_lsn = flushed_lsn, end_lsn = next_lsn;
+        pending.swap(log_buffer);
+
+        guard.unlock();
+
+        int result = write_log(pending.data(), pending.size(), write_lsn);
+        int error = errno;
+
+        guard.lock();
+
+        if (result != SUCCESS){
+            cerr << "Unable to write the log at LSN " << write_lsn << ": " << strerror(error) << endl;
+            failed = true;
+            durable_cond.notify_all();
+            break;
+        }
+
+        pending.clear();
+        flushed_lsn = end_lsn;
+        num_syncs++;
+
+        durable_cond.notify_all();
+    }
+}
+
+lsn_t LogManager::append(LogRecord_t & record, const char * old_image, const char * new_image){
+
+    size_t size = sizeof(LogRecord_t) + 2 * record.length;
+
+    unique_lock<mutex> guard(latch);
+
+    // Back-pressure: wait for the group commit thread if the buffer is full
+    while (!failed && !log_buffer.empty() && log_buffer.size() + size > buffer_capacity){
+        requested_lsn = max(requested_lsn, next_lsn);
+        flush_cond.notify_one();
+        durable_cond.wait(guard);
+    }
+
+    // A failed log takes no more records, so callers learn that nothing they change is logged
+    if (failed){
+        return NO_LSN;
+    }
+
+    record.size = size;
+    record.lsn = next_lsn;
+    record.checksum = 0;
+
+    size_t start = log_buffer.size();
+    log_buffer.resize(start + size);
+
+    char * dest = log_buffer.data() + start;
+    if (record.length > 0){
+        memcpy(dest + sizeof(LogRecord_t), old_image, record.length);
+        memcpy(dest + sizeof(LogRecord_t) + record.length, new_image, record.length);
+    }
+
+    record.checksum = record_checksum(record, dest + sizeof(LogRecord_t));
+    memcpy(dest, &record, sizeof(LogRecord_t));
+
+    next_lsn += size;
+    num_records++;
+
+    if (record.trx_id != 0){
+        if (record.type == LogType::COMMIT || record.type == LogType::ROLLBACK){
+            active_trx.erase(record.trx_id);
+        }
+        else {
+            auto iter = active_trx.find(record.trx_id);
+            if (iter == active_trx.end()){
+                active_trx[record.trx_id] = {record.trx_id, record.lsn, record.lsn};
+            }
+            else {
+                iter->second.last_lsn = record.lsn;
+            }
+        }
+    }
+
+    if (crash_point != 0 && num_records >= crash_point){
+        _exit(1);
+    }
+
+    return record.lsn;
+}
+
+int LogManager::flush(lsn_t lsn){
+
+    unique_lock<mutex> guard(latch);
+
+    if (flushed_lsn > lsn){
+        return SUCCESS;
+    }
+
+    requested_lsn = max(requested_lsn, lsn + 1);
+    flush_cond.notify_one();
+
+    durable_cond.wait(guard, [&]{ return flushed_lsn > lsn || failed; });
+    return flushed_lsn > lsn ? SUCCESS : FAILURE;
+}
+
+bool LogManager::read_record(lsn_t lsn, LogRecord_t & record, vector<char> & images){
+
+    off_t offset = sizeof(LogFileHeader_t) + (lsn - base_lsn);
+
+    if (lsn < start_lsn || lsn >= flushed_lsn){
+        return false;
+    }
+
+    if (pread(fd, &record, sizeof(LogRecord_t), offset) != sizeof(LogRecord_t)){
+        return false;
+    }
+
+    if (record.lsn != lsn || record.length < 0 || record.length > MAX_LOG_IMAGE_SIZE
+        || record.size != sizeof(LogRecord_t) + 2 * record.length){
+        return false;
+    }
+
+    images.resize(2 * record.length);
+    if (pread(fd, images.data(), images.size(), offset + sizeof(LogRecord_t)) != (ssize_t)images.size()){
+        return false;
+    }
+
+    return record.checksum == record_checksum(record, images.data());
+}
+
+lsn_t LogManager::get_start_lsn(){
+    lock_guard<mutex> guard(latch);
+    return start_lsn;
+}
+
+lsn_t LogManager::get_checkpoint_lsn(){
+    lock_guard<mutex> guard(latch);
+    return header.checkpoint_lsn;
+}
+
+lsn_t LogManager::get_flushed_lsn(){
+    lock_guard<mutex> guard(latch);
+    return flushed_lsn;
+}
+
+lsn_t LogManager::get_next_lsn(){
+    lock_guard<mutex> guard(latch);
+    return next_lsn;
+}
+
+bool LogManager::has_failed(){
+    return failed.load();
+}
+
+lsn_t LogManager::get_active_trx(vector<ActiveTrx_t> & active){
+    lock_guard<mutex> guard(latch);
+
+    active.clear();
+    for (auto & entry : active_trx){
+        active.push_back(entry.second);
+    }
+
+    return next_lsn;
+}
+
+// Only the checkpoint thread rewrites the header, so the I/O is done outside the latch
+int LogManager::set_checkpoint(lsn_t checkpoint_lsn, lsn_t new_start_lsn){
+
+    LogFileHeader_t new_header = header;
+    new_header.checkpoint_lsn = checkpoint_lsn;
+    new_header.start_lsn = max(new_start_lsn, start_lsn);
+
+    if (pwrite(fd, &new_header, sizeof(new_header), 0) != sizeof(new_header) || fdatasync(fd)){
+        return FAILURE;
+    }
+
+    unique_lock<mutex> guard(latch);
+    header = new_header;
+    start_lsn = new_header.start_lsn;
+    guard.unlock();
+
+    // Deallocate the whole blocks of the file holding nothing but dropped records
+    off_t end = (sizeof(LogFileHeader_t) + (start_lsn - base_lsn)) / PAGE_SIZE * PAGE_SIZE;
+    if (end > PAGE_SIZE){
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, PAGE_SIZE, end - PAGE_SIZE);
+    }
+
+    return SUCCESS;
+}
+
+int LogManager::new_system_op_id(){
+    lock_guard<mutex> guard(latch);
+    return next_system_op_id--;
+}
+
+void LogManager::set_crash_point(uint64_t num_records){
+    lock_guard<mutex> guard(latch);
+    crash_point = num_records ? this->num_records + num_records : 0;
+}
+
+void LogManager::print_status(){
+    lock_guard<mutex> guard(latch);
+
+    printf("<Log status> ");
+    printf("Start LSN: %ld / ", start_lsn);
+    printf("Checkpoint LSN: %ld / ", header.checkpoint_lsn);
+    printf("Next LSN: %ld / ", next_lsn);
+    printf("Flushed LSN: %ld / ", flushed_lsn);
+    printf("Records: %ld / ", num_records);
+    printf("Syncs: %ld\n", num_syncs);
+}
+
+LogScope::LogScope(int trx_id, LogType type, lsn_t * last_lsn, keyval_t key, lsn_t undo_next_lsn){
+    saved = log_context;
+    log_context = {trx_id, type, last_lsn, key, undo_next_lsn};
+}
+
+LogScope::LogScope(LogType type){
+    saved = log_context;
+    log_context.type = type;
+}
+
+LogScope::~LogScope(){
+    log_context = saved;
+}
+
+bool log_failed(){
+    return log_manager != nullptr && log_manager->has_failed();
+}
+
+SystemOp::SystemOp(LogType type)
+    : op_id(log_manager->new_system_op_id()), last_lsn(NO_LSN), scope(op_id, type, &last_lsn) {}
+
+SystemOp::~SystemOp(){
+    if (last_lsn != NO_LSN){
+        log_trx_record(op_id, LogType::COMMIT, last_lsn);
+    }
+}
+
+// Log the change between old_page and new_page under the owner of the calling thread
+// Only the range between the first and the last changed byte is logged,
+// ignoring the page LSN which is stamped by the caller
+lsn_t log_page_write(int table_id, Pagenum_t page_num, const Page_t * old_page, const Page_t * new_page){
+
+    if (log_manager == nullptr || log_context.trx_id == 0){
+        return NO_LSN;
+    }
+
+    Page_t temp = *new_page;
+    set_page_lsn(page_num, &temp, get_page_lsn(page_num, old_page));
+
+    const char * old_bytes = (const char *)old_page, * new_bytes = (const char *)&temp;
+    int first = 0, last = PAGE_SIZE - 1;
+
+    while (first < PAGE_SIZE && old_bytes[first] == new_bytes[first]) first++;
+    if (first == PAGE_SIZE){
+        return NO_LSN;
+    }
+    while (old_bytes[last] == new_bytes[last]) last--;
+
+    LogRecord_t record;
+    memset(&record, 0, sizeof(record));
+
+    record.prev_lsn = *log_context.last_lsn;
+    record.trx_id = log_context.trx_id;
+    record.type = log_context.type;
+    record.table_id = table_id;
+    record.page_num = page_num;
+    record.offset = first;
+    record.length = last - first + 1;
+    record.undo_next_lsn = log_context.undo_next_lsn;
+    record.key = log_context.key;
+
+    lsn_t lsn = log_manager->append(record, old_bytes + first, new_bytes + first);
+    *log_context.last_lsn = lsn;
+
+    return lsn;
+}
+
+lsn_t log_trx_record(int trx_id, LogType type, lsn_t prev_lsn){
+
+    LogRecord_t record;
+    memset(&record, 0, sizeof(record));
+
+    record.prev_lsn = prev_lsn;
+    record.trx_id = trx_id;
+    record.type = type;
+
+    return log_manager->append(record, nullptr, nullptr);
+}
+
+lsn_t log_table_open(int table_id, const char * pathname){
+
+    LogRecord_t record;
+    memset(&record, 0, sizeof(record));
+
+    // The path is kept as both images so the record has the usual layout
+    record.type = LogType::OPEN;
+    record.table_id = table_id;
+    record.length = strlen(pathname) + 1;
+
+    return log_manager->append(record, pathname, pathname);
+}
+
+lsn_t log_checkpoint(const char * payload, int length){
+
+    LogRecord_t record;
+    memset(&record, 0, sizeof(record));
+
+    record.type = LogType::CHECKPOINT;
+    record.length = length;
+
+    return log_manager->append(record, payload, payload);
+}
@@ -1,5 +1,6 @@
 #include "join.hpp"
 #include "transaction.hpp"
+#include "recovery.hpp"
 
 void print_instructions(){
     printf( "Welcome to disk-based B+ tree implementation!\n\nInstructions---------------\n\n");
@@ -13,8 +14,12 @@ void print_instructions(){
     printf("d [table ID] [key] : Delete key in table corresponding to ID.\n");
     printf("l [table ID] : Print the leaves of current tree.\n");
     printf("p [table ID] : Print the shape of current tree.\n");
+    printf("v [table ID] : Check the structure of the tree corresponding to ID.\n");
     printf("b : Print the current status of buffer.\n");
     printf("n [table ID] [page number] : Print the information of the page that page number is pointing at.\n");
+    printf("k : Take a checkpoint and print the checkpoint status.\n");
+    printf("w [trx ID] : Print the lock counters of a running transaction, or of every transaction if trx ID is 0.\n");
+    printf("x [count] : Crash the program after count more log records are written.\n");
     printf("s : Close all of tables currently opened and flush data of them into disk.\n");
     printf("q : exit program.\n\n--------------------------------\n");
 }
@@ -119,6 +124,36 @@ int main(){
             cin >> number;
             print_tree(number);
         }
+        else if (cmd == 'v'){
+            cin >> number;
+            if(check_tree(number)) printf("tree of table %d is broken.\n", number);
+            else printf("tree of table %d is valid.\n", number);
+        }
+        else if (cmd == 'k'){
+            take_checkpoint();
+            print_checkpoint_status();
+            log_manager->print_status();
+        }
+        else if (cmd == 'w'){
+            cin >> number;
+            LockStat stat;
+            if (number == 0){
+                lock_manager->print_status();
+            }
+            else if (get_lock_stat(number, &stat) != SUCCESS){
+                printf("transaction %d is not running.\n", number);
+            }
+            else {
+                printf("transaction %d: %lu locks acquired, %lu waits (%.1f us in total, %.1f us at most), %lu deadlocks, %lu timeouts\n",
+                    number, stat.num_acquired, stat.num_waits, stat.total_wait_ns / 1000.0, stat.max_wait_ns / 1000.0,
+                    stat.num_deadlocks, stat.num_timeouts);
+            }
+        }
+        else if (cmd == 'x'){
+            cin >> number;
+            log_manager->set_crash_point(number);
+            printf("crashing after %d more log records.\n", number);
+        }
         else if (cmd == 'b'){
             buffer_print_all();
         }
@@ -0,0 +1,200 @@
+#include <mvcc.hpp>
+
+VersionStore * version_store;
+
+VersionStore::VersionStore() : visible_ts(0), num_versions(0), gc_threshold(VERSION_GC_THRESHOLD) {}
+
+VersionStore::Stripe & VersionStore::stripe_of(int table_id, keyval_t key){
+    return stripes[RIDHasher()(make_pair(table_id, key)) % VERSION_STORE_STRIPES];
+}
+
+uint64_t VersionStore::oldest_snapshot(){
+    return snapshots.empty() ? visible_ts : *snapshots.begin();
+}
+
+bool VersionStore::prune(VersionChain & chain, uint64_t oldest_ts){
+
+    // The newest version is valid until the value in the page was committed
+    uint64_t end_ts = chain.writer != 0 ? UINT64_MAX : chain.latest_ts;
+    size_t keep = 0;
+
+    while (keep < chain.versions.size() && end_ts > oldest_ts){
+        end_ts = chain.versions[keep].begin_ts;
+        keep++;
+    }
+
+    num_versions -= chain.versions.size() - keep;
+    chain.versions.resize(keep);
+
+    return chain.writer == 0 && chain.versions.empty() && chain.latest_ts <= oldest_ts;
+}
+
+uint64_t VersionStore::begin_snapshot(){
+    lock_guard<mutex> guard(ts_latch);
+    snapshots.insert(visible_ts);
+    return visible_ts;
+}
+
+void VersionStore::end_snapshot(uint64_t snapshot_ts){
+
+    unique_lock<mutex> guard(ts_latch);
+    snapshots.erase(snapshots.find(snapshot_ts));
+    guard.unlock();
+
+    if (num_versions >= gc_threshold){
+        collect_garbage();
+    }
+}
+
+void VersionStore::save_version(int trx_id, int table_id, keyval_t key, const char * old_value){
+
+    Stripe & stripe = stripe_of(table_id, key);
+    lock_guard<mutex> guard(stripe.latch);
+
+    VersionChain & chain = stripe.chains[make_pair(table_id, key)];
+    if (chain.writer == trx_id){
+        return;
+    }
+
+    Version version;
+    version.begin_ts = chain.latest_ts;
+    memcpy(version.value, old_value, sizeof(version.value));
+
+    chain.versions.push_front(version);
+    chain.writer = trx_id;
+    num_versions++;
+}
+
+void VersionStore::read_version(int table_id, keyval_t key, uint64_t snapshot_ts, const char * page_value, char * ret_val){
+
+    Stripe & stripe = stripe_of(table_id, key);
+    lock_guard<mutex> guard(stripe.latch);
+
+    auto iter = stripe.chains.find(make_pair(table_id, key));
+
+    if (iter == stripe.chains.end() || (iter->second.writer == 0 && iter->second.latest_ts <= snapshot_ts)){
+        strcpy(ret_val, page_value);
+        return;
+    }
+
+    for (Version & version : iter->second.versions){
+        if (version.begin_ts <= snapshot_ts){
+            strcpy(ret_val, version.value);
+            return;
+        }
+    }
+
+    // Garbage collection keeps every version an active snapshot can see
+    strcpy(ret_val, iter->second.versions.empty() ? page_value : iter->second.versions.back().value);
+}
+
+void VersionStore::read_committed(int table_id, keyval_t key, int trx_id, const char * page_value, char * ret_val){
+
+    Stripe & stripe = stripe_of(table_id, key);
+    lock_guard<mutex> guard(stripe.latch);
+
+    auto iter = stripe.chains.find(make_pair(table_id, key));
+
+    // While a writer's value is in the page, the newest version is the last committed value,
+    // and garbage collection never drops it
+    if (iter == stripe.chains.end() || iter->second.writer == 0 || iter->second.writer == trx_id){
+        strcpy(ret_val, page_value);
+    }
+    else {
+        strcpy(ret_val, iter->second.versions.front().value);
+    }
+}
+
+void VersionStore::commit(Transaction * trx){
+
+    if (trx->undo_log_list.empty()){
+        return;
+    }
+
+    // Commits are published one at a time, so a snapshot taken at visible_ts
+    // sees every commit up to it and none after it
+    lock_guard<mutex> guard(ts_latch);
+
+    uint64_t commit_ts = visible_ts + 1;
+    uint64_t oldest_ts = snapshots.empty() ? commit_ts : *snapshots.begin();
+
+    for (UndoLog & undo : trx->undo_log_list){
+
+        Stripe & stripe = stripe_of(undo.table_id, undo.key);
+        lock_guard<mutex> stripe_guard(stripe.latch);
+
+        auto iter = stripe.chains.find(make_pair(undo.table_id, undo.key));
+        if (iter == stripe.chains.end() || iter->second.writer != trx->trx_id){
+            continue;
+        }
+
+        iter->second.latest_ts = commit_ts;
+        iter->second.writer = 0;
+
+        if (prune(iter->second, oldest_ts)){
+            stripe.chains.erase(iter);
+        }
+    }
+
+    visible_ts = commit_ts;
+}
+
+void VersionStore::abort(Transaction * trx){
+
+    for (UndoLog & undo : trx->undo_log_list){
+
+        Stripe & stripe = stripe_of(undo.table_id, undo.key);
+        lock_guard<mutex> guard(stripe.latch);
+
+        auto iter = stripe.chains.find(make_pair(undo.table_id, undo.key));
+        if (iter == stripe.chains.end() || iter->second.writer != trx->trx_id){
+            continue;
+        }
+
+        // The page holds the saved value again
+        VersionChain & chain = iter->second;
+        chain.latest_ts = chain.versions.front().begin_ts;
+        chain.versions.pop_front();
+        chain.writer = 0;
+        num_versions--;
+    }
+}
+
+void VersionStore::collect_garbage(){
+
+    unique_lock<mutex> guard(ts_latch);
+    uint64_t oldest_ts = oldest_snapshot();
+    guard.unlock();
+
+    for (Stripe & stripe : stripes){
+        lock_guard<mutex> stripe_guard(stripe.latch);
+
+        for (auto iter = stripe.chains.begin(); iter != stripe.chains.end();){
+            if (prune(iter->second, oldest_ts)){
+                iter = stripe.chains.erase(iter);
+            }
+            else {
+                iter++;
+            }
+        }
+    }
+
+    gc_threshold = max((int64_t)VERSION_GC_THRESHOLD, 2 * num_versions.load());
+}
+
+void VersionStore::print_status(){
+
+    size_t num_chains = 0;
+    for (Stripe & stripe : stripes){
+        lock_guard<mutex> guard(stripe.latch);
+        num_chains += stripe.chains.size();
+    }
+
+    lock_guard<mutex> guard(ts_latch);
+
+    printf("<Version store status> ");
+    printf("Visible timestamp: %ld / ", visible_ts);
+    printf("Active snapshots: %ld / ", snapshots.size());
+    printf("Version chains: %ld / ", num_chains);
+    printf("Old versions: %ld\n", num_versions.load());
+}
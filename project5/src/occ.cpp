@@ -0,0 +1,120 @@
+#include <occ.hpp>
+
+RecordVersionTable * record_versions;
+
+RecordVersionTable::RecordVersionTable() : num_readers(0) {}
+
+RecordVersionTable::Stripe & RecordVersionTable::stripe_of(int table_id, keyval_t key){
+    return stripes[RIDHasher()(make_pair(table_id, key)) % RECORD_VERSION_STRIPES];
+}
+
+void RecordVersionTable::begin_reader(){
+    num_readers++;
+}
+
+void RecordVersionTable::end_reader(){
+    if (--num_readers == 0){
+        sweep();
+    }
+}
+
+void RecordVersionTable::sweep(){
+
+    size_t num_entries = 0;
+    for (Stripe & stripe : stripes){
+        lock_guard<mutex> guard(stripe.latch);
+        num_entries += stripe.entries.size();
+    }
+    if (num_entries < RECORD_VERSION_SWEEP_THRESHOLD){
+        return;
+    }
+
+    for (Stripe & stripe : stripes){
+        lock_guard<mutex> guard(stripe.latch);
+
+        // A reader may have started meanwhile
+        if (num_readers > 0){
+            return;
+        }
+
+        for (auto iter = stripe.entries.begin(); iter != stripe.entries.end();){
+            if (iter->second.writer == 0){
+                iter = stripe.entries.erase(iter);
+            }
+            else {
+                iter++;
+            }
+        }
+    }
+}
+
+RecordVersion RecordVersionTable::read(int table_id, keyval_t key){
+
+    Stripe & stripe = stripe_of(table_id, key);
+    lock_guard<mutex> guard(stripe.latch);
+
+    auto iter = stripe.entries.find(make_pair(table_id, key));
+    if (iter == stripe.entries.end()){
+        return RecordVersion{0, 0};
+    }
+    return iter->second;
+}
+
+void RecordVersionTable::lock(int trx_id, int table_id, keyval_t key){
+
+    Stripe & stripe = stripe_of(table_id, key);
+    lock_guard<mutex> guard(stripe.latch);
+
+    // The record lock of trx_id keeps every other writer away
+    stripe.entries[make_pair(table_id, key)].writer = trx_id;
+}
+
+void RecordVersionTable::unlock(int trx_id, int table_id, keyval_t key, bool changed){
+
+    Stripe & stripe = stripe_of(table_id, key);
+    lock_guard<mutex> guard(stripe.latch);
+
+    auto iter = stripe.entries.find(make_pair(table_id, key));
+    if (iter == stripe.entries.end() || iter->second.writer != trx_id){
+        return;
+    }
+
+    if (num_readers == 0){
+        stripe.entries.erase(iter);
+        return;
+    }
+
+    iter->second.writer = 0;
+    if (changed){
+        iter->second.version++;
+    }
+}
+
+bool RecordVersionTable::validate(int trx_id, const ReadSet & read_set){
+
+    for (auto & read_entry : read_set){
+        RecordVersion current = read(read_entry.first.first, read_entry.first.second);
+
+        if (current.version != read_entry.second || (current.writer != 0 && current.writer != trx_id)){
+            return false;
+        }
+    }
+    return true;
+}
+
+void RecordVersionTable::print_status(){
+
+    size_t num_entries = 0, num_locked = 0;
+    for (Stripe & stripe : stripes){
+        lock_guard<mutex> guard(stripe.latch);
+        num_entries += stripe.entries.size();
+        for (auto & entry : stripe.entries){
+            if (entry.second.writer != 0) num_locked++;
+        }
+    }
+
+    printf("<Record version status> ");
+    printf("Optimistic transactions: %d / ", num_readers.load());
+    printf("Entries: %ld / ", num_entries);
+    printf("Marked by a writer: %ld\n", num_locked);
+}
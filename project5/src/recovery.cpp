@@ -0,0 +1,547 @@
+#include <recovery.hpp>
+
+#include <queue>
+
+Checkpointer * checkpointer;
+
+// Page record handed to a redo worker
+struct RedoRecord{
+    LogRecord_t record;
+
+    // table the record applies to in this run
+    int table_id;
+
+    vector<char> new_image;
+};
+
+// Redo worker owning the pages whose hash falls into its partition
+struct RedoWorker{
+
+    mutex latch;
+    condition_variable cond;
+    deque<RedoRecord> queue;
+    bool done;
+
+    uint64_t num_redone;
+    thread worker;
+
+    RedoWorker() : done(false), num_redone(0) {}
+
+    void push(RedoRecord && redo);
+    void finish();
+    void run();
+};
+
+// Table ID of the log mapped to a table ID of this run, starting from lsn
+struct TableMapping{
+    lsn_t lsn;
+    int log_table_id;
+    int table_id;
+};
+
+// Apply the new image of a page record again if the page is older than the record
+static bool redo_record(int table_id, const LogRecord_t & record, const char * new_image){
+
+    bool redone = false;
+    BufferBlock_t * frame = buffer_read_page(table_id, record.page_num);
+    frame->latch.lock();
+
+    if (get_page_lsn(record.page_num, &frame->frame) < record.lsn){
+        Page_t page = frame->frame;
+        memcpy((char *)&page + record.offset, new_image, record.length);
+        set_page_lsn(record.page_num, &page, record.lsn);
+
+        // Nobody owns this thread, so the write is not logged again
+        buffer_write_page(frame, page);
+        buffer_unpin_page(frame, 1);
+        redone = true;
+    }
+
+    frame->latch.unlock();
+    buffer_unpin_page(frame, 1);
+
+    return redone;
+}
+
+void RedoWorker::push(RedoRecord && redo){
+    unique_lock<mutex> guard(latch);
+    cond.wait(guard, [&]{ return queue.size() < REDO_QUEUE_CAPACITY; });
+
+    queue.push_back(move(redo));
+    cond.notify_all();
+}
+
+void RedoWorker::finish(){
+    unique_lock<mutex> guard(latch);
+    done = true;
+    cond.notify_all();
+    guard.unlock();
+
+    worker.join();
+}
+
+void RedoWorker::run(){
+
+    unique_lock<mutex> guard(latch);
+
+    while (true){
+        cond.wait(guard, [&]{ return done || !queue.empty(); });
+        if (queue.empty()) break;
+
+        RedoRecord redo = move(queue.front());
+        queue.pop_front();
+        cond.notify_all();
+
+        guard.unlock();
+        if (redo_record(redo.table_id, redo.record, redo.new_image.data())){
+            num_redone++;
+        }
+        guard.lock();
+    }
+}
+
+// Table ID of this run the record at lsn refers to, or 0 if its file is gone
+static int table_at(const vector<TableMapping> & mappings, lsn_t lsn, int log_table_id){
+
+    const TableMapping * latest = nullptr;
+
+    for (auto & mapping : mappings){
+        if (mapping.lsn < lsn && mapping.log_table_id == log_table_id
+            && (latest == nullptr || mapping.lsn > latest->lsn)){
+            latest = &mapping;
+        }
+    }
+
+    return latest != nullptr ? latest->table_id : 0;
+}
+
+// Open the file named by an OPEN record, unless it has been opened already
+static int reopen_table(map<string, int> & opened, const char * pathname){
+
+    auto iter = opened.find(pathname);
+    if (iter != opened.end()){
+        return iter->second;
+    }
+
+    // A file removed since then has nothing left to recover
+    int table_id = 0;
+    if (access(pathname, F_OK) == 0){
+        table_id = open_table((char *)pathname);
+        if (table_id < 0){
+            return FAILURE;
+        }
+    }
+
+    opened[pathname] = table_id;
+    return table_id;
+}
+
+// Roll a page record of an unfinished operation back
+// Records of transactions are undone logically by key, since the record may have
+// moved to another page since then, and the records of system operations physically
+static void undo_record(int table_id, const LogRecord_t & record, const char * old_image, lsn_t * last_lsn){
+
+    LogScope scope(record.trx_id, LogType::COMPENSATE, last_lsn, record.key, record.prev_lsn);
+
+    if (record.type == LogType::UPDATE){
+        int base = offsetof(NodePage_t, lf_record);
+        int offset = (record.offset - base) % sizeof(LeafRecord) - offsetof(LeafRecord, value);
+
+        undo_update(table_id, record.key, offset, old_image, record.length);
+        return;
+    }
+
+    BufferBlock_t * frame = buffer_read_page(table_id, record.page_num);
+    frame->latch.lock();
+
+    Page_t page = frame->frame;
+    memcpy((char *)&page + record.offset, old_image, record.length);
+    buffer_write_page(frame, page);
+    buffer_unpin_page(frame, 1);
+
+    frame->latch.unlock();
+    buffer_unpin_page(frame, 1);
+}
+
+int recover_db(int num_threads, RecoveryStat * stat){
+
+    LogRecord_t record;
+    vector<char> images;
+
+    vector<TableMapping> mappings;
+    map<string, int> opened;
+
+    // unfinished transaction or system operation -> its last LSN
+    map<int, lsn_t> losers;
+
+    // dirty page table of the last checkpoint
+    map<pair<int, Pagenum_t>, lsn_t> dirty_pages;
+
+    int result = SUCCESS;
+    memset(stat, 0, sizeof(RecoveryStat));
+    stat->num_threads = num_threads;
+
+    vector<RedoWorker> workers(num_threads);
+    for (auto & worker : workers){
+        worker.worker = thread(&RedoWorker::run, &worker);
+    }
+
+    // The last checkpoint gives the state of the tables as of its begin LSN
+    lsn_t start_lsn = log_manager->get_start_lsn(), end_lsn = log_manager->get_flushed_lsn();
+    lsn_t begin_lsn = start_lsn, redo_lsn = start_lsn;
+    lsn_t checkpoint_lsn = log_manager->get_checkpoint_lsn();
+
+    if (checkpoint_lsn != NO_LSN && log_manager->read_record(checkpoint_lsn, record, images)){
+
+        const char * payload = images.data() + record.length;
+        CheckpointHeader_t header;
+        memcpy(&header, payload, sizeof(header));
+        payload += sizeof(header);
+
+        begin_lsn = redo_lsn = header.begin_lsn;
+
+        for (int i = 0; i < header.num_tables; i++, payload += sizeof(CheckpointTable_t)){
+            CheckpointTable_t table;
+            memcpy(&table, payload, sizeof(table));
+
+            int table_id = reopen_table(opened, table.pathname);
+            if (table_id < 0){
+                result = FAILURE;
+                table_id = 0;
+            }
+            mappings.push_back({table.open_lsn, table.table_id, table_id});
+        }
+
+        for (int i = 0; i < header.num_dirty_pages; i++, payload += sizeof(DirtyPage_t)){
+            DirtyPage_t page;
+            memcpy(&page, payload, sizeof(page));
+
+            dirty_pages[{page.table_id, page.page_num}] = page.rec_lsn;
+            redo_lsn = min(redo_lsn, page.rec_lsn);
+        }
+
+        for (int i = 0; i < header.num_active_trx; i++, payload += sizeof(ActiveTrx_t)){
+            ActiveTrx_t trx;
+            memcpy(&trx, payload, sizeof(trx));
+
+            losers[trx.trx_id] = trx.last_lsn;
+        }
+    }
+
+    // Analysis and redo
+    lsn_t lsn = max(redo_lsn, start_lsn);
+
+    while (lsn < end_lsn && log_manager->read_record(lsn, record, images)){
+
+        stat->num_records++;
+        lsn += record.size;
+
+        if (record.type == LogType::CHECKPOINT){
+            continue;
+        }
+
+        if (record.type == LogType::OPEN){
+            int table_id = reopen_table(opened, images.data() + record.length);
+            if (table_id < 0){
+                result = FAILURE;
+                table_id = 0;
+            }
+            mappings.push_back({record.lsn, record.table_id, table_id});
+            continue;
+        }
+
+        // The checkpoint knows the transactions as of begin_lsn
+        if (record.trx_id != 0 && record.lsn >= begin_lsn){
+            if (record.type == LogType::COMMIT || record.type == LogType::ROLLBACK){
+                losers.erase(record.trx_id);
+            }
+            else {
+                losers[record.trx_id] = record.lsn;
+            }
+        }
+
+        if (record.length == 0){
+            continue;
+        }
+
+        int table_id = table_at(mappings, record.lsn, record.table_id);
+        if (table_id == 0){
+            continue;
+        }
+
+        // Older records only matter for the pages the checkpoint found dirty
+        if (record.lsn < begin_lsn){
+            auto iter = dirty_pages.find({record.table_id, record.page_num});
+            if (iter == dirty_pages.end() || record.lsn < iter->second){
+                continue;
+            }
+        }
+
+        RedoRecord redo;
+        redo.record = record;
+        redo.table_id = table_id;
+        redo.new_image.assign(images.begin() + record.length, images.end());
+
+        size_t partition = (record.page_num * 31 + table_id) % num_threads;
+        workers[partition].push(move(redo));
+    }
+
+    for (auto & worker : workers){
+        worker.finish();
+        stat->num_redone += worker.num_redone;
+    }
+
+    // Undo, always taking the newest record left over all losers
+    priority_queue<pair<lsn_t, int>> undo_queue;
+    stat->num_losers = losers.size();
+
+    for (auto & loser : losers){
+        undo_queue.push({loser.second, loser.first});
+    }
+
+    while (!undo_queue.empty()){
+
+        int trx_id = undo_queue.top().second;
+        lsn = undo_queue.top().first;
+        undo_queue.pop();
+
+        lsn_t next_lsn = NO_LSN;
+
+        if (log_manager->read_record(lsn, record, images)){
+            if (record.type == LogType::COMPENSATE){
+                // Everything after undo_next_lsn has been rolled back before
+                next_lsn = record.undo_next_lsn;
+            }
+            else {
+                int table_id = table_at(mappings, record.lsn, record.table_id);
+                if (record.length > 0 && table_id != 0){
+                    undo_record(table_id, record, images.data(), &losers[trx_id]);
+                    stat->num_undone++;
+                }
+                next_lsn = record.prev_lsn;
+            }
+        }
+
+        if (next_lsn != NO_LSN){
+            undo_queue.push({next_lsn, trx_id});
+        }
+        else {
+            log_trx_record(trx_id, LogType::ROLLBACK, losers[trx_id]);
+        }
+    }
+
+    // A B-link split is logged one level at a time, so a crash may have cut one short
+    // between levels; the tree is still whole, but the parent lacks the new node
+    for (auto & table : opened){
+        if (table.second > 0){
+            finish_splits(table.second);
+        }
+    }
+
+    // Closing the tables writes every recovered page, forcing the log up to it
+    for (auto & table : opened){
+        if (table.second > 0){
+            close_table(table.second);
+        }
+    }
+
+    lsn_t last_lsn = log_manager->get_next_lsn();
+    if (last_lsn > log_manager->get_flushed_lsn() && log_manager->flush(last_lsn - 1) != SUCCESS){
+        result = FAILURE;
+    }
+
+    return result;
+}
+
+Checkpointer::Checkpointer(int interval_ms, uint64_t interval_bytes)
+    : terminate(false), interval_ms(interval_ms), interval_bytes(interval_bytes) {
+
+    memset(&stat, 0, sizeof(stat));
+    stat.begin_lsn = log_manager->get_next_lsn();
+    idle_lsn = NO_LSN;
+
+    worker = thread(&Checkpointer::run, this);
+}
+
+Checkpointer::~Checkpointer(){
+
+    unique_lock<mutex> guard(wait_latch);
+    terminate = true;
+    cond.notify_one();
+    guard.unlock();
+
+    worker.join();
+}
+
+void Checkpointer::set_interval(int interval_ms, uint64_t interval_bytes){
+    lock_guard<mutex> guard(wait_latch);
+    this->interval_ms = interval_ms;
+    this->interval_bytes = interval_bytes;
+}
+
+// Body of the checkpoint thread
+void Checkpointer::run(){
+
+    unique_lock<mutex> guard(wait_latch);
+    auto last_time = chrono::steady_clock::now();
+
+    while (!terminate){
+
+        cond.wait_for(guard, chrono::milliseconds(CHECKPOINT_POLL_MS));
+        if (terminate) break;
+
+        auto now = chrono::steady_clock::now();
+        lsn_t next_lsn = log_manager->get_next_lsn();
+
+        bool time_due = interval_ms > 0 && now - last_time >= chrono::milliseconds(interval_ms);
+        bool bytes_due = interval_bytes > 0 && next_lsn - stat.begin_lsn >= interval_bytes;
+
+        if (time_due){
+            last_time = now;
+        }
+
+        // Skip it if nothing has been logged since the last checkpoint
+        if (!(time_due || bytes_due) || next_lsn == idle_lsn){
+            continue;
+        }
+
+        guard.unlock();
+        checkpoint();
+        guard.lock();
+
+        last_time = chrono::steady_clock::now();
+    }
+}
+
+int Checkpointer::checkpoint(){
+
+    lock_guard<mutex> guard(latch);
+
+    auto start_time = chrono::steady_clock::now();
+
+    vector<ActiveTrx_t> active_trx;
+    vector<DirtyPage_t> dirty_pages;
+    vector<CheckpointTable_t> opened;
+
+    // Page cleaner: write the pages dirty since before the previous checkpoint.
+    // The log is forced once here instead of page by page.
+    lsn_t next_lsn = log_manager->get_next_lsn();
+    if (next_lsn > log_manager->get_flushed_lsn() && log_manager->flush(next_lsn - 1) != SUCCESS){
+        return FAILURE;
+    }
+    int num_cleaned = buffer->clean_pages(stat.begin_lsn);
+
+    // The active transaction table is exact as of begin_lsn. The dirty page table is
+    // collected after it, and a page written in between has a log record after begin_lsn.
+    lsn_t begin_lsn = log_manager->get_active_trx(active_trx);
+    buffer->get_dirty_pages(dirty_pages);
+
+    tables.latch.lock();
+    for (int i = 1; i <= MAX_TABLE_NUMBER; i++){
+        if (tables.in_use[i]){
+            CheckpointTable_t table;
+            memset(&table, 0, sizeof(table));
+
+            table.table_id = i;
+            table.open_lsn = tables.open_lsn[i];
+            strncpy(table.pathname, tables.pathname[i], sizeof(table.pathname) - 1);
+            opened.push_back(table);
+        }
+    }
+    tables.latch.unlock();
+
+    CheckpointHeader_t header;
+    memset(&header, 0, sizeof(header));
+    header.begin_lsn = begin_lsn;
+    header.num_tables = opened.size();
+    header.num_dirty_pages = dirty_pages.size();
+    header.num_active_trx = active_trx.size();
+
+    vector<char> payload(sizeof(header));
+    memcpy(payload.data(), &header, sizeof(header));
+    payload.insert(payload.end(), (char *)opened.data(), (char *)(opened.data() + opened.size()));
+    payload.insert(payload.end(), (char *)dirty_pages.data(), (char *)(dirty_pages.data() + dirty_pages.size()));
+    payload.insert(payload.end(), (char *)active_trx.data(), (char *)(active_trx.data() + active_trx.size()));
+
+    // The log is cut only behind a checkpoint record that is known to be durable
+    lsn_t checkpoint_lsn = log_checkpoint(payload.data(), payload.size());
+    if (checkpoint_lsn == NO_LSN || log_manager->flush(checkpoint_lsn) != SUCCESS){
+        return FAILURE;
+    }
+
+    // Redo starts from the oldest dirty page, and undo may need
+    // every record of the active transactions
+    lsn_t redo_lsn = begin_lsn, start_lsn;
+    for (auto & page : dirty_pages){
+        redo_lsn = min(redo_lsn, page.rec_lsn);
+    }
+    start_lsn = redo_lsn;
+    for (auto & trx : active_trx){
+        start_lsn = min(start_lsn, trx.first_lsn);
+    }
+
+    if (log_manager->set_checkpoint(checkpoint_lsn, start_lsn) != SUCCESS){
+        return FAILURE;
+    }
+
+    double duration = chrono::duration<double, milli>(chrono::steady_clock::now() - start_time).count();
+    redo_lsn = max(redo_lsn, log_manager->get_start_lsn());
+
+    lock_guard<mutex> wait_guard(wait_latch);
+
+    stat.num_checkpoints++;
+    stat.checkpoint_lsn = checkpoint_lsn;
+    stat.begin_lsn = begin_lsn;
+    stat.redo_lsn = redo_lsn;
+    stat.start_lsn = log_manager->get_start_lsn();
+    stat.num_cleaned_pages = num_cleaned;
+    stat.num_dirty_pages = dirty_pages.size();
+    stat.num_active_trx = active_trx.size();
+    stat.duration_ms = duration;
+    idle_lsn = log_manager->get_next_lsn();
+    stat.recovery_estimate_ms = (double)(idle_lsn - redo_lsn) * 1000 / ESTIMATED_LOG_SCAN_RATE
+        + dirty_pages.size() * ESTIMATED_PAGE_READ_MS;
+
+    return SUCCESS;
+}
+
+CheckpointStat Checkpointer::get_stat(){
+    lock_guard<mutex> guard(wait_latch);
+    return stat;
+}
+
+int set_checkpoint_interval(int interval_ms, uint64_t interval_bytes){
+
+    if (checkpointer == nullptr || interval_ms < 0){
+        return FAILURE;
+    }
+
+    checkpointer->set_interval(interval_ms, interval_bytes);
+    return SUCCESS;
+}
+
+int take_checkpoint(){
+
+    if (checkpointer == nullptr){
+        return FAILURE;
+    }
+
+    return checkpointer->checkpoint();
+}
+
+void print_checkpoint_status(){
+
+    CheckpointStat stat = checkpointer->get_stat();
+
+    printf("<Checkpoint status> ");
+    printf("Checkpoints: %ld / ", stat.num_checkpoints);
+    printf("Last LSN: %ld / ", stat.checkpoint_lsn);
+    printf("Duration: %.3f ms / ", stat.duration_ms);
+    printf("Cleaned pages: %d / ", stat.num_cleaned_pages);
+    printf("Dirty pages: %d / ", stat.num_dirty_pages);
+    printf("Active transactions: %d\n", stat.num_active_trx);
+    printf("<Recovery estimate> ");
+    printf("Redo from LSN: %ld / ", stat.redo_lsn);
+    printf("Log kept from LSN: %ld / ", stat.start_lsn);
+    printf("Estimated time: %.3f ms\n", stat.recovery_estimate_ms);
+}
@@ -0,0 +1,233 @@
+#include <sink.hpp>
+
+#include <cerrno>
+
+// "00" to "99", for formatting integers two digits at a time
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Longest formatted int64_t: sign and 19 digits
+#define MAX_INT_LENGTH 20
+
+OutputSink::OutputSink(const char * pathname, size_t buffer_size, int flags)
+    : fd(-1), flags(flags), direct(false), failed(false), buffer(NULL), capacity(0), size(0), bytes_written(0) {
+
+    if (flags & SINK_DIRECT){
+        fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        direct = fd >= 0;
+    }
+    if (fd < 0){
+        fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0){
+        failed = true;
+        return;
+    }
+
+    if (direct){
+        // Whole blocks, and at least two so a flush always leaves room for a row
+        capacity = (buffer_size + SINK_DIRECT_ALIGNMENT - 1) / SINK_DIRECT_ALIGNMENT * SINK_DIRECT_ALIGNMENT;
+        if (capacity < 2 * SINK_DIRECT_ALIGNMENT) capacity = 2 * SINK_DIRECT_ALIGNMENT;
+
+        void * aligned;
+        buffer = posix_memalign(&aligned, SINK_DIRECT_ALIGNMENT, capacity) == 0 ? (char *)aligned : NULL;
+    }
+    else{
+        capacity = buffer_size < 2 * MAX_INT_LENGTH ? 2 * MAX_INT_LENGTH : buffer_size;
+        buffer = (char *)malloc(capacity);
+    }
+
+    if (buffer == NULL){
+        failed = true;
+    }
+}
+
+OutputSink::~OutputSink(){
+    close();
+    free(buffer);
+}
+
+int OutputSink::write_fully(const char * data, size_t length){
+
+    while (length > 0){
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0){
+            if (errno == EINTR) continue;
+            failed = true;
+            return FAILURE;
+        }
+        data += written;
+        length -= written;
+    }
+    return SUCCESS;
+}
+
+int OutputSink::writev_fully(struct iovec * iov, int iovcnt){
+
+    while (iovcnt > 0){
+        ssize_t written = ::writev(fd, iov, iovcnt);
+        if (written < 0){
+            if (errno == EINTR) continue;
+            failed = true;
+            return FAILURE;
+        }
+
+        // Skip what went out and retry the rest
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len){
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0){
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return SUCCESS;
+}
+
+int OutputSink::flush_buffer(){
+
+    if (failed) {
+        size = 0;
+        return FAILURE;
+    }
+
+    size_t length = direct ? size / SINK_DIRECT_ALIGNMENT * SINK_DIRECT_ALIGNMENT : size;
+    if (length == 0){
+        return SUCCESS;
+    }
+
+    if (write_fully(buffer, length) != SUCCESS){
+        size = 0;
+        return FAILURE;
+    }
+
+    bytes_written += length;
+    size -= length;
+    if (size > 0){
+        memmove(buffer, buffer + length, size);
+    }
+    return SUCCESS;
+}
+
+void OutputSink::write(const char * data, size_t length){
+
+    if (length <= capacity - size){
+        memcpy(buffer + size, data, length);
+        size += length;
+        return;
+    }
+
+    // Large slice: send it along with the buffer rather than copying it
+    if (!direct && !failed && length >= capacity / 2){
+        struct iovec iov[2];
+        iov[0].iov_base = buffer;
+        iov[0].iov_len = size;
+        iov[1].iov_base = (void *)data;
+        iov[1].iov_len = length;
+
+        if (writev_fully(iov, 2) == SUCCESS){
+            bytes_written += size + length;
+        }
+        size = 0;
+        return;
+    }
+
+    while (length > 0){
+        if (size == capacity && flush_buffer() != SUCCESS){
+            return;
+        }
+        size_t chunk = length < capacity - size ? length : capacity - size;
+        memcpy(buffer + size, data, chunk);
+        size += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+void OutputSink::write_int(int64_t value){
+
+    if (capacity - size < MAX_INT_LENGTH){
+        flush_buffer();
+    }
+
+    char digits[MAX_INT_LENGTH];
+    char * end = digits + MAX_INT_LENGTH;
+    char * p = end;
+
+    // Negate in unsigned arithmetic so that INT64_MIN works too
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+
+    while (magnitude >= 100){
+        const char * pair = digit_pairs + (magnitude % 100) * 2;
+        magnitude /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (magnitude >= 10){
+        const char * pair = digit_pairs + magnitude * 2;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    else{
+        *--p = '0' + magnitude;
+    }
+    if (value < 0){
+        *--p = '-';
+    }
+
+    memcpy(buffer + size, p, end - p);
+    size += end - p;
+}
+
+int OutputSink::finish_direct(){
+
+    flush_buffer();
+    if (failed || size == 0){
+        return failed ? FAILURE : SUCCESS;
+    }
+
+    // The tail is not a whole block, so it goes through the page cache
+    int fl = fcntl(fd, F_GETFL);
+    if (fl < 0 || fcntl(fd, F_SETFL, fl & ~O_DIRECT) < 0){
+        failed = true;
+        return FAILURE;
+    }
+    direct = false;
+    return flush_buffer();
+}
+
+int OutputSink::close(){
+
+    if (fd < 0){
+        return FAILURE;
+    }
+
+    if (direct){
+        finish_direct();
+    }
+    else{
+        flush_buffer();
+    }
+
+    if (!failed && (flags & SINK_SYNC) && fdatasync(fd) < 0){
+        failed = true;
+    }
+
+    if (::close(fd) < 0){
+        failed = true;
+    }
+    fd = -1;
+
+    return failed ? FAILURE : SUCCESS;
+}
@@ -1,22 +1,84 @@
 #include <transaction.hpp>
+#include <recovery.hpp>
+#include <mvcc.hpp>
+#include <occ.hpp>
+#include <bloom.hpp>
 
 TransactionManager::TransactionManager(){
     next_trx_id = 1;
-    current_id = 1;
 }
 
-LockManager::LockManager(){
+TransactionManager::~TransactionManager(){
+    for (auto & stripe : stripes){
+        for (auto & entry : stripe.trx_table){
+            delete entry.second;
+        }
+    }
+}
+
+LockManager::LockManager() : global_stat() {
 }
 
 
-Lock::Lock() : table_id(0), page_num(0), lock_mode(LockMode::SHARED) {}
-Lock::Lock(int table_id, Pagenum_t page_num, LockMode lock_mode) : table_id(table_id), page_num(page_num), lock_mode(lock_mode) {}
+Lock::Lock() : table_id(0), trx(nullptr), is_table_lock(false), page_num(0), key(0), acquired(false), lock_mode(LockMode::SHARED), prev(nullptr), next(nullptr) {}
+Lock::Lock(int table_id, Pagenum_t page_num, keyval_t key, LockMode lock_mode, Transaction* trx)
+    : table_id(table_id), trx(trx), is_table_lock(false), page_num(page_num), key(key), acquired(false), lock_mode(lock_mode), prev(nullptr), next(nullptr) {}
+Lock::Lock(int table_id, LockMode lock_mode, Transaction* trx)
+    : table_id(table_id), trx(trx), is_table_lock(true), page_num(0), key(0), acquired(false), lock_mode(lock_mode), prev(nullptr), next(nullptr) {}
+
+UndoLog::UndoLog(int table_id, keyval_t key, const char * old_value, lsn_t prev_lsn)
+    : table_id(table_id), key(key), prev_lsn(prev_lsn) {
+    memcpy(this->old_value, old_value, sizeof(this->old_value));
+}
 
 LockManager * lock_manager;
 TransactionManager * trx_manager;
 
+int lock_escalation_threshold = DEFAULT_LOCK_ESCALATION_THRESHOLD;
+int lock_wait_timeout_ms = DEFAULT_LOCK_WAIT_TIMEOUT_MS;
+
+EarlyReleaseTable * early_releases;
+bool early_lock_release = true;
+
+#define NUM_LOCK_MODES 5
+
+// Whether locks in the two modes may be held on the same table or record by different transactions
+static const bool lock_compatible[NUM_LOCK_MODES][NUM_LOCK_MODES] = {
+    //          IS     IX     S      SIX    X
+    /* IS  */ { true,  true,  true,  true,  false },
+    /* IX  */ { true,  true,  false, false, false },
+    /* S   */ { true,  false, true,  false, false },
+    /* SIX */ { true,  false, false, false, false },
+    /* X   */ { false, false, false, false, false },
+};
+
+// Weakest mode that is at least as strong as both modes
+static const LockMode lock_supremum[NUM_LOCK_MODES][NUM_LOCK_MODES] = {
+    /* IS  */ { LockMode::INTENTION_SHARED, LockMode::INTENTION_EXCLUSIVE, LockMode::SHARED,
+                LockMode::SHARED_INTENTION_EXCLUSIVE, LockMode::EXCLUSIVE },
+    /* IX  */ { LockMode::INTENTION_EXCLUSIVE, LockMode::INTENTION_EXCLUSIVE, LockMode::SHARED_INTENTION_EXCLUSIVE,
+                LockMode::SHARED_INTENTION_EXCLUSIVE, LockMode::EXCLUSIVE },
+    /* S   */ { LockMode::SHARED, LockMode::SHARED_INTENTION_EXCLUSIVE, LockMode::SHARED,
+                LockMode::SHARED_INTENTION_EXCLUSIVE, LockMode::EXCLUSIVE },
+    /* SIX */ { LockMode::SHARED_INTENTION_EXCLUSIVE, LockMode::SHARED_INTENTION_EXCLUSIVE, LockMode::SHARED_INTENTION_EXCLUSIVE,
+                LockMode::SHARED_INTENTION_EXCLUSIVE, LockMode::EXCLUSIVE },
+    /* X   */ { LockMode::EXCLUSIVE, LockMode::EXCLUSIVE, LockMode::EXCLUSIVE,
+                LockMode::EXCLUSIVE, LockMode::EXCLUSIVE },
+};
+
+static LockMode supremum(LockMode mode, LockMode other){
+    return lock_supremum[(int)mode][(int)other];
+}
+
+// Whether a lock held in mode held grants everything a lock in mode does
+static bool covers(LockMode held, LockMode mode){
+    return supremum(held, mode) == held;
+}
+
 void Transaction::unlock_all(){
 
+    lock_manager->release_all(this);
+
     trx_mutex.lock();
 
     auto iter = acquired_locks.begin();
@@ -30,109 +92,934 @@ void Transaction::unlock_all(){
 
 }
 
-Transaction* TransactionManager::add_new_trx(){
+TransactionManager::Stripe & TransactionManager::get_stripe(int trx_id){
+    return stripes[(unsigned int)trx_id % TRX_TABLE_STRIPES];
+}
 
-    trx_manager_mutex.lock();
+Transaction* TransactionManager::add_new_trx(){
 
-    Transaction *trx = new Transaction(next_trx_id++);
+    // The transaction is built before it is published, outside of any latch
+    Transaction *trx = new Transaction(next_trx_id.fetch_add(1, memory_order_relaxed));
     trx->is_working = true;
-    trx_table.push_back(trx);
+    trx->trx_state = TransactionState::RUNNING;
+
+    Stripe & stripe = get_stripe(trx->trx_id);
+
+    stripe.latch.lock();
+    stripe.trx_table[trx->trx_id] = trx;
+    stripe.latch.unlock();
+
+    return trx;
+}
+
+Transaction* TransactionManager::get_trx(int trx_id){
 
-    trx_manager_mutex.unlock();
+    Transaction * trx = nullptr;
+    Stripe & stripe = get_stripe(trx_id);
+
+    stripe.latch.lock();
+
+    auto iter = stripe.trx_table.find(trx_id);
+    if (iter != stripe.trx_table.end()){
+        trx = iter->second;
+    }
+
+    stripe.latch.unlock();
 
     return trx;
 }
 
 bool TransactionManager::clear_trx(int trx_id){
-    
-    trx_manager_mutex.lock();
-
-    for(auto iter = trx_table.begin(); iter != trx_table.end(); iter++){
-        if((*iter)->trx_id == trx_id){
-            Transaction * trx = (*iter);
-            trx->is_working = false;
-            current_id++;
-            trx->trx_mutex.unlock();
+
+    Transaction * trx = nullptr;
+    Stripe & stripe = get_stripe(trx_id);
+
+    stripe.latch.lock();
+
+    auto iter = stripe.trx_table.find(trx_id);
+    if (iter != stripe.trx_table.end()){
+        trx = iter->second;
+        trx->is_working = false;
+        stripe.trx_table.erase(iter);
+    }
+
+    stripe.latch.unlock();
+
+    if (trx == nullptr){
+        return false;
+    }
+
+    delete trx;
+    return true;
+}
+
+bool TransactionManager::get_lock_stat(int trx_id, LockStat * stat){
+
+    Stripe & stripe = get_stripe(trx_id);
+    lock_guard<mutex> guard(stripe.latch);
+
+    auto iter = stripe.trx_table.find(trx_id);
+    if (iter == stripe.trx_table.end()){
+        return false;
+    }
+
+    lock_manager->get_stat(iter->second, stat);
+    return true;
+}
+
+// Lock list of the table or record that lock is on, or nullptr if there is none
+LockList * LockManager::find_lock_list(Lock * lock){
+
+    if (lock->is_table_lock){
+        auto iter = table_lock_table.find(lock->table_id);
+        return iter == table_lock_table.end() ? nullptr : &iter->second;
+    }
+
+    auto iter = lock_table.find(make_pair(lock->table_id, lock->key));
+    return iter == lock_table.end() ? nullptr : &iter->second;
+}
+
+// Two locks of different transactions conflict unless their modes are compatible
+bool LockManager::conflicts(Lock * lock, Lock * other){
+    return other->trx != lock->trx
+        && !lock_compatible[(int)lock->lock_mode][(int)other->lock_mode];
+}
+
+// Whether the transaction of lock already holds a granted lock ahead of it (lock upgrade)
+bool LockManager::is_upgrade(Lock * lock){
+    for (Lock * other = lock->prev; other != nullptr; other = other->prev){
+        if (other->trx == lock->trx && other->acquired){
             return true;
         }
     }
+    return false;
+}
+
+// Whether lock has to wait for other in the same lock list
+// Granted locks are waited for wherever they are, since an upgrade is granted past waiting locks.
+// Waiting locks are waited for only when they are ahead, and never by an upgrading transaction.
+bool LockManager::waits_for(Lock * lock, Lock * other, bool upgrade, bool ahead){
+    if (!other->acquired && (upgrade || !ahead)){
+        return false;
+    }
+    return conflicts(lock, other);
+}
+
+// A lock is granted when it doesn't wait for any other lock on the record
+bool LockManager::is_grantable(Lock * lock){
+
+    bool upgrade = is_upgrade(lock);
+
+    for (Lock * other = lock->prev; other != nullptr; other = other->prev){
+        if (waits_for(lock, other, upgrade, true)) return false;
+    }
+    for (Lock * other = lock->next; other != nullptr; other = other->next){
+        if (waits_for(lock, other, upgrade, false)) return false;
+    }
+    return true;
+}
 
-    trx_manager_mutex.unlock();
+// Follow the wait-for graph from trx, whose wait_lock is already set
+// Return true if it leads back to trx
+bool LockManager::detect_deadlock(Transaction * trx){
 
+    stack<Transaction *> pending;
+    unordered_map<int, bool> visited;
+
+    pending.push(trx);
+
+    while (!pending.empty()){
+
+        Transaction * waiter = pending.top();
+        pending.pop();
+
+        Lock * wait_lock = waiter->wait_lock;
+        if (wait_lock == nullptr) continue;
+
+        bool upgrade = is_upgrade(wait_lock);
+
+        for (int ahead = 1; ahead >= 0; ahead--){
+            for (Lock * other = ahead ? wait_lock->prev : wait_lock->next; other != nullptr; other = ahead ? other->prev : other->next){
+                if (!waits_for(wait_lock, other, upgrade, ahead)) continue;
+
+                if (other->trx == trx) return true;
+
+                if (!visited[other->trx->trx_id]){
+                    visited[other->trx->trx_id] = true;
+                    pending.push(other->trx);
+                }
+            }
+        }
+    }
     return false;
 }
 
+void LockManager::append_lock(Lock * lock){
+
+    auto & entry = lock->is_table_lock ? table_lock_table[lock->table_id]
+        : lock_table[make_pair(lock->table_id, lock->key)];
+
+    if (entry.second == nullptr){
+        entry.first = entry.second = lock;
+    }
+    else {
+        lock->prev = entry.second;
+        entry.second->next = lock;
+        entry.second = lock;
+    }
+}
+
+void LockManager::remove_lock(Lock * lock){
+
+    auto & entry = *find_lock_list(lock);
+
+    if (lock->prev) lock->prev->next = lock->next;
+    else entry.first = lock->next;
+
+    if (lock->next) lock->next->prev = lock->prev;
+    else entry.second = lock->prev;
+
+    // Any waiting transaction on the record may be granted now
+    for (Lock * other = entry.first; other != nullptr; other = other->next){
+        if (!other->acquired){
+            other->trx->trx_cond.notify_one();
+        }
+    }
+
+    lock->prev = lock->next = nullptr;
+
+    if (entry.first == nullptr){
+        if (lock->is_table_lock) table_lock_table.erase(lock->table_id);
+        else lock_table.erase(make_pair(lock->table_id, lock->key));
+    }
+}
+
+// Count a lock request of trx that waited for wait_ns
+static void count_wait(LockStat & stat, uint64_t wait_ns){
+    stat.num_waits++;
+    stat.total_wait_ns += wait_ns;
+    stat.max_wait_ns = max(stat.max_wait_ns, wait_ns);
+}
+
+int LockManager::grant(Transaction * trx, Lock * lock, unique_lock<mutex> & guard, bool wait){
+
+    append_lock(lock);
+
+    auto wait_start = chrono::steady_clock::now();
+    auto deadline = wait_start + chrono::milliseconds(lock_wait_timeout_ms);
+    bool waited = false;
+
+    while (!is_grantable(lock)){
+
+        trx->wait_lock = lock;
+
+        bool deadlock = wait && detect_deadlock(trx);
+        bool timeout = wait && !deadlock && lock_wait_timeout_ms > 0 && chrono::steady_clock::now() >= deadline;
+
+        if (!wait || deadlock || timeout){
+            trx->wait_lock = nullptr;
+            trx->trx_state = TransactionState::RUNNING;
+            remove_lock(lock);
+            delete lock;
+
+            if (waited){
+                uint64_t wait_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - wait_start).count();
+                count_wait(trx->lock_stat, wait_ns);
+                count_wait(global_stat, wait_ns);
+            }
+            if (deadlock){
+                trx->lock_stat.num_deadlocks++;
+                global_stat.num_deadlocks++;
+            }
+            if (timeout){
+                trx->lock_stat.num_timeouts++;
+                global_stat.num_timeouts++;
+            }
+            return FAILURE;
+        }
+
+        waited = true;
+        trx->trx_state = TransactionState::WAITING;
+
+        if (lock_wait_timeout_ms > 0) trx->trx_cond.wait_until(guard, deadline);
+        else trx->trx_cond.wait(guard);
+    }
+
+    lock->acquired = true;
+    trx->wait_lock = nullptr;
+    trx->trx_state = TransactionState::RUNNING;
+
+    if (waited){
+        uint64_t wait_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - wait_start).count();
+        count_wait(trx->lock_stat, wait_ns);
+        count_wait(global_stat, wait_ns);
+    }
+    trx->lock_stat.num_acquired++;
+    global_stat.num_acquired++;
+
+    if (lock->is_table_lock){
+        trx->table_locks[lock->table_id] = lock;
+    }
+    else {
+        trx->num_record_locks[lock->table_id]++;
+    }
+
+    trx->trx_mutex.lock();
+    trx->acquired_locks.push_back(lock);
+    trx->trx_mutex.unlock();
+
+    return SUCCESS;
+}
+
+// Lock the table for trx in at least the given mode
+// A transaction converting its table lock asks for the supremum of both modes, which is
+// granted past the waiting locks like a record lock upgrade
+int LockManager::convert_table_lock(Transaction * trx, int table_id, LockMode mode, unique_lock<mutex> & guard, bool wait){
+
+    Lock * held = trx->table_locks[table_id];
+
+    if (held != nullptr){
+        if (covers(held->lock_mode, mode)){
+            return SUCCESS;
+        }
+        mode = supremum(held->lock_mode, mode);
+    }
+
+    return grant(trx, new Lock(table_id, mode, trx), guard, wait);
+}
+
+// Replace the record locks of trx in the table with a table lock, if there are too many of them
+// Escalation never waits: if the table lock can't be granted at once, it is tried again
+// with the next record lock
+void LockManager::escalate(Transaction * trx, int table_id, unique_lock<mutex> & guard){
+
+    if (lock_escalation_threshold <= 0 || trx->num_record_locks[table_id] <= lock_escalation_threshold){
+        return;
+    }
+
+    // Shared record locks only come under an INTENTION_SHARED table lock
+    LockMode mode = trx->table_locks[table_id]->lock_mode == LockMode::INTENTION_SHARED
+        ? LockMode::SHARED : LockMode::EXCLUSIVE;
+
+    if (convert_table_lock(trx, table_id, mode, guard, false) != SUCCESS){
+        return;
+    }
+
+    // The table lock covers every record lock of trx in the table now
+    lock_guard<mutex> trx_guard(trx->trx_mutex);
+
+    auto iter = trx->acquired_locks.begin();
+    while (iter != trx->acquired_locks.end()){
+        Lock * lock = *iter;
+        if (!lock->is_table_lock && lock->table_id == table_id){
+            remove_lock(lock);
+            delete lock;
+            trx->acquired_locks.erase(iter++);
+        }
+        else {
+            iter++;
+        }
+    }
+
+    trx->num_record_locks[table_id] = 0;
+}
+
+int LockManager::acquire(Transaction * trx, int table_id, Pagenum_t page_num, keyval_t key, LockMode mode){
+
+    unique_lock<mutex> guard(lock_manager_mutex);
+
+    // A table lock may cover the record already
+    Lock * table_lock = trx->table_locks[table_id];
+    if (table_lock != nullptr && covers(table_lock->lock_mode, mode)){
+        return SUCCESS;
+    }
+
+    LockMode intention = mode == LockMode::SHARED ? LockMode::INTENTION_SHARED : LockMode::INTENTION_EXCLUSIVE;
+    if (convert_table_lock(trx, table_id, intention, guard, true) != SUCCESS){
+        return FAILURE;
+    }
+
+    auto iter = lock_table.find(make_pair(table_id, key));
+
+    // The transaction may already hold a strong enough lock
+    if (iter != lock_table.end()){
+        for (Lock * lock = iter->second.first; lock != nullptr; lock = lock->next){
+            if (lock->trx == trx && lock->acquired && covers(lock->lock_mode, mode)){
+                return SUCCESS;
+            }
+        }
+    }
+
+    if (grant(trx, new Lock(table_id, page_num, key, mode, trx), guard, true) != SUCCESS){
+        return FAILURE;
+    }
+
+    escalate(trx, table_id, guard);
+
+    return SUCCESS;
+}
+
+int LockManager::acquire_table(Transaction * trx, int table_id, LockMode mode){
+
+    unique_lock<mutex> guard(lock_manager_mutex);
+
+    return convert_table_lock(trx, table_id, mode, guard, true);
+}
+
+void LockManager::get_stat(Transaction * trx, LockStat * stat){
+
+    lock_guard<mutex> guard(lock_manager_mutex);
+
+    *stat = trx == nullptr ? global_stat : trx->lock_stat;
+}
+
+void LockManager::print_status(){
+
+    LockStat stat;
+    get_stat(nullptr, &stat);
+
+    printf("<Lock manager status> ");
+    printf("Acquired: %lu / ", stat.num_acquired);
+    printf("Waits: %lu / ", stat.num_waits);
+    printf("Average wait: %.1f us / ", stat.num_waits ? stat.total_wait_ns / 1000.0 / stat.num_waits : 0.0);
+    printf("Longest wait: %.1f us / ", stat.max_wait_ns / 1000.0);
+    printf("Deadlocks: %lu / ", stat.num_deadlocks);
+    printf("Timeouts: %lu\n", stat.num_timeouts);
+}
+
+void LockManager::release_all(Transaction * trx){
+
+    lock_guard<mutex> guard(lock_manager_mutex);
+    lock_guard<mutex> trx_guard(trx->trx_mutex);
+
+    for (Lock * lock : trx->acquired_locks){
+        remove_lock(lock);
+    }
+
+    memset(trx->table_locks, 0, sizeof(trx->table_locks));
+    memset(trx->num_record_locks, 0, sizeof(trx->num_record_locks));
+}
+
 int begin_trx(){
+    return begin_trx(TrxMode::LOCKING);
+}
+
+// Start a transaction in the given mode, at the given isolation level if it is LOCKING
+static int start_trx(TrxMode mode, IsolationLevel isolation){
 
     Transaction * trx = trx_manager->add_new_trx();
-    
+
     int trx_id = trx->trx_id;
+    trx->mode = mode;
+    trx->isolation = isolation;
 
-    return SUCCESS;
+    // A snapshot transaction never writes, so it needs no log records
+    if (mode == TrxMode::SNAPSHOT){
+        trx->snapshot_ts = version_store->begin_snapshot();
+    }
+    // An optimistic transaction logs BEGIN once it applies its writes
+    else if (mode == TrxMode::OPTIMISTIC){
+        record_versions->begin_reader();
+    }
+    else {
+        trx->last_lsn = log_trx_record(trx_id, LogType::BEGIN, NO_LSN);
+        if (trx->last_lsn == NO_LSN){
+            trx_manager->clear_trx(trx_id);
+            return 0;
+        }
+    }
+
+    return trx_id;
+}
+
+EarlyReleaseTable::EarlyReleaseTable() : num_entries(0) {}
+
+EarlyReleaseTable::Stripe & EarlyReleaseTable::stripe_of(int table_id, keyval_t key){
+    return stripes[RIDHasher()(make_pair(table_id, key)) % EARLY_RELEASE_STRIPES];
+}
+
+void EarlyReleaseTable::prune(){
+
+    lsn_t flushed_lsn = log_manager->get_flushed_lsn();
+
+    for (Stripe & stripe : stripes){
+        lock_guard<mutex> guard(stripe.latch);
+
+        auto iter = stripe.entries.begin();
+        while (iter != stripe.entries.end()){
+            if (iter->second < flushed_lsn){
+                iter = stripe.entries.erase(iter);
+                num_entries--;
+            }
+            else {
+                iter++;
+            }
+        }
+    }
+}
+
+void EarlyReleaseTable::release(Transaction * trx, lsn_t commit_lsn){
+
+    for (UndoLog & undo : trx->undo_log_list){
+
+        Stripe & stripe = stripe_of(undo.table_id, undo.key);
+        lock_guard<mutex> guard(stripe.latch);
+
+        auto result = stripe.entries.emplace(make_pair(undo.table_id, undo.key), commit_lsn);
+        if (result.second){
+            num_entries++;
+        }
+        else {
+            result.first->second = max(result.first->second, commit_lsn);
+        }
+    }
+
+    if (num_entries >= EARLY_RELEASE_PRUNE_THRESHOLD){
+        prune();
+    }
+}
+
+lsn_t EarlyReleaseTable::depends_on(int table_id, keyval_t key){
+
+    if (num_entries == 0){
+        return NO_LSN;
+    }
+
+    Stripe & stripe = stripe_of(table_id, key);
+    lock_guard<mutex> guard(stripe.latch);
+
+    auto iter = stripe.entries.find(make_pair(table_id, key));
+    return iter == stripe.entries.end() ? NO_LSN : iter->second;
+}
+
+int begin_trx(TrxMode mode){
+    return start_trx(mode, IsolationLevel::REPEATABLE_READ);
+}
+
+int begin_trx(IsolationLevel isolation){
+    return start_trx(TrxMode::LOCKING, isolation);
+}
+
+// Clear the writer marks of trx on the records it may have changed
+static void unmark_records(Transaction * trx, bool changed){
+
+    if (trx->mode == TrxMode::OPTIMISTIC){
+        for (auto & write : trx->write_set){
+            record_versions->unlock(trx->trx_id, write.first.first, write.first.second, changed);
+        }
+    }
+    else {
+        for (UndoLog & undo : trx->undo_log_list){
+            record_versions->unlock(trx->trx_id, undo.table_id, undo.key, changed);
+        }
+    }
+}
+
+// Find the leaf that may hold key and lock the record for trx in the given mode
+// Return the page number of the leaf, or KEY_DO_NOT_EXISTS if there is no leaf or the lock would deadlock
+static Pagenum_t lock_record(Transaction * trx, int table_id, keyval_t key, LockMode mode){
+
+    BufferBlock_t * header_frame = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
+    Pagenum_t root_page_num = header_frame->frame.header_page.root_page_num;
+    buffer_unpin_page(header_frame, 1);
+
+    Pagenum_t page_num = find_leaf(table_id, root_page_num, key, false);
+
+    if (page_num == KEY_DO_NOT_EXISTS || lock_manager->acquire(trx, table_id, page_num, key, mode) != SUCCESS){
+        return KEY_DO_NOT_EXISTS;
+    }
+    return page_num;
+}
+
+// Overwrite the value of key for trx under an exclusive lock, keeping what is needed to undo it
+// Return SUCCESS, or FAILURE if the key doesn't exist or the lock would deadlock
+static int update_record(Transaction * trx, int table_id, keyval_t key, const char * values){
+
+    // The update could not be logged
+    if (log_failed()){
+        return FAILURE;
+    }
+
+    Pagenum_t page_num = lock_record(trx, table_id, key, LockMode::EXCLUSIVE);
+    if (page_num == KEY_DO_NOT_EXISTS){
+        return FAILURE;
+    }
+
+    // The leaf may have split since it was locked, so it is looked up again
+    BufferBlock_t * node_page_frame = find_leaf_frame(table_id, key, true);
+    if (node_page_frame == nullptr){
+        return FAILURE;
+    }
+
+    Page_t page = node_page_frame->frame;
+    int i, result;
+
+    for (i = 0; i < page.node_page.num_key; i++)
+        if (page.node_page.lf_record[i].key == key) break;
+    if (i == page.node_page.num_key) {
+        result = FAILURE;
+    }
+    else {
+        LeafRecord & record = page.node_page.lf_record[i];
+        lsn_t prev_lsn = trx->last_lsn;
+
+        trx->undo_log_list.emplace_back(table_id, key, record.value, prev_lsn);
+        version_store->save_version(trx->trx_id, table_id, key, record.value);
+
+        // Optimistic readers must not trust the record until trx ends
+        record_versions->lock(trx->trx_id, table_id, key);
+        strcpy(record.value, values);
+
+        LogScope scope(trx->trx_id, LogType::UPDATE, &trx->last_lsn, key);
+        buffer_write_page(node_page_frame, page);
+        buffer_unpin_page(node_page_frame, 1);
+        result = SUCCESS;
+    }
+
+    node_page_frame->latch.unlock();
+    buffer_unpin_page(node_page_frame, 1);
+
+    return result;
+}
+
+// Publish the commit of trx, whose commit record was appended at commit_lsn, and release its locks
+// Return SUCCESS once the commit of trx, if it wrote anything, and every commit it depends on are durable,
+// or FAILURE if the log could not make them durable
+static int finish_commit(Transaction * trx, lsn_t commit_lsn){
+
+    int result = SUCCESS;
+
+    bool wrote = !trx->undo_log_list.empty();
+    lsn_t durable_lsn = wrote ? commit_lsn : trx->depends_lsn;
+
+    // Without early lock release, the locks are held until the commit record is durable
+    if (!early_lock_release && durable_lsn != NO_LSN){
+        result = log_manager->flush(durable_lsn);
+    }
+    else if (wrote){
+        early_releases->release(trx, commit_lsn);
+    }
+
+    // New snapshots see the updates from now on
+    version_store->commit(trx);
+    unmark_records(trx, true);
+    trx->unlock_all();
+
+    // The group commit thread syncs the commit records of many transactions at once,
+    // while the transactions that waited for these locks run
+    if (early_lock_release && durable_lsn != NO_LSN){
+        result = log_manager->flush(durable_lsn);
+    }
+
+    return result;
+}
+
+// Validation and write phase of an optimistic transaction
+// Return SUCCESS if it committed durably, otherwise abort it (or, if only the log failed, leave it
+// committed but not durable) and return FAILURE
+static int commit_optimistic(Transaction * trx){
+
+    int trx_id = trx->trx_id;
+    lsn_t commit_lsn = NO_LSN;
+
+    // The write set is locked in key order, so optimistic transactions never deadlock
+    // with each other. From here on no other transaction can change those records.
+    for (auto & write : trx->write_set){
+        if (lock_record(trx, write.first.first, write.first.second, LockMode::EXCLUSIVE) == KEY_DO_NOT_EXISTS){
+            abort_trx(trx);
+            return FAILURE;
+        }
+        record_versions->lock(trx_id, write.first.first, write.first.second);
+    }
+
+    if (!record_versions->validate(trx_id, trx->read_set)){
+        abort_trx(trx);
+        return FAILURE;
+    }
+
+    if (!trx->write_set.empty()){
+
+        trx->last_lsn = log_trx_record(trx_id, LogType::BEGIN, NO_LSN);
+        if (trx->last_lsn == NO_LSN){
+            abort_trx(trx);
+            return FAILURE;
+        }
+
+        for (auto & write : trx->write_set){
+            if (update_record(trx, write.first.first, write.first.second, write.second.c_str()) != SUCCESS){
+                abort_trx(trx);
+                return FAILURE;
+            }
+        }
+
+        commit_lsn = log_trx_record(trx_id, LogType::COMMIT, trx->last_lsn);
+        if (commit_lsn == NO_LSN){
+            abort_trx(trx);
+            return FAILURE;
+        }
+    }
+
+    int result = finish_commit(trx, commit_lsn);
+    record_versions->end_reader();
+    trx_manager->clear_trx(trx_id);
+
+    return result;
 }
 
 int end_trx(int tid){
 
-    if (trx_manager->clear_trx(tid)){
-        return tid;
+    Transaction * trx = trx_manager->get_trx(tid);
+
+    if (trx == nullptr){
+        return 0;
     }
-    return SUCCESS;
+
+    if (trx->mode == TrxMode::SNAPSHOT){
+        version_store->end_snapshot(trx->snapshot_ts);
+
+        // The snapshot may hold commits that are not durable yet
+        int result = SUCCESS;
+        if (trx->depends_lsn != NO_LSN){
+            result = log_manager->flush(trx->depends_lsn);
+        }
+        trx_manager->clear_trx(tid);
+        return result == SUCCESS ? tid : 0;
+    }
+
+    if (trx->mode == TrxMode::OPTIMISTIC){
+        return commit_optimistic(trx) == SUCCESS ? tid : 0;
+    }
+
+    // Without a commit record the transaction can only roll back
+    lsn_t commit_lsn = log_trx_record(tid, LogType::COMMIT, trx->last_lsn);
+    if (commit_lsn == NO_LSN){
+        abort_trx(trx);
+        return 0;
+    }
+
+    int result = finish_commit(trx, commit_lsn);
+    trx_manager->clear_trx(tid);
+
+    return result == SUCCESS ? tid : 0;
 }
 
-int db_find(int table_id, keyval_t key, char* ret_val, int trx_id){
+int get_lock_stat(int trx_id, LockStat * stat){
 
-    while(trx_manager->current_id != trx_id){}
-    return db_find(table_id, key, ret_val);
+    if (trx_id == 0){
+        lock_manager->get_stat(nullptr, stat);
+        return SUCCESS;
+    }
+
+    return trx_manager->get_lock_stat(trx_id, stat) ? SUCCESS : FAILURE;
 }
 
-int db_update(int table_id, keyval_t key, char* values, int trx_id){
+void abort_trx(Transaction * trx){
+
+    if (trx->mode == TrxMode::SNAPSHOT){
+        version_store->end_snapshot(trx->snapshot_ts);
+        trx_manager->clear_trx(trx->trx_id);
+        return;
+    }
+
+    for (auto iter = trx->undo_log_list.rbegin(); iter != trx->undo_log_list.rend(); iter++){
+        LogScope undo_scope(trx->trx_id, LogType::COMPENSATE, &trx->last_lsn, iter->key, iter->prev_lsn);
+        undo_update(iter->table_id, iter->key, 0, iter->old_value, sizeof(iter->old_value));
+    }
+
+    // An optimistic transaction that never reached its write phase logged nothing
+    if (trx->last_lsn != NO_LSN){
+        trx->last_lsn = log_trx_record(trx->trx_id, LogType::ROLLBACK, trx->last_lsn);
+    }
 
-    while(trx_manager->current_id != trx_id){}
-    if(tables.in_use[table_id] == false){
+    version_store->abort(trx);
+    unmark_records(trx, !trx->undo_log_list.empty());
+
+    trx->unlock_all();
+
+    if (trx->mode == TrxMode::OPTIMISTIC){
+        record_versions->end_reader();
+    }
+    trx_manager->clear_trx(trx->trx_id);
+}
+
+int undo_update(int table_id, keyval_t key, int offset, const char * image, int length){
+
+    BufferBlock_t * node_page_frame = find_leaf_frame(table_id, key, true);
+    if (node_page_frame == nullptr){
+        return FAILURE;
+    }
+
+    Page_t page = node_page_frame->frame;
+    int i, result = FAILURE;
+
+    for (i = 0; i < page.node_page.num_key; i++)
+        if (page.node_page.lf_record[i].key == key) break;
+
+    if (i < page.node_page.num_key){
+        memcpy(page.node_page.lf_record[i].value + offset, image, length);
+        buffer_write_page(node_page_frame, page);
+        buffer_unpin_page(node_page_frame, 1);
+        result = SUCCESS;
+    }
+
+    node_page_frame->latch.unlock();
+    buffer_unpin_page(node_page_frame, 1);
+
+    return result;
+}
+
+int db_find(int table_id, keyval_t key, char* ret_val, int trx_id){
+
+    Transaction * trx = trx_manager->get_trx(trx_id);
+
+    if (trx == nullptr || table_id < 1 || table_id > MAX_TABLE_NUMBER || tables.in_use[table_id] == false){
+        return FAILURE;
+    }
+
+    // An optimistic transaction reads its own writes
+    if (trx->mode == TrxMode::OPTIMISTIC){
+        auto write = trx->write_set.find(make_pair(table_id, key));
+        if (write != trx->write_set.end()){
+            strcpy(ret_val, write->second.c_str());
+            return SUCCESS;
+        }
+    }
+
+    // Reading an absent key aborts, like it does after a descent
+    if (!bloom_may_contain(table_id, key)){
+        abort_trx(trx);
         return FAILURE;
     }
 
     BufferBlock_t * header_frame, * node_page_frame;
-    HeaderPage_t header;
 
     header_frame = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
-    header = header_frame->frame.header_page;
+    Pagenum_t root_page_num = header_frame->frame.header_page.root_page_num;
+    buffer_unpin_page(header_frame, 1);
 
     int i = 0, result;
-    Pagenum_t page_num = find_leaf( table_id, header.root_page_num, key, false );
-    NodePage_t node_page;
-    Record_t new_record;
+    Pagenum_t page_num = find_leaf( table_id, root_page_num, key, false );
 
-    if (page_num == KEY_DO_NOT_EXISTS){
+    // Snapshot, optimistic and read-committed transactions read without locks, and never wait for writers
+    bool read_locked = trx->mode == TrxMode::LOCKING && trx->isolation == IsolationLevel::REPEATABLE_READ;
+
+    if (page_num == KEY_DO_NOT_EXISTS || (read_locked
+        && lock_manager->acquire(trx, table_id, page_num, key, LockMode::SHARED) != SUCCESS)){
+        abort_trx(trx);
+        return FAILURE;
+    }
+
+    node_page_frame = find_leaf_frame(table_id, key, false);
+    if (node_page_frame == nullptr){
+        abort_trx(trx);
         return FAILURE;
     }
 
-    node_page_frame = buffer_read_page(table_id, page_num);
-    node_page = PAGE_CONTENTS(node_page_frame);
+    NodePage_t & node_page = PAGE_CONTENTS(node_page_frame);
 
     for (i = 0; i < node_page.num_key; i++)
         if (node_page.lf_record[i].key == key) break;
     if (i == node_page.num_key) {
         result = FAILURE;
     }
+    else if (trx->mode == TrxMode::SNAPSHOT) {
+        version_store->read_version(table_id, key, trx->snapshot_ts, node_page.lf_record[i].value, ret_val);
+        result = SUCCESS;
+    }
+    else if (!read_locked && trx->mode == TrxMode::LOCKING) {
+        version_store->read_committed(table_id, key, trx->trx_id, node_page.lf_record[i].value, ret_val);
+        result = SUCCESS;
+    }
+    else if (trx->mode == TrxMode::OPTIMISTIC) {
+        // Writers mark the record before changing the page, so under the page latch
+        // an unmarked record holds the committed value of its version
+        RecordVersion version = record_versions->read(table_id, key);
+
+        if (version.writer != 0){
+            result = FAILURE;
+        }
+        else {
+            strcpy(ret_val, node_page.lf_record[i].value);
+            trx->read_set.emplace(make_pair(table_id, key), version.version);
+            result = SUCCESS;
+        }
+    }
     else {
-        strcpy(node_page.lf_record[i].value, values);
+        strcpy(ret_val, node_page.lf_record[i].value);
         result = SUCCESS;
     }
 
-    buffer_unpin_page(header_frame, 1);
+    node_page_frame->latch.unlock_shared();
     buffer_unpin_page(node_page_frame, 1);
 
+    if (result != SUCCESS){
+        abort_trx(trx);
+    }
+    else {
+        // The value may come from a commit that released its locks before it was durable
+        trx->depends_lsn = max(trx->depends_lsn, early_releases->depends_on(table_id, key));
+    }
+
     return result;
 }
 
+int db_update(int table_id, keyval_t key, char* values, int trx_id){
+
+    Transaction * trx = trx_manager->get_trx(trx_id);
+
+    if (trx == nullptr || table_id < 1 || table_id > MAX_TABLE_NUMBER || tables.in_use[table_id] == false){
+        return FAILURE;
+    }
+
+    // Snapshot transactions are read-only
+    if (trx->mode == TrxMode::SNAPSHOT){
+        abort_trx(trx);
+        return FAILURE;
+    }
+
+    int result = SUCCESS;
+
+    if (trx->mode == TrxMode::OPTIMISTIC){
+
+        // The write is buffered until end_trx, but the key has to exist now
+        if (trx->write_set.count(make_pair(table_id, key)) == 0){
+
+            BufferBlock_t * header_frame = buffer_read_page(table_id, HEADER_PAGE_NUMBER);
+            Pagenum_t root_page_num = header_frame->frame.header_page.root_page_num;
+            buffer_unpin_page(header_frame, 1);
+
+            if (find(table_id, root_page_num, key, false).is_null){
+                result = FAILURE;
+            }
+        }
+
+        if (result == SUCCESS){
+            trx->write_set[make_pair(table_id, key)] = string(values);
+        }
+    }
+    else {
+        result = update_record(trx, table_id, key, values);
+    }
+
+    if (result != SUCCESS){
+        abort_trx(trx);
+    }
+
+    return result;
+}
 
 // Allocate the buffer pool (array) with the given number of entries.
 // Initialize other fields such as state info, LRU info
 // If success, return 0. Otherwise, return non zero value.
 int init_db(int num_buf){
+    return init_db(num_buf, DEFAULT_LOG_PATH);
+}
 
-    int i;
+// Same as init_db(num_buf), but keeps the write-ahead log at log_path
+int init_db(int num_buf, const char * log_path){
+
+    int i, num_threads;
+    RecoveryStat stat;
 
     // Ignore when num_buf <= 0
     if( num_buf <= 0)
@@ -144,11 +1031,34 @@ int init_db(int num_buf){
         tables.pathname[i][0] = 0;
         tables.fd[i] = 0;
         tables.in_use[i] = false;
+        tables.subtree_counts[i] = false;
     }
 
+    log_manager = new LogManager(log_path, DEFAULT_LOG_BUFFER_SIZE);
     buffer = new Buffer(num_buf);
     trx_manager = new TransactionManager();
     lock_manager = new LockManager();
+    version_store = new VersionStore();
+    record_versions = new RecordVersionTable();
+    early_releases = new EarlyReleaseTable();
+
+    // Every redo worker pins one page at a time
+    num_threads = min((int)thread::hardware_concurrency(), MAX_REDO_THREADS);
+    num_threads = max(1, min(num_threads, num_buf / 2));
+
+    if (recover_db(num_threads, &stat) != SUCCESS){
+        return FAILURE;
+    }
+
+    checkpointer = new Checkpointer(DEFAULT_CHECKPOINT_INTERVAL_MS, DEFAULT_CHECKPOINT_INTERVAL_BYTES);
+
+    if (stat.num_redone > 0 || stat.num_losers > 0){
+        printf("Recovered from the log: %ld records, %ld redone by %d threads, %d unfinished operations rolled back (%ld records)\n",
+            stat.num_records, stat.num_redone, stat.num_threads, stat.num_losers, stat.num_undone);
+
+        // Nothing before this point is needed again
+        checkpointer->checkpoint();
+    }
 
     return SUCCESS;
 }
@@ -161,9 +1071,21 @@ int shutdown_db(void){
         close_table(i);
     }
 
+    // Every page is on the disk now, so the next start has nothing to recover
+    checkpointer->checkpoint();
+    delete checkpointer;
+    checkpointer = nullptr;
+
     delete buffer;
     delete trx_manager;
     delete lock_manager;
+    delete version_store;
+    delete record_versions;
+    delete early_releases;
+
+    // Every page has been written, so the remaining log records can be synced last
+    delete log_manager;
+    log_manager = nullptr;
 
     return SUCCESS;
-}
\ No newline at end of file
+}